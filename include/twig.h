@@ -26,21 +26,141 @@ typedef struct {
     uint32_t phys_addr, iommu_addr;
     size_t size;
     int ion_fd;
+    size_t fd_offset; // Where this buffer starts in ion_fd, non-zero for arena sub-allocations
 } twig_mem_t;
 
+#define TWIG_MEM_UNCACHED (1 << 0) // Write-combined, CPU writes go straight to memory and never need a flush
+
+#define TWIG_CPU_READ  (1 << 0) // Directions for twig_mem_begin/end_cpu_access, like DMA_BUF_SYNC_READ/WRITE
+#define TWIG_CPU_WRITE (1 << 1)
+
+typedef enum {
+    TWIG_OUTPUT_TILED, // The VE's own 32x32 tiled NV12 reconstruction, no second buffer (default)
+    TWIG_OUTPUT_NV12,  // Linear copies written by the VE alongside the reconstruction
+    TWIG_OUTPUT_NV21,
+    TWIG_OUTPUT_YV12
+} twig_output_format_t;
+
+typedef enum {
+    TWIG_ROTATE_0,
+    TWIG_ROTATE_90, // Clockwise
+    TWIG_ROTATE_180,
+    TWIG_ROTATE_270
+} twig_rotation_t;
+
+// Layout of a frame handed out by the decoder, offsets are from virt_addr/iommu_addr
+typedef struct {
+    twig_output_format_t format;
+    int width, height; // After scaling and rotation
+    int planes;
+    int stride[3];
+    size_t offset[3];
+    int scale_shift;   // Picture was scaled down by 1 << scale_shift
+    twig_rotation_t rotation;
+} twig_frame_info_t;
+
+// Per-stream scheduling and register traffic counters, see twig_h264_get_stream_stats
+typedef struct {
+    uint64_t decoded;  // Access units that went through the VE
+    uint64_t dropped;  // Non-reference pictures skipped because their deadline couldn't be met anymore
+    uint64_t late;     // Decoded anyway (reference pictures, mostly) but finished past their deadline
+    uint64_t mmio_issued; // Register and SRAM writes that went out to the VE for this stream
+    uint64_t mmio_elided; // Ones skipped because the VE already held that value
+} twig_stream_stats_t;
+
+// Where decode time goes, see twig_h264_get_stats. Only collected with TWIG_ENABLE_STATS (the default)
+typedef enum {
+    TWIG_STAGE_DECODE,    // A whole access unit on the service thread, start to finish
+    TWIG_STAGE_NAL_SCAN,  // Finding the NAL units in an access unit
+    TWIG_STAGE_PARSE,     // SPS/PPS/slice headers through the bitreader
+    TWIG_STAGE_REF_LISTS, // Building reference picture lists
+    TWIG_STAGE_REG_WRITE, // Writing a slice's registers out to the VE and triggering it
+    TWIG_STAGE_VE_WAIT,   // Waiting for the VE interrupt
+    TWIG_STAGE_COUNT
+} twig_stage_t;
+
+#define TWIG_STATS_BUCKETS 32 // hist[i] counts durations of 2^i to 2^(i+1) - 1 ns, the last bucket everything longer
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns; // CLOCK_MONOTONIC
+    uint64_t hist[TWIG_STATS_BUCKETS];
+} twig_stage_stats_t;
+
+// Device-wide, every decoder on the device adds to the same counters
+typedef struct {
+    twig_stage_stats_t stages[TWIG_STAGE_COUNT];
+    uint64_t mmio_reads;
+    uint64_t mmio_writes;
+    uint64_t vld_starts;   // Bitreader (VLD) restarts on slice data, and refills after a ring wrap
+    uint64_t ve_waits;
+    uint64_t slices;
+    uint64_t frames;
+    uint64_t allocs;       // Buffers from twig_alloc_mem*, arena or not
+    uint64_t bytes_in_use; // What those hold right now
+} twig_stats_t;
+
+// Binary trace events, see twig_h264_get_trace. Only recorded in builds with TWIG_LOG_LEVEL 5 (trace)
+typedef enum {
+    TWIG_TRACE_SUBMIT = 1, // arg0: submission number, arg1: bytes
+    TWIG_TRACE_PARAMS,     // arg0: NAL type (7 SPS, 8 PPS), arg1: offset in the access unit
+    TWIG_TRACE_DECODE,     // arg0: submission number, arg1: 1 if it was dropped instead
+    TWIG_TRACE_VE_SWITCH,  // Another decoder had the VE, state gets loaded again
+    TWIG_TRACE_SLICE,      // arg0: slice in the picture, arg1: register writes in its command list
+    TWIG_TRACE_SLICE_DONE, // arg0: slice in the picture, arg1: 0 or the VE wait's error
+    TWIG_TRACE_FRAME       // arg0: POC, arg1: framebuffer slot
+} twig_trace_event_id_t;
+
+typedef struct {
+    uint64_t seq;     // Position in the decoder's trace, gaps mean events were overwritten before the dump
+    uint64_t time_ns; // CLOCK_MONOTONIC
+    uint32_t event;   // twig_trace_event_id_t
+    uint32_t arg0, arg1;
+} twig_trace_event_t;
+
 typedef struct twig_dev_t twig_dev_t;
 typedef struct twig_h264_decoder_t twig_h264_decoder_t;
 
 twig_dev_t *twig_open(void);    
+twig_dev_t *twig_open_backend(const char *name);
 void twig_close(twig_dev_t *cedar);
 
+int twig_sim_set_latency(twig_dev_t *cedar, unsigned int decode_us, unsigned int bits_us);
+
 twig_mem_t *twig_alloc_mem(twig_dev_t *cedar, size_t size);
+twig_mem_t *twig_alloc_mem_flags(twig_dev_t *cedar, size_t size, unsigned int flags);
 void twig_flush_mem(twig_mem_t *mem);
+void twig_flush_range(twig_mem_t *mem, size_t offset, size_t len);
+int twig_mem_begin_cpu_access(twig_mem_t *mem, unsigned int dir, size_t offset, size_t len);
+int twig_mem_end_cpu_access(twig_mem_t *mem, unsigned int dir, size_t offset, size_t len);
 void twig_free_mem(twig_dev_t *cedar, twig_mem_t *mem);
+int twig_enable_arena(twig_dev_t *cedar, size_t chunk_size);
+twig_mem_t *twig_import_dmabuf(twig_dev_t *cedar, int fd, size_t size);
+void *twig_map_mem(twig_mem_t *mem);
 
 twig_h264_decoder_t *twig_h264_decoder_init(twig_dev_t *cedar);
+int twig_h264_decoder_set_pool_hint(twig_h264_decoder_t *decoder, int app_hold_frames);
+int twig_h264_decoder_set_ring_size(twig_h264_decoder_t *decoder, size_t size);
+int twig_h264_decoder_set_weight(twig_h264_decoder_t *decoder, int weight);
+int twig_h264_decoder_set_target_fps(twig_h264_decoder_t *decoder, int fps);
+int twig_h264_decoder_use_external_frames(twig_h264_decoder_t *decoder, twig_mem_t **buffers, int count);
+int twig_h264_decoder_set_output_format(twig_h264_decoder_t *decoder, twig_output_format_t format);
+int twig_h264_decoder_set_output_transform(twig_h264_decoder_t *decoder, int scale_shift, twig_rotation_t rotation, int keep_full);
 twig_mem_t *twig_h264_decode_frame(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf);
+int twig_h264_submit(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf, size_t len);
+int twig_h264_submit_deadline(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf, size_t len, uint64_t deadline_ns);
+void *twig_h264_ring_reserve(twig_h264_decoder_t *decoder, size_t len);
+int twig_h264_ring_commit(twig_h264_decoder_t *decoder, size_t len);
+int twig_h264_poll(twig_h264_decoder_t *decoder, twig_mem_t **output_buf);
+int twig_h264_get_fd(twig_h264_decoder_t *decoder);
+int twig_h264_get_pending(twig_h264_decoder_t *decoder);
+int twig_h264_get_stream_stats(twig_h264_decoder_t *decoder, twig_stream_stats_t *stats);
+int twig_h264_get_stats(twig_h264_decoder_t *decoder, twig_stats_t *stats);
+int twig_h264_get_trace(twig_h264_decoder_t *decoder, twig_trace_event_t *events, int max_events);
+twig_mem_t *twig_h264_flush(twig_h264_decoder_t *decoder);
 int twig_h264_get_frame_res(twig_h264_decoder_t *decoder, int *width, int *height);
+int twig_h264_get_frame_info(twig_h264_decoder_t *decoder, twig_mem_t *output_buf, twig_frame_info_t *info);
+twig_mem_t *twig_h264_get_secondary(twig_h264_decoder_t *decoder, twig_mem_t *output_buf, twig_frame_info_t *info);
 void twig_h264_return_frame(twig_h264_decoder_t *decoder, twig_mem_t *output_buf);
 void twig_h264_decoder_destroy(twig_h264_decoder_t* decoder);
 
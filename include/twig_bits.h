@@ -2,7 +2,7 @@
  * libtwig - A streamlined CedarX variant library
  * Pruned for H.264 decoding with easy-to-use buffers
  * 
- * Supplemental hardware bitreader functions
+ * Supplemental software RBSP bitreader functions
  *
  * Garbage code by Noxwell(Beebono)
  * Based on CedarX framework by Allwinner Technology Co. Ltd.
@@ -11,53 +11,212 @@
 #ifndef TWIG_BITS_H_
 #define TWIG_BITS_H_
 
-#include "twig_regs.h"
-
-static uint32_t twig_get_bits(void *regs, int num) {
-    twig_writel(regs, H264_TRIGGER, (2 << 0)| (num << 8));
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const uint8_t *data; // Raw NAL payload (after the header byte), emulation prevention bytes included
+    size_t size;
+    size_t raw_pos;      // Next raw byte to be pulled into the cache
+    uint64_t cache;      // Unread RBSP bits, MSB first
+    int cache_bits;
+    int zeros;           // Run of zero bytes pulled so far, for 0x000003 detection
+    size_t bits_read;    // RBSP bits consumed, emulation prevention bytes excluded
+    int overrun;         // Set if anything tried to read past the end of the NAL
+} twig_bits_t;
+
+typedef struct {
+    uint8_t len;
+    uint8_t value;
+} twig_golomb_t;
+
+// ue(v) codes of up to 9 bits, indexed by the next 9 bits of the stream. len == 0 means "longer than that".
+static const twig_golomb_t twig_ue_table[512] = {
+    { 0,  0 }, { 0,  0 }, { 0,  0 }, { 0,  0 }, { 0,  0 }, { 0,  0 }, { 0,  0 }, { 0,  0 },
+    { 0,  0 }, { 0,  0 }, { 0,  0 }, { 0,  0 }, { 0,  0 }, { 0,  0 }, { 0,  0 }, { 0,  0 },
+    { 9, 15 }, { 9, 16 }, { 9, 17 }, { 9, 18 }, { 9, 19 }, { 9, 20 }, { 9, 21 }, { 9, 22 },
+    { 9, 23 }, { 9, 24 }, { 9, 25 }, { 9, 26 }, { 9, 27 }, { 9, 28 }, { 9, 29 }, { 9, 30 },
+    { 7,  7 }, { 7,  7 }, { 7,  7 }, { 7,  7 }, { 7,  8 }, { 7,  8 }, { 7,  8 }, { 7,  8 },
+    { 7,  9 }, { 7,  9 }, { 7,  9 }, { 7,  9 }, { 7, 10 }, { 7, 10 }, { 7, 10 }, { 7, 10 },
+    { 7, 11 }, { 7, 11 }, { 7, 11 }, { 7, 11 }, { 7, 12 }, { 7, 12 }, { 7, 12 }, { 7, 12 },
+    { 7, 13 }, { 7, 13 }, { 7, 13 }, { 7, 13 }, { 7, 14 }, { 7, 14 }, { 7, 14 }, { 7, 14 },
+    { 5,  3 }, { 5,  3 }, { 5,  3 }, { 5,  3 }, { 5,  3 }, { 5,  3 }, { 5,  3 }, { 5,  3 },
+    { 5,  3 }, { 5,  3 }, { 5,  3 }, { 5,  3 }, { 5,  3 }, { 5,  3 }, { 5,  3 }, { 5,  3 },
+    { 5,  4 }, { 5,  4 }, { 5,  4 }, { 5,  4 }, { 5,  4 }, { 5,  4 }, { 5,  4 }, { 5,  4 },
+    { 5,  4 }, { 5,  4 }, { 5,  4 }, { 5,  4 }, { 5,  4 }, { 5,  4 }, { 5,  4 }, { 5,  4 },
+    { 5,  5 }, { 5,  5 }, { 5,  5 }, { 5,  5 }, { 5,  5 }, { 5,  5 }, { 5,  5 }, { 5,  5 },
+    { 5,  5 }, { 5,  5 }, { 5,  5 }, { 5,  5 }, { 5,  5 }, { 5,  5 }, { 5,  5 }, { 5,  5 },
+    { 5,  6 }, { 5,  6 }, { 5,  6 }, { 5,  6 }, { 5,  6 }, { 5,  6 }, { 5,  6 }, { 5,  6 },
+    { 5,  6 }, { 5,  6 }, { 5,  6 }, { 5,  6 }, { 5,  6 }, { 5,  6 }, { 5,  6 }, { 5,  6 },
+    { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 },
+    { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 },
+    { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 },
+    { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 },
+    { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 },
+    { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 },
+    { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 },
+    { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 }, { 3,  1 },
+    { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 },
+    { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 },
+    { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 },
+    { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 },
+    { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 },
+    { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 },
+    { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 },
+    { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 }, { 3,  2 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+    { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 }, { 1,  0 },
+};
+
+static inline void twig_bits_init(twig_bits_t *bits, const uint8_t *data, size_t size) {
+    bits->data = data;
+    bits->size = size;
+    bits->raw_pos = 0;
+    bits->cache = 0;
+    bits->cache_bits = 0;
+    bits->zeros = 0;
+    bits->bits_read = 0;
+    bits->overrun = 0;
+}
 
-    while (twig_readl(regs, H264_STATUS) & (1 << 8))
-        usleep(1);
+static inline void twig_bits_refill(twig_bits_t *bits) {
+    while (bits->cache_bits <= 56 && bits->raw_pos < bits->size) {
+        uint8_t byte = bits->data[bits->raw_pos++];
+        if (bits->zeros >= 2 && byte == 0x03) { // Emulation prevention byte, not part of the RBSP
+            bits->zeros = 0;
+            continue;
+        }
+        bits->zeros = byte ? 0 : bits->zeros + 1;
+        bits->cache |= (uint64_t)byte << (56 - bits->cache_bits);
+        bits->cache_bits += 8;
+    }
+}
 
-    return twig_readl(regs, H264_BASIC_BITS);
+static inline void twig_bits_consume(twig_bits_t *bits, int num) {
+    bits->cache <<= num;
+    bits->cache_bits -= num;
+    bits->bits_read += num;
 }
 
-static uint32_t twig_get_1bit(void *regs) {
-    return twig_get_bits(regs, 1);
+static inline uint32_t twig_get_bits(twig_bits_t *bits, int num) {
+    if (num <= 0)
+        return 0;
+
+    if (bits->cache_bits < num) {
+        twig_bits_refill(bits);
+        if (bits->cache_bits < num) { // Out of data, the cache is zero-padded so just pretend
+            bits->overrun = 1;
+            bits->cache_bits = num;
+        }
+    }
+
+    uint32_t value = bits->cache >> (64 - num);
+    twig_bits_consume(bits, num);
+    return value;
 }
 
-static void twig_skip_bits(void *regs, int num) {
-	int count = 0;
-	while (count < num) {
-		int tmp = (num - count <= 32) ? num - count : 32;
-		twig_writel(regs, H264_TRIGGER, (3 << 0) | (tmp << 8));
-		while (twig_readl(regs, H264_STATUS) & (1 << 8))
-			usleep(1);
+static inline uint32_t twig_get_1bit(twig_bits_t *bits) {
+    return twig_get_bits(bits, 1);
+}
 
-		count += tmp;
-	}   
+static inline void twig_skip_bits(twig_bits_t *bits, int num) {
+    while (num > 0) {
+        int tmp = (num <= 32) ? num : 32;
+        twig_get_bits(bits, tmp);
+        num -= tmp;
+    }
 }
 
-static void twig_skip_1bit(void *regs) {
-    twig_skip_bits(regs, 1);
+static inline void twig_skip_1bit(twig_bits_t *bits) {
+    twig_get_bits(bits, 1);
 }
 
-static int32_t twig_get_se(void *regs) {
-    twig_writel(regs, H264_TRIGGER, (4 << 0));
+static inline uint32_t twig_get_ue(twig_bits_t *bits) {
+    if (bits->cache_bits < 32)
+        twig_bits_refill(bits);
 
-    while (twig_readl(regs, H264_STATUS) & (1 << 8))
-        usleep(1);
+    const twig_golomb_t *code = &twig_ue_table[bits->cache >> (64 - 9)];
+    if (code->len && code->len <= bits->cache_bits) { // Short code, one lookup and done
+        twig_bits_consume(bits, code->len);
+        return code->value;
+    }
 
-    return twig_readl(regs, H264_BASIC_BITS);
+    int leading_zeros = bits->cache ? __builtin_clzll(bits->cache) : 64;
+    if (leading_zeros > 31) { // Not a valid ue(v) in anything we parse, stream is probably broken
+        bits->overrun = 1;
+        return 0;
+    }
+
+    twig_skip_bits(bits, leading_zeros);
+    return twig_get_bits(bits, leading_zeros + 1) - 1;
+}
+
+static inline int32_t twig_get_se(twig_bits_t *bits) {
+    uint32_t code = twig_get_ue(bits);
+    return (code & 1) ? (int32_t)((code + 1) >> 1) : -(int32_t)(code >> 1);
 }
 
-static uint32_t twig_get_ue(void *regs) {
-    twig_writel(regs, H264_TRIGGER, (5 << 0));
+// Position of the next unread bit within the raw (escaped) NAL data, which is what the VLD wants
+static inline size_t twig_bits_raw_offset(const twig_bits_t *bits) {
+    size_t rbsp_bytes = bits->bits_read >> 3;
+    size_t raw = 0, count = 0;
+    int zeros = 0;
+    while (raw < bits->size) {
+        uint8_t byte = bits->data[raw];
+        if (zeros >= 2 && byte == 0x03) {
+            zeros = 0;
+            raw++;
+            continue;
+        }
+        if (count == rbsp_bytes)
+            break;
+
+        zeros = byte ? 0 : zeros + 1;
+        raw++;
+        count++;
+    }
+    return raw * 8 + (bits->bits_read & 7);
+}
 
-    while (twig_readl(regs, H264_STATUS) & (1 << 8))
-     usleep(1);
+static inline int twig_bits_more_rbsp_data(const twig_bits_t *bits) {
+    size_t last = bits->size;
+    while (last > 0 && bits->data[last - 1] == 0x00) // Trailing zero bytes don't count
+        last--;
+    if (last == 0)
+        return 0;
 
-    return twig_readl(regs, H264_BASIC_BITS);
+    size_t stop_bit = last * 8 - 1 - __builtin_ctz(bits->data[last - 1]); // rbsp_stop_one_bit
+    return twig_bits_raw_offset(bits) < stop_bit;
 }
 
 #endif // TWIG_BITS_H_
\ No newline at end of file
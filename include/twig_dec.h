@@ -11,12 +11,22 @@
 #ifndef TWIG_DEC_H_
 #define TWIG_DEC_H_
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include "twig_log.h"
+
 #define NAL_SPS 7
 #define NAL_PPS 8
 #define NAL_IDR_SLICE 5
 #define NAL_SLICE 1
 
-#define MAX_FRAME_POOL_SIZE 20
+#define MAX_FRAME_POOL_SIZE 32
+#define TWIG_FRAMEBUFFER_SLOTS 18 // Entries in the VE's framebuffer list SRAM, references + the current picture
+#define TWIG_DEFAULT_APP_HOLD 2 // Frames the app is assumed to hold at once unless it says otherwise
+#define TWIG_MAX_NALS 256
+#define TWIG_MAX_PENDING 8
+#define TWIG_DEFAULT_RING_SIZE (4 * 1024 * 1024) // Submitted + decoding access units
+#define TWIG_MAX_COMPLETIONS (TWIG_MAX_PENDING + MAX_FRAME_POOL_SIZE) // An IDR can push every pending frame out at once
 
 typedef enum {
     SLICE_TYPE_P,
@@ -35,21 +45,33 @@ typedef enum {
 typedef struct {
     twig_mem_t *buffer;
     twig_mem_t *extra_data;
+    twig_mem_t *output;            // Linear copy from the VE's secondary output, what the app gets instead of buffer unless keep_full
+    twig_frame_info_t tiled_info;  // Layouts of buffer and output as of the last decode into this frame
+    twig_frame_info_t output_info;
     twig_frame_state_t state;
     int frame_idx;
+    int slot; // Framebuffer list slot, only means anything while referenced or being decoded
     int frame_num;
     int poc;
     int is_reference;
     int is_long_term;
     int long_term_idx;
+    int needs_output; // Decoded, waiting for its turn in POC order
+    int external;     // buffer belongs to the app, the pool never allocates or frees it
 } twig_frame_t;
 
 typedef struct {
     twig_frame_t frames[MAX_FRAME_POOL_SIZE];
-    int allocated_count;
+    int allocated_count; // High-water mark, entries below it with no buffer are holes left by a resize
+    int external;        // Frames come from twig_h264_decoder_use_external_frames, nothing gets allocated beyond them
     int frame_width;
     int frame_height;
     size_t frame_size;
+    size_t extra_size;
+    twig_frame_info_t tiled_info;  // Reconstruction layout for the current geometry
+    twig_frame_info_t output_info; // Secondary output layout, format/scale_shift/rotation in here are the app's settings
+    size_t output_size;            // 0 while the output format is tiled
+    int keep_full;                 // App gets the full tiled frame, the secondary copy only through twig_h264_get_secondary
     twig_frame_t *short_refs[16];
     twig_frame_t *long_refs[16];
     int short_count;
@@ -57,10 +79,17 @@ typedef struct {
     int max_long_term_frame_idx;
     int prev_frame_num;
     int max_frame_num; 
+    int max_refs; // Sliding window size, max_num_ref_frames from the SPS
 } twig_frame_pool_t;
 
+// What the app sees of a frame, the linear copy if there is one and it's not just riding along
+static inline twig_mem_t *twig_frame_output(twig_frame_pool_t *pool, twig_frame_t *frame) {
+    return (frame->output && !pool->keep_full) ? frame->output : frame->buffer;
+}
+
 typedef struct {
     uint8_t profile_idc;
+    uint8_t constraint_set_flags;
     uint8_t level_idc;
     uint8_t chroma_format_idc;
     uint8_t bit_depth_luma_minus8;
@@ -86,6 +115,10 @@ typedef struct {
     uint8_t seq_scaling_list_present_flag[8];
     uint8_t scaling_list_4x4[6][16];
     uint8_t scaling_list_8x8[2][64];
+    uint8_t vui_parameters_present_flag;
+    uint8_t bitstream_restriction_flag;
+    uint8_t max_num_reorder_frames;  // Filled in from Table A-1 when the VUI doesn't have them
+    uint8_t max_dec_frame_buffering;
 } twig_h264_sps_t;
 
 typedef struct {
@@ -145,6 +178,7 @@ typedef struct {
     int8_t slice_alpha_c0_offset_div2;
     int8_t slice_beta_offset_div2;
     uint8_t first_slice_in_pic;
+    uint8_t no_output_of_prior_pics_flag;
     uint8_t long_term_reference_flag;
     uint32_t modification_of_pic_nums_idc[32];
     uint32_t abs_diff_pic_num_minus1[32];
@@ -155,12 +189,36 @@ typedef struct {
     int modification_count_l1;
 } twig_h264_hdr_t;
 
+#define TWIG_PRED_WEIGHT_WORDS (32 + 32 * 2 + 32 + 32 * 2) // Luma then chroma for list 0, the same again for list 1
+
+#define TWIG_SHADOW_REGS 64 // The whole H.264 block, 0x200 to 0x2ff
+#define TWIG_SHADOW_SRAM_WORDS ((0x800 + 2 * 64 + 6 * 16) / 4) // Pred weights up to the end of the scaling lists
+
+// Last values this decoder wrote to the H.264 registers and SRAM, writes that wouldn't change anything get skipped.
+// Only holds while nobody else had the VE in between, a switch throws it all away.
 typedef struct {
-    int prev_poc_msb;
-    int prev_poc_lsb;
-    int prev_frame_num;
-    int frame_num_offset;
-} twig_ref_state_t;
+    uint32_t regs[TWIG_SHADOW_REGS];
+    uint64_t regs_valid;
+    uint32_t sram[TWIG_SHADOW_SRAM_WORDS];
+    uint64_t sram_valid[(TWIG_SHADOW_SRAM_WORDS + 63) / 64];
+    uint64_t issued, elided; // MMIO writes that went out, and ones that didn't have to
+} twig_shadow_t;
+
+#define TWIG_CMD_LIST_SIZE 512 // Worst case for a first slice is around 440: framebuffer list, pred weights, scaling lists and the rest
+
+// One register write, offset from the VE base
+typedef struct {
+    uint32_t reg;
+    uint32_t value;
+} twig_cmd_t;
+
+// Register writes in the order the VE should see them. Built on the CPU while the VE is still busy, then written
+// out in one burst. What's left in it afterwards is exactly what the VE got, twig_cmd_list_apply can replay it.
+typedef struct {
+    int count;
+    int overflow; // Something didn't fit, the list is not what was meant to go out
+    twig_cmd_t cmds[TWIG_CMD_LIST_SIZE];
+} twig_cmd_list_t;
 
 typedef struct {
     int memory_management_control_operation;
@@ -170,41 +228,148 @@ typedef struct {
     int max_long_term_frame_idx_plus1;
 } twig_mmco_cmd_t;
 
+// Everything the VE needs for one slice, worked out on the CPU ahead of time so that happens while the slice
+// before it is still decoding. Nothing in here touches the hardware until twig_program_slice.
+typedef struct {
+    twig_h264_hdr_t hdr; // Its own, the next slice gets parsed while this one is still in the VE
+    twig_mmco_cmd_t mmco_commands[32];
+    int mmco_count;
+    int has_pred_weights;
+    uint32_t pred_weight; // H264_PRED_WEIGHT, log2 denominators
+    uint32_t pred_weight_table[TWIG_PRED_WEIGHT_WORDS]; // SRAM image
+    uint8_t nal_type, nal_ref_idc;
+    size_t data_bit_offset; // Where the slice data starts, in bits from the start of the access unit
+    size_t wrapped_bits;    // Slice data past the end of the ring, fed to the VLD once it asks
+    twig_cmd_list_t cmds;
+} twig_slice_t;
+
+typedef struct {
+    int prev_poc_msb;
+    int prev_poc_lsb;
+    int prev_frame_num;
+    int frame_num_offset;
+} twig_ref_state_t;
+
+typedef struct {
+    uint32_t offset; // NAL header byte, just past the start code
+    uint32_t size;   // Header + payload, up to the next start code
+    uint8_t type, ref_idc;
+} twig_nal_t;
+
+typedef struct {
+    twig_mem_t *buf;
+    size_t offset, len; // Only ring jobs start anywhere but 0, and only those may run past the end of buf
+    uint64_t seq;
+    uint64_t ring_end;  // Where the ring's tail moves once this is decoded, 0 for app buffers
+    uint64_t deadline;  // CLOCK_MONOTONIC ns it should be decoded by, 0 for none
+} twig_job_t;
+
+typedef struct {
+    twig_mem_t *mem;     // One allocation for the decoder's whole life
+    uint8_t *mirror;     // mem mapped twice back to back, so a span over the end reads straight through on the CPU
+    size_t size;
+    uint64_t head;         // Bytes committed since the start, only the producer touches it. Positions in mem are these % size
+    _Atomic uint64_t tail; // Bytes decoded, moved by the service thread
+} twig_ring_t;
+
+typedef struct {
+    twig_mem_t *frame; // NULL if an access unit failed to decode
+    uint64_t seq;
+} twig_completion_t;
+
 struct twig_h264_decoder_t {
     twig_dev_t *cedar;
-    void *ve_regs;
     twig_mem_t *extra_buf;
-    twig_h264_hdr_t *hdr;
+    twig_h264_hdr_t *hdr; // First slice's header, what the picture as a whole goes by once it's decoded
     twig_h264_sps_t *sps;
     twig_h264_pps_t *pps;
     uint16_t coded_width, coded_height;
     uint16_t last_width, last_height;
+    int app_hold_frames; // From twig_h264_decoder_set_pool_hint, guarded by queue_lock
     int is_default_scaling;
+    int scaling_loaded; // Scaling lists in the SRAM match sps/pps, cleared by new parameter sets or another decoder
+    uint32_t ve_ctrl;   // What this decoder last wrote to VE_CTRL, the wide frame bit differs between streams
+    twig_shadow_t shadow;
     twig_frame_pool_t frame_pool;
     int pool_initialized;
     twig_ref_state_t ref_state;
-    twig_mmco_cmd_t mmco_commands[32];
+    twig_mmco_cmd_t mmco_commands[32]; // Also the first slice's, every slice of a picture has to carry the same
     int mmco_count;
-    size_t current_pos;
+    twig_nal_t nals[TWIG_MAX_NALS]; // Index of the access unit being decoded
+    int nal_count;
+    twig_slice_t slices[2]; // One being decoded by the VE, the next one being prepared
+    twig_mem_t *ready[MAX_FRAME_POOL_SIZE]; // Frames bumped out in POC order by the last access unit
+    int ready_count;
+
+    // Submissions and completions are single-producer single-consumer rings, indexed by ever-growing counts.
+    // The app pushes jobs and pops completions, the device's service thread does the opposite, neither locks.
+    twig_job_t jobs[TWIG_MAX_PENDING];            // Job n sits in jobs[n % TWIG_MAX_PENDING] until it's done
+    _Atomic uint64_t submit_seq, done_seq;        // Jobs pushed, jobs decoded. Pending is the difference
+    twig_completion_t completions[TWIG_MAX_COMPLETIONS];
+    _Atomic uint64_t completion_head, completion_tail;
+
+    // Scheduling, guarded by the device's service_lock
+    twig_h264_decoder_t *next_stream; // Every decoder on the device, in the order they were created
+    int weight;                       // Access units in a row before the service thread moves on to the next stream
+    uint64_t frame_period_ns;         // From twig_h264_decoder_set_target_fps, producer side like the rings
+    uint64_t decode_ns;               // Running average of what one access unit takes, service thread only
+
+    // Pool handoff between app and service thread, guarded by queue_lock
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    twig_mem_t *returns[MAX_FRAME_POOL_SIZE]; // Frames handed back while the service thread was busy with the pool
+    int return_count;
+    int decoding;
+    twig_stream_stats_t stats;
+    int event_fd;
+    twig_ring_t ring;
+    size_t ring_size; // Used when the ring is set up on the first reserve
+#ifdef TWIG_TRACING
+    twig_trace_ring_t trace; // Written from any thread without locks, read by twig_h264_get_trace
+#endif
 };
 
-void *twig_get_ve_regs(twig_dev_t *cedar);
+int twig_get_ve_regs(twig_dev_t *cedar);
 int twig_wait_for_ve(twig_dev_t *cedar);
-void twig_put_ve_regs(twig_dev_t *cedar);
+void twig_put_ve_regs(twig_dev_t *cedar, const void *owner);
+int twig_ve_switch(twig_dev_t *cedar, const void *owner);
+
+int twig_h264_decode_au(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf, size_t offset, size_t len, int may_drop);
+void twig_h264_release_frame(twig_h264_decoder_t *decoder, twig_mem_t *output_buf);
+int twig_async_init(twig_h264_decoder_t *decoder);
+int twig_pending(twig_h264_decoder_t *decoder);
+void twig_async_cleanup(twig_h264_decoder_t *decoder);
+int twig_queue_job(twig_h264_decoder_t *decoder, twig_mem_t *buf, size_t offset, size_t len, uint64_t ring_end, uint64_t deadline);
+void twig_ring_cleanup(twig_h264_decoder_t *decoder);
 
 int twig_frame_pool_init(twig_frame_pool_t *pool, int width, int height);
-twig_frame_t *twig_frame_pool_get(twig_frame_pool_t *pool, twig_dev_t *cedar, uint16_t pwimm1);
+int twig_frame_pool_use_external(twig_frame_pool_t *pool, twig_dev_t *cedar, twig_mem_t **buffers, int count);
+void twig_frame_pool_set_output(twig_frame_pool_t *pool, twig_dev_t *cedar);
+int twig_frame_pool_reserve(twig_frame_pool_t *pool, twig_dev_t *cedar, int count);
+void twig_frame_pool_resize(twig_frame_pool_t *pool, twig_dev_t *cedar, int width, int height, int count);
+twig_frame_t *twig_frame_pool_get(twig_frame_pool_t *pool, twig_dev_t *cedar);
+void twig_frame_pool_release(twig_frame_pool_t *pool, twig_dev_t *cedar, twig_frame_t *frame);
 void twig_add_short_term_ref(twig_frame_pool_t *pool, twig_frame_t *frame);
 void twig_mark_frame_unref(twig_frame_pool_t *pool, twig_frame_t *frame);
 void twig_remove_stale_frames(twig_frame_pool_t *pool);
+twig_frame_t *twig_bump_frame(twig_frame_pool_t *pool);
+void twig_drain_output(twig_h264_decoder_t *decoder, int discard);
+void twig_queue_output(twig_h264_decoder_t *decoder, twig_frame_t *frame);
 void twig_frame_pool_cleanup(twig_frame_pool_t *pool, twig_dev_t *cedar);
 
-int twig_parse_mmco_commands(void *regs, twig_mmco_cmd_t *mmco_list, int *mmco_count);
+int twig_parse_mmco_commands(twig_bits_t *bits, twig_mmco_cmd_t *mmco_list, int *mmco_count);
 void twig_execute_mmco_commands(twig_h264_decoder_t *decoder, twig_frame_t *current_frame);
-void twig_write_framebuffer_list(twig_dev_t *cedar, void *ve_regs, twig_frame_pool_t *pool, twig_frame_t *output_frame, int output_poc);
+void twig_write_framebuffer_list(twig_cmd_list_t *cmds, twig_shadow_t *shadow, twig_frame_pool_t *pool, twig_frame_t *output_frame, int output_poc);
+void twig_write_output_registers(twig_cmd_list_t *cmds, twig_shadow_t *shadow, twig_frame_pool_t *pool, twig_frame_t *frame);
 void twig_build_ref_lists(twig_frame_pool_t *pool, twig_h264_hdr_t *hdr, twig_frame_t **list0, int *l0_count,
                                     twig_frame_t **list1, int *l1_count, int current_poc);
-void twig_write_ref_list0_registers(twig_dev_t *cedar, void *ve_regs, twig_frame_pool_t *pool, twig_frame_t **ref_list0, int l0_count);
-void twig_write_ref_list1_registers(twig_dev_t *cedar, void *ve_regs, twig_frame_pool_t *pool, twig_frame_t **ref_list1, int l1_count);
+void twig_write_ref_list0_registers(twig_cmd_list_t *cmds, twig_shadow_t *shadow, twig_frame_t **ref_list0, int l0_count);
+void twig_write_ref_list1_registers(twig_cmd_list_t *cmds, twig_shadow_t *shadow, twig_frame_t **ref_list1, int l1_count);
+
+void twig_cmd_add(twig_cmd_list_t *cmds, uint32_t reg, uint32_t value);
+int twig_cmd_list_apply(twig_dev_t *cedar, const twig_cmd_list_t *cmds);
+void twig_shadow_invalidate(twig_shadow_t *shadow);
+void twig_shadow_writel(twig_cmd_list_t *cmds, twig_shadow_t *shadow, uint32_t reg, uint32_t value);
+void twig_shadow_write_sram(twig_cmd_list_t *cmds, twig_shadow_t *shadow, uint32_t addr, const uint32_t *words, int count);
 
 #endif // TWIG_DEC_H_
\ No newline at end of file
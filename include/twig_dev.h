@@ -0,0 +1,101 @@
+/*
+ * libtwig - A streamlined CedarX variant library
+ * Pruned for H.264 decoding with easy-to-use buffers
+ *
+ * Private Cedar device backend interface
+ *
+ * Garbage code by Noxwell(Beebono)
+ * Based on CedarX framework by Allwinner Technology Co. Ltd.
+ */
+
+#ifndef TWIG_DEV_H_
+#define TWIG_DEV_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "twig.h"
+
+#define VE_REGS_SIZE 2048
+#define TWIG_IMPORT_CACHE 32 // Idle imports kept mapped, so apps cycling through a buffer set never pay twice
+
+typedef struct twig_arena twig_arena_t;
+typedef struct twig_import twig_import_t;
+
+typedef struct {
+    const char *name;
+    int (*open)(twig_dev_t *cedar);
+    void (*close)(twig_dev_t *cedar);
+    uint32_t (*readl)(twig_dev_t *cedar, uint32_t reg);
+    void (*writel)(twig_dev_t *cedar, uint32_t reg, uint32_t value);
+    int (*wait)(twig_dev_t *cedar);
+    twig_mem_t *(*alloc)(twig_dev_t *cedar, size_t size, unsigned int flags);
+    twig_mem_t *(*import)(twig_dev_t *cedar, int fd, size_t size); // Owns fd on success, leaves virt_addr NULL
+    void (*flush)(twig_dev_t *cedar, twig_mem_t *mem, size_t offset, size_t len);
+    void (*invalidate)(twig_dev_t *cedar, twig_mem_t *mem, size_t offset, size_t len);
+    void (*free)(twig_dev_t *cedar, twig_mem_t *mem);
+} twig_backend_t;
+
+// twig_stats_t, but safe to bump from any thread. Always here so the layout doesn't depend on TWIG_ENABLE_STATS
+typedef struct {
+    struct {
+        _Atomic uint64_t count, total_ns;
+        _Atomic uint64_t hist[TWIG_STATS_BUCKETS];
+    } stages[TWIG_STAGE_COUNT];
+    _Atomic uint64_t mmio_reads, mmio_writes, vld_starts, ve_waits, slices, frames, allocs;
+    _Atomic int64_t bytes_in_use;
+} twig_dev_stats_t;
+
+struct twig_dev_t {
+    const twig_backend_t *backend;
+    void *priv;
+    void *regs; // Directly mapped register window, NULL if the backend has to see every access
+    twig_arena_t *arena; // NULL unless twig_enable_arena was called
+    pthread_mutex_t import_lock;
+    twig_import_t *imports; // Every dma-buf imported so far and not evicted, in use or idle
+    uint64_t import_clock;
+    pthread_mutex_t ve_lock;  // Guards the two below
+    const void *ve_owner;     // Decoder whose state is in the H.264 registers and SRAM right now
+    int ve_users;             // Decoders open on this device, the VE goes idle when the last one goes
+
+    // One thread owns the VE and decodes for every stream, see twig_async.c. Fields below are guarded by service_lock
+    pthread_mutex_t service_lock;
+    pthread_t service;
+    int service_running, service_stop;
+    int service_fd;                  // eventfd, every submission bumps it so the service thread never sleeps through one
+    twig_h264_decoder_t *streams;    // List of decoders through next_stream
+    int stream_count;
+    twig_h264_decoder_t *current;    // Stream the service thread decoded last, and how many in a row
+    int current_turns;
+    int fd;
+    twig_dev_stats_t stats; // Relaxed atomics, see twig_stats.h
+};
+
+// Every backend allocation starts with one of these, so twig_mem_t alone is enough to find the device
+typedef struct {
+    twig_mem_t pub_mem;
+    twig_dev_t *cedar;
+    twig_arena_t *arena; // Set on arena sub-allocations, the backend never sees those
+    twig_import_t *import; // Set on imported dma-bufs, the import cache decides when they go
+    unsigned int flags;    // TWIG_MEM_* it was allocated with
+    size_t stale_start, stale_end; // What the VE wrote that the CPU cache may still have old lines for
+} twig_mem_priv_t;
+
+twig_arena_t *twig_arena_create(size_t chunk_size);
+void twig_arena_destroy(twig_arena_t *arena, twig_dev_t *cedar);
+twig_mem_t *twig_arena_alloc(twig_arena_t *arena, twig_dev_t *cedar, size_t size);
+void twig_arena_free(twig_arena_t *arena, twig_mem_t *mem);
+void twig_arena_flush(twig_arena_t *arena, twig_mem_t *mem, size_t offset, size_t len);
+void twig_arena_invalidate(twig_arena_t *arena, twig_mem_t *mem, size_t offset, size_t len);
+
+void twig_import_release(twig_dev_t *cedar, twig_mem_t *mem);
+void twig_import_cleanup(twig_dev_t *cedar);
+
+void twig_service_stop(twig_dev_t *cedar);
+
+// The VE just wrote all of mem, the next twig_mem_begin_cpu_access has to drop the CPU's cached copy
+void twig_mem_device_wrote(twig_mem_t *mem);
+
+extern const twig_backend_t twig_cedar_backend;
+extern const twig_backend_t twig_sim_backend;
+
+#endif // TWIG_DEV_H_
\ No newline at end of file
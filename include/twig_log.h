@@ -0,0 +1,93 @@
+/*
+ * libtwig - A streamlined CedarX variant library
+ * Pruned for H.264 decoding with easy-to-use buffers
+ *
+ * Private logging and binary tracing, anything below TWIG_LOG_LEVEL is compiled out
+ *
+ * Garbage code by Noxwell(Beebono)
+ * Based on CedarX framework by Allwinner Technology Co. Ltd.
+ */
+
+#ifndef TWIG_LOG_H_
+#define TWIG_LOG_H_
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include "twig.h"
+
+#define TWIG_LOG_LEVEL_NONE  0
+#define TWIG_LOG_LEVEL_ERROR 1
+#define TWIG_LOG_LEVEL_WARN  2
+#define TWIG_LOG_LEVEL_INFO  3
+#define TWIG_LOG_LEVEL_DEBUG 4
+#define TWIG_LOG_LEVEL_TRACE 5 // Everything, plus binary events into each decoder's trace ring
+
+#ifndef TWIG_LOG_LEVEL
+#define TWIG_LOG_LEVEL TWIG_LOG_LEVEL_WARN
+#endif
+
+// TWIG_LOG(WARN, "...", ...). The level picks a macro, so disabled ones don't even evaluate their arguments.
+#define TWIG_LOG(level, ...) TWIG_LOG_##level(__VA_ARGS__)
+
+#if TWIG_LOG_LEVEL >= TWIG_LOG_LEVEL_ERROR
+#define TWIG_LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define TWIG_LOG_ERROR(...) ((void)0)
+#endif
+
+#if TWIG_LOG_LEVEL >= TWIG_LOG_LEVEL_WARN
+#define TWIG_LOG_WARN(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define TWIG_LOG_WARN(...) ((void)0)
+#endif
+
+#if TWIG_LOG_LEVEL >= TWIG_LOG_LEVEL_INFO
+#define TWIG_LOG_INFO(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define TWIG_LOG_INFO(...) ((void)0)
+#endif
+
+#if TWIG_LOG_LEVEL >= TWIG_LOG_LEVEL_DEBUG
+#define TWIG_LOG_DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define TWIG_LOG_DEBUG(...) ((void)0)
+#endif
+
+#if TWIG_LOG_LEVEL >= TWIG_LOG_LEVEL_TRACE
+#define TWIG_TRACING 1
+#define TWIG_TRACE_SIZE 1024 // Events kept per decoder, older ones get overwritten
+
+// One event. seq is 0 while a writer is busy with the slot, otherwise its position in the ring + 1,
+// so a reader can tell a slot that changed under it from one that didn't.
+typedef struct {
+    _Atomic uint64_t seq;
+    _Atomic uint64_t time_ns;
+    _Atomic uint32_t event, arg0, arg1;
+} twig_trace_slot_t;
+
+typedef struct {
+    _Atomic uint64_t head; // Slots ever claimed, any thread may claim one
+    twig_trace_slot_t slots[TWIG_TRACE_SIZE];
+} twig_trace_ring_t;
+
+static inline void twig_trace_write(twig_trace_ring_t *ring, uint32_t event, uint32_t arg0, uint32_t arg1) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t seq = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+    twig_trace_slot_t *slot = &ring->slots[seq % TWIG_TRACE_SIZE];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // Busy before any of the contents change
+    atomic_store_explicit(&slot->time_ns, (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec, memory_order_relaxed);
+    atomic_store_explicit(&slot->event, event, memory_order_relaxed);
+    atomic_store_explicit(&slot->arg0, arg0, memory_order_relaxed);
+    atomic_store_explicit(&slot->arg1, arg1, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+}
+
+#define TWIG_TRACE(decoder, event, arg0, arg1) twig_trace_write(&(decoder)->trace, (event), (arg0), (arg1))
+#else
+#define TWIG_TRACE(decoder, event, arg0, arg1) ((void)sizeof((arg0) + (arg1))) // Nothing runs, but the arguments still count as used
+#endif
+
+#endif // TWIG_LOG_H_
\ No newline at end of file
@@ -12,13 +12,23 @@
 #define TWIG_REGS_H_
 
 #include <stdint.h>
+#include "twig_dev.h"
+#include "twig_stats.h"
 
-static inline void twig_writel(void *base, uint8_t offset, uint32_t value) {
-    *((volatile uint32_t*)(base + offset)) = value;
+static inline void twig_writel(twig_dev_t *cedar, uint32_t reg, uint32_t value) {
+    TWIG_STAT_ADD(cedar, mmio_writes, 1);
+    if (cedar->regs)
+        *((volatile uint32_t*)(cedar->regs + reg)) = value;
+    else
+        cedar->backend->writel(cedar, reg, value);
 }
 
-static inline uint32_t twig_readl(void *base, uint8_t offset) {
-    return *((volatile uint32_t*)(base + offset));
+static inline uint32_t twig_readl(twig_dev_t *cedar, uint32_t reg) {
+    TWIG_STAT_ADD(cedar, mmio_reads, 1);
+    if (cedar->regs)
+        return *((volatile uint32_t*)(cedar->regs + reg));
+
+    return cedar->backend->readl(cedar, reg);
 }
 
 #define VE_BASE 0x01c0e000
@@ -73,56 +83,56 @@ typedef enum {
 #define H264_OFFSET 0x200
 
 typedef enum {
-    H264_SEQ_HDR               = 0x00,
-    H264_PIC_HDR               = 0x04,
-    H264_SLICE_HDR             = 0x08,
-    H264_SLICE_HDR2            = 0x0c,
-    H264_PRED_WEIGHT           = 0x10,
-    H264_VP8_HDR               = 0x14,
-    H264_QINDEX                = 0x18,
-    H264_QP                    = 0x1c,
-    H264_CTRL                  = 0x20,
-    H264_TRIGGER               = 0x24,
-    H264_STATUS                = 0x28,
-    H264_CUR_MBNUM             = 0x2c,
-    H264_VLD_ADDR              = 0x30,
-    H264_VLD_OFFSET            = 0x34,
-    H264_VLD_LEN               = 0x38,
-    H264_VLD_END               = 0x3c,
-    H264_SDROT_CTRL            = 0x40,
-    H264_SDROT_LUMA            = 0x44,
-    H264_SDROT_CHROMA          = 0x48,
-    H264_OUTPUT_FRAME_INDEX    = 0x4c,
-    H264_FIELD_INTRA_INFO_BUF  = 0x50,
-    H264_NEIGHBOR_INFO_BUF     = 0x54,
-    H264_PIC_MBSIZE            = 0x58,
-    H264_PIC_BOUNDARYSIZE      = 0x5c,
-    H264_MB_ADDR               = 0x60,
-    H264_MB_NB1                = 0x64,
-    H264_MB_NB2                = 0x68,
-    H264_MB_NB3                = 0x6c,
-    H264_MB_NB4                = 0x70,
-    H264_MB_NB5                = 0x74,
-    H264_MB_NB6                = 0x78,
-    H264_MB_NB7                = 0x7c,
-    H264_MB_NB8                = 0x80,
-    H264_MB_QP                 = 0x90,
-    H264_REC_LUMA              = 0xac,
-    H264_FWD_LUMA              = 0xb0,
-    H264_BACK_LUMA             = 0xb4,
-    H264_ERROR                 = 0xb8,
-    H264_REC_CHROMA            = 0xd0,
-    H264_FWD_CHROMA            = 0xd4,
-    H264_BACK_CHROMA           = 0xd8,
-    H264_BASIC_BITS            = 0xdc,
-    H264_RAM_WRITE_PTR         = 0xe0,
-    H264_RAM_WRITE_DATA        = 0xe4,
-    H264_ALT_LUMA              = 0xe8,
-    H264_ALT_CHROMA            = 0xec,
-    H264_SEG_MB_LV0            = 0xf0,
-    H264_SEG_MB_LV1            = 0xf4,
-    H264_REF_LF_DELTA          = 0xf8,
-    H264_MODE_LF_DELTA         = 0xfc
+    H264_SEQ_HDR               = H264_OFFSET + 0x00,
+    H264_PIC_HDR               = H264_OFFSET + 0x04,
+    H264_SLICE_HDR             = H264_OFFSET + 0x08,
+    H264_SLICE_HDR2            = H264_OFFSET + 0x0c,
+    H264_PRED_WEIGHT           = H264_OFFSET + 0x10,
+    H264_VP8_HDR               = H264_OFFSET + 0x14,
+    H264_QINDEX                = H264_OFFSET + 0x18,
+    H264_QP                    = H264_OFFSET + 0x1c,
+    H264_CTRL                  = H264_OFFSET + 0x20,
+    H264_TRIGGER               = H264_OFFSET + 0x24,
+    H264_STATUS                = H264_OFFSET + 0x28,
+    H264_CUR_MBNUM             = H264_OFFSET + 0x2c,
+    H264_VLD_ADDR              = H264_OFFSET + 0x30,
+    H264_VLD_OFFSET            = H264_OFFSET + 0x34,
+    H264_VLD_LEN               = H264_OFFSET + 0x38,
+    H264_VLD_END               = H264_OFFSET + 0x3c,
+    H264_SDROT_CTRL            = H264_OFFSET + 0x40,
+    H264_SDROT_LUMA            = H264_OFFSET + 0x44,
+    H264_SDROT_CHROMA          = H264_OFFSET + 0x48,
+    H264_OUTPUT_FRAME_INDEX    = H264_OFFSET + 0x4c,
+    H264_FIELD_INTRA_INFO_BUF  = H264_OFFSET + 0x50,
+    H264_NEIGHBOR_INFO_BUF     = H264_OFFSET + 0x54,
+    H264_PIC_MBSIZE            = H264_OFFSET + 0x58,
+    H264_PIC_BOUNDARYSIZE      = H264_OFFSET + 0x5c,
+    H264_MB_ADDR               = H264_OFFSET + 0x60,
+    H264_MB_NB1                = H264_OFFSET + 0x64,
+    H264_MB_NB2                = H264_OFFSET + 0x68,
+    H264_MB_NB3                = H264_OFFSET + 0x6c,
+    H264_MB_NB4                = H264_OFFSET + 0x70,
+    H264_MB_NB5                = H264_OFFSET + 0x74,
+    H264_MB_NB6                = H264_OFFSET + 0x78,
+    H264_MB_NB7                = H264_OFFSET + 0x7c,
+    H264_MB_NB8                = H264_OFFSET + 0x80,
+    H264_MB_QP                 = H264_OFFSET + 0x90,
+    H264_REC_LUMA              = H264_OFFSET + 0xac,
+    H264_FWD_LUMA              = H264_OFFSET + 0xb0,
+    H264_BACK_LUMA             = H264_OFFSET + 0xb4,
+    H264_ERROR                 = H264_OFFSET + 0xb8,
+    H264_REC_CHROMA            = H264_OFFSET + 0xd0,
+    H264_FWD_CHROMA            = H264_OFFSET + 0xd4,
+    H264_BACK_CHROMA           = H264_OFFSET + 0xd8,
+    H264_BASIC_BITS            = H264_OFFSET + 0xdc,
+    H264_RAM_WRITE_PTR         = H264_OFFSET + 0xe0,
+    H264_RAM_WRITE_DATA        = H264_OFFSET + 0xe4,
+    H264_ALT_LUMA              = H264_OFFSET + 0xe8,
+    H264_ALT_CHROMA            = H264_OFFSET + 0xec,
+    H264_SEG_MB_LV0            = H264_OFFSET + 0xf0,
+    H264_SEG_MB_LV1            = H264_OFFSET + 0xf4,
+    H264_REF_LF_DELTA          = H264_OFFSET + 0xf8,
+    H264_MODE_LF_DELTA         = H264_OFFSET + 0xfc
 } H264_Registers;
 
 #define VE_SRAM_H264_PRED_WEIGHT_TABLE	0x000
@@ -131,4 +141,20 @@ typedef enum {
 #define VE_SRAM_H264_REF_LIST1		    0x664
 #define VE_SRAM_H264_SCALING_LISTS	    0x800
 
+// VE_OUTPUT_FORMAT: primary (reconstruction) format in bits 4-6, secondary (SDROT) format in bits 0-2
+#define VE_OUTPUT_FMT_TILED_32      0x0
+#define VE_OUTPUT_FMT_YV12          0x3
+#define VE_OUTPUT_FMT_NV12          0x4
+#define VE_OUTPUT_FMT_NV21          0x5
+#define VE_PRIMARY_OUTPUT_FMT(f)    ((f) << 4)
+#define VE_EXTRA_OUTPUT_FMT(f)      ((f) << 0)
+
+// VE_EXTRA_OUT_STRIDE has the chroma stride up top, VE_EXTRA_OUT_FMT_OFFSET the length of all chroma planes
+#define VE_EXTRA_OUT_STRIDES(luma, chroma) (((chroma) << 16) | ((luma) & 0xffff))
+#define VE_EXTRA_OUT_CHROMA_LEN(len)       ((len) & 0x0fffffff)
+
+#define H264_SDROT_ENABLE           (0x1 << 8) // Secondary output on, written to H264_SDROT_LUMA/CHROMA
+#define H264_SDROT_SCALE(shift)     ((shift) & 0x3)        // Scale down by 1 << shift, up to 1/8
+#define H264_SDROT_ROTATE(rotation) (((rotation) & 0x3) << 4) // Quarter turns clockwise
+
 #endif // TWIG_REGS_H_
\ No newline at end of file
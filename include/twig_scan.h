@@ -0,0 +1,29 @@
+/*
+ * libtwig - A streamlined CedarX variant library
+ * Pruned for H.264 decoding with easy-to-use buffers
+ *
+ * Private start code scanner, vectorized where the CPU allows
+ *
+ * Garbage code by Noxwell(Beebono)
+ * Based on CedarX framework by Allwinner Technology Co. Ltd.
+ */
+
+#ifndef TWIG_SCAN_H_
+#define TWIG_SCAN_H_
+
+#include <stdint.h>
+
+typedef int (*twig_scan_fn_t)(const uint8_t *data, int len, int start);
+
+typedef struct {
+    const char *name;
+    twig_scan_fn_t find;
+} twig_scanner_t;
+
+// Position of the NAL header byte after the next 3- or 4-byte start code at or after start, len if there isn't one
+int twig_find_nal_header(const uint8_t *data, int len, int start);
+
+// Every variant this CPU can run, scalar first and the one twig_find_nal_header picked last
+const twig_scanner_t *twig_get_scanners(int *count);
+
+#endif // TWIG_SCAN_H_
\ No newline at end of file
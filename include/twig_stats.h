@@ -0,0 +1,49 @@
+/*
+ * libtwig - A streamlined CedarX variant library
+ * Pruned for H.264 decoding with easy-to-use buffers
+ *
+ * Private decode statistics, compiled out entirely without TWIG_ENABLE_STATS
+ *
+ * Garbage code by Noxwell(Beebono)
+ * Based on CedarX framework by Allwinner Technology Co. Ltd.
+ */
+
+#ifndef TWIG_STATS_H_
+#define TWIG_STATS_H_
+
+#include <time.h>
+#include "twig_dev.h"
+
+#ifdef TWIG_ENABLE_STATS
+
+static inline uint64_t twig_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void twig_stats_record(twig_dev_t *cedar, twig_stage_t stage, uint64_t ns) {
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= TWIG_STATS_BUCKETS)
+        bucket = TWIG_STATS_BUCKETS - 1;
+    atomic_fetch_add_explicit(&cedar->stats.stages[stage].count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cedar->stats.stages[stage].total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cedar->stats.stages[stage].hist[bucket], 1, memory_order_relaxed);
+}
+
+// Counters only need to add up in the end, nobody orders anything against them
+#define TWIG_STAT_ADD(cedar, field, n) atomic_fetch_add_explicit(&(cedar)->stats.field, (n), memory_order_relaxed)
+#define TWIG_STAT_CLOCK(start) uint64_t start = twig_stats_now()
+#define TWIG_STAT_STAGE(cedar, stage, start) twig_stats_record(cedar, stage, twig_stats_now() - (start))
+#define TWIG_STAT_STAGE_NS(cedar, stage, ns) twig_stats_record(cedar, stage, ns)
+
+#else
+
+#define TWIG_STAT_ADD(cedar, field, n) ((void)0)
+#define TWIG_STAT_CLOCK(start)
+#define TWIG_STAT_STAGE(cedar, stage, start) ((void)0)
+#define TWIG_STAT_STAGE_NS(cedar, stage, ns) ((void)0)
+
+#endif // TWIG_ENABLE_STATS
+
+#endif // TWIG_STATS_H_
\ No newline at end of file
@@ -1,123 +1,222 @@
 #include "twig.h"
+#include "twig_dev.h"
 #include "twig_regs.h"
-#include "allwinner/cedardev_api.h"
+#include "twig_log.h"
 
 #define EXPORT __attribute__((visibility ("default")))
 
-struct twig_dev_t {
-    int fd, active;
-    void *regs;
+static const twig_backend_t *twig_backends[] = {
+    &twig_cedar_backend,
+    &twig_sim_backend,
 };
 
-twig_mem_t *twig_ion_alloc_mem(int cedar_fd, size_t size);
-void twig_ion_flush_mem(twig_mem_t *pub_mem);
-void twig_ion_free_mem(int cedar_fd, twig_mem_t *pub_mem);
+EXPORT twig_dev_t *twig_open_backend(const char *name) {
+    const twig_backend_t *backend = NULL;
+    for (size_t i = 0; i < sizeof(twig_backends) / sizeof(twig_backends[0]); i++) {
+        if (name && strcmp(name, twig_backends[i]->name) == 0)
+            backend = twig_backends[i];
+    }
+    if (!backend)
+        return NULL;
 
-EXPORT twig_dev_t *twig_open(void) {
     twig_dev_t *cedar = calloc(1, sizeof(*cedar));
     if (!cedar)
         return NULL;
 
-    cedar->fd = open("/dev/cedar_dev", O_RDWR);
-    if (cedar->fd == -1)
-        goto err_free;
-
-    cedar->regs = mmap(NULL, 2048, PROT_READ | PROT_WRITE, MAP_SHARED, cedar->fd, VE_BASE);
-    if (cedar->regs == MAP_FAILED)
-        goto err_close;
-
-    if(twig_readl(cedar->regs, VE_CTRL) & 0x00000001) {
-        fprintf(stderr, "WARNING: Cedar VE is still in H.264 mode, but twig_open was called again!\n");
-        fprintf(stderr, "         Forcing a hardware reset in case the previous instance crashed!\n");
-        ioctl(cedar->fd, IOCTL_SET_REFCOUNT, 0);
+    cedar->backend = backend;
+    cedar->fd = -1;
+    if (backend->open(cedar) < 0) {
+        free(cedar);
+        return NULL;
     }
 
-    if (ioctl(cedar->fd, IOCTL_ENABLE_VE, 0) < 0)
-        goto err_unmap;
+    pthread_mutex_init(&cedar->import_lock, NULL);
+    pthread_mutex_init(&cedar->ve_lock, NULL);
+    pthread_mutex_init(&cedar->service_lock, NULL);
+    cedar->service_fd = -1; // Service thread starts with the first decoder
+    return cedar;
+}
 
-    if (ioctl(cedar->fd, IOCTL_ENGINE_REQ, 0) < 0)
-        goto err_disable;
+EXPORT twig_dev_t *twig_open(void) {
+    const char *name = getenv("TWIG_BACKEND"); // Lets unmodified apps run against the simulator
+    twig_dev_t *cedar = twig_open_backend(name ? name : "cedar");
 
-    cedar->active = 0;
+    const char *arena_mb = getenv("TWIG_ARENA_MB"); // Same for the arena allocator
+    if (cedar && arena_mb && twig_enable_arena(cedar, strtoul(arena_mb, NULL, 0) << 20) < 0)
+        TWIG_LOG(WARN, "WARNING: Failed to set up the arena allocator, using plain allocations!\n");
     return cedar;
-
-err_disable:
-    ioctl(cedar->fd, IOCTL_DISABLE_VE, 0);
-err_unmap:
-    munmap(cedar->regs, 2048);
-    cedar->regs = NULL;
-err_close:
-    close(cedar->fd);
-    cedar->fd = -1;
-err_free:
-    free(cedar);
-    return NULL;
 }
 
-void *twig_get_ve_regs(twig_dev_t *cedar) {
+// Every decoder on the device holds a reference, only the first one flips the VE into H.264 mode
+int twig_get_ve_regs(twig_dev_t *cedar) {
     if (!cedar)
-        return NULL;
+        return -1;
 
-    if (cedar->active == 0) {
-        twig_writel(cedar->regs, VE_CTRL, 0x00130001);
-        cedar->active = 1;
-    }
-    return cedar->regs;
+    pthread_mutex_lock(&cedar->ve_lock);
+    if (cedar->ve_users++ == 0)
+        twig_writel(cedar, VE_CTRL, 0x00130001);
+    pthread_mutex_unlock(&cedar->ve_lock);
+    return 0;
 }
 
 int twig_wait_for_ve(twig_dev_t *cedar) {
     if (!cedar)
         return -1;
 
-    int ret = ioctl(cedar->fd, IOCTL_WAIT_VE_DE, 1);
-    if (ret < 0)
-        return -1;
-
-    return 0;
+    TWIG_STAT_CLOCK(start);
+    int ret = cedar->backend->wait(cedar);
+    TWIG_STAT_STAGE(cedar, TWIG_STAGE_VE_WAIT, start);
+    TWIG_STAT_ADD(cedar, ve_waits, 1);
+    return ret;
 }
 
-void twig_put_ve_regs(twig_dev_t *cedar) {
+// And only the last one out puts it back to idle, the rest keep decoding
+void twig_put_ve_regs(twig_dev_t *cedar, const void *owner) {
     if (!cedar)
         return;
 
-    twig_writel(cedar->regs, VE_CTRL, 0x00130007);
-    cedar->active = 0;
+    pthread_mutex_lock(&cedar->ve_lock);
+    if (cedar->ve_owner == owner) // A new decoder could get the same address, it mustn't think its state is loaded
+        cedar->ve_owner = NULL;
+    if (cedar->ve_users > 0 && --cedar->ve_users == 0)
+        twig_writel(cedar, VE_CTRL, 0x00130007);
+    pthread_mutex_unlock(&cedar->ve_lock);
 }
 
-EXPORT twig_mem_t *twig_alloc_mem(twig_dev_t *cedar, size_t size) {
-    if (!cedar || cedar->fd < 0 || size <= 0)
+// Called by the service thread before each picture. Returns 1 if another decoder had the VE last, meaning
+// nothing this decoder left in the registers or SRAM can be trusted and has to be loaded again.
+int twig_ve_switch(twig_dev_t *cedar, const void *owner) {
+    pthread_mutex_lock(&cedar->ve_lock);
+    int switched = (cedar->ve_owner != owner);
+    cedar->ve_owner = owner;
+    pthread_mutex_unlock(&cedar->ve_lock);
+    return switched;
+}
+
+// TWIG_MEM_UNCACHED gives a write-combined buffer, for bitstreams the CPU only ever writes. No flush needed
+// after filling it, but CPU reads from it are slow (the decoder reads each access unit once to index it).
+EXPORT twig_mem_t *twig_alloc_mem_flags(twig_dev_t *cedar, size_t size, unsigned int flags) {
+    if (!cedar || size <= 0)
         return NULL;
 
-    return twig_ion_alloc_mem(cedar->fd, size);
+    twig_mem_t *mem = NULL;
+    if (cedar->arena && !(flags & TWIG_MEM_UNCACHED)) // Arena chunks are cached, uncached buffers get their own
+        mem = twig_arena_alloc(cedar->arena, cedar, size);
+    if (!mem) // No arena, or bigger than a whole chunk
+        mem = cedar->backend->alloc(cedar, size, flags);
+    if (mem) {
+        ((twig_mem_priv_t *)mem)->cedar = cedar;
+        ((twig_mem_priv_t *)mem)->flags = flags;
+        TWIG_STAT_ADD(cedar, allocs, 1);
+        TWIG_STAT_ADD(cedar, bytes_in_use, mem->size);
+    }
+    return mem;
+}
+
+EXPORT twig_mem_t *twig_alloc_mem(twig_dev_t *cedar, size_t size) {
+    return twig_alloc_mem_flags(cedar, size, 0);
+}
+
+// Cleans just [offset, offset + len) out to memory, for when only part of a big buffer was written
+EXPORT void twig_flush_range(twig_mem_t *mem, size_t offset, size_t len) {
+    if (!mem || offset >= mem->size || len == 0)
+        return;
+
+    if (len > mem->size - offset)
+        len = mem->size - offset;
+
+    twig_mem_priv_t *priv = (twig_mem_priv_t *)mem;
+    if (priv->flags & TWIG_MEM_UNCACHED) // Nothing ever sits in the cache
+        return;
+
+    if (priv->arena)
+        twig_arena_flush(priv->arena, mem, offset, len);
+    else
+        priv->cedar->backend->flush(priv->cedar, mem, offset, len);
+}
+
+void twig_mem_device_wrote(twig_mem_t *mem) {
+    twig_mem_priv_t *priv = (twig_mem_priv_t *)mem;
+    priv->stale_start = 0;
+    priv->stale_end = mem->size;
+}
+
+// Call before the CPU looks at (or writes into part of) a buffer the VE wrote, offset and len cover only the
+// planes or rows about to be touched. Only what the VE wrote since the last call gets invalidated, so reading
+// luma and then chroma costs one pass over the frame, and a frame the CPU never touches costs nothing at all.
+EXPORT int twig_mem_begin_cpu_access(twig_mem_t *mem, unsigned int dir, size_t offset, size_t len) {
+    if (!mem || !(dir & (TWIG_CPU_READ | TWIG_CPU_WRITE)) || offset >= mem->size)
+        return -1;
+
+    if (len > mem->size - offset)
+        len = mem->size - offset;
+
+    twig_mem_priv_t *priv = (twig_mem_priv_t *)mem;
+    size_t start = offset > priv->stale_start ? offset : priv->stale_start;
+    size_t end = offset + len < priv->stale_end ? offset + len : priv->stale_end;
+    if (start >= end || (priv->flags & TWIG_MEM_UNCACHED))
+        return 0;
+
+    if (priv->arena)
+        twig_arena_invalidate(priv->arena, mem, start, end - start);
+    else
+        priv->cedar->backend->invalidate(priv->cedar, mem, start, end - start);
+
+    // Shrink what's left stale, a hole in the middle just stays stale on both sides
+    if (start == priv->stale_start)
+        priv->stale_start = end;
+    else if (end == priv->stale_end)
+        priv->stale_end = start;
+    if (priv->stale_start >= priv->stale_end)
+        priv->stale_start = priv->stale_end = 0;
+    return 0;
+}
+
+// Call once the CPU is done, written bytes get cleaned out to memory before the VE reads them. Reads need nothing.
+EXPORT int twig_mem_end_cpu_access(twig_mem_t *mem, unsigned int dir, size_t offset, size_t len) {
+    if (!mem || !(dir & (TWIG_CPU_READ | TWIG_CPU_WRITE)) || offset >= mem->size)
+        return -1;
+
+    if (dir & TWIG_CPU_WRITE)
+        twig_flush_range(mem, offset, len);
+    return 0;
 }
 
 EXPORT void twig_flush_mem(twig_mem_t *mem) {
     if (!mem)
         return;
 
-    twig_ion_flush_mem(mem);
+    twig_flush_range(mem, 0, mem->size);
 }
 
 EXPORT void twig_free_mem(twig_dev_t *cedar, twig_mem_t *mem) {
-    if (!cedar || cedar->fd < 0 || !mem)
+    if (!cedar || !mem)
         return;
 
-    twig_ion_free_mem(cedar->fd, mem);
+    twig_mem_priv_t *priv = (twig_mem_priv_t *)mem;
+    if (!priv->import) // Imports were never ours to count
+        TWIG_STAT_ADD(cedar, bytes_in_use, -(int64_t)mem->size);
+    if (priv->import)
+        twig_import_release(cedar, mem); // Stays mapped in the cache until it's pushed out
+    else if (priv->arena)
+        twig_arena_free(priv->arena, mem);
+    else
+        cedar->backend->free(cedar, mem);
 }
 
 EXPORT void twig_close(twig_dev_t *cedar) {
-    if (!cedar || cedar->fd == -1)
+    if (!cedar)
         return;
 
-    if (cedar->active == 1)
-        twig_put_ve_regs(cedar);
-
-    munmap(cedar->regs, 2048);
-    cedar->regs = NULL;
+    twig_service_stop(cedar); // Nothing touches the VE after this
+    if (cedar->ve_users > 0) // Decoders the app never destroyed, don't leave the VE in H.264 mode for them
+        twig_writel(cedar, VE_CTRL, 0x00130007);
 
-    ioctl(cedar->fd, IOCTL_ENGINE_REL, 0);
-    ioctl(cedar->fd, IOCTL_DISABLE_VE, 0);
-
-    close(cedar->fd);
-    cedar->fd = -1;
+    twig_import_cleanup(cedar);
+    twig_arena_destroy(cedar->arena, cedar); // Chunks go back before the backend does
+    cedar->backend->close(cedar);
+    pthread_mutex_destroy(&cedar->import_lock);
+    pthread_mutex_destroy(&cedar->ve_lock);
+    pthread_mutex_destroy(&cedar->service_lock);
+    free(cedar);
 }
\ No newline at end of file
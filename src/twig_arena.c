@@ -0,0 +1,257 @@
+#include <pthread.h>
+#include "twig.h"
+#include "twig_dev.h"
+#include "twig_log.h"
+
+#define EXPORT __attribute__((visibility ("default")))
+
+#define TWIG_ARENA_ALIGN 4096
+#define TWIG_ARENA_CLASSES 20 // 4K << 19 is 2G, bigger than anything the VE can map
+#define TWIG_ARENA_DEFAULT_CHUNK (32 * 1024 * 1024)
+
+typedef struct twig_arena_chunk twig_arena_chunk_t;
+
+// A piece of a chunk. While in use it's the twig_mem_t the caller got, while free it sits in a size class list.
+typedef struct twig_arena_block {
+    twig_mem_priv_t priv;
+    twig_arena_chunk_t *chunk;
+    size_t offset, size;
+    int is_free;
+    struct twig_arena_block *prev, *next;           // Neighbours in the chunk, by address
+    struct twig_arena_block *free_prev, *free_next; // Same size class, only valid while free
+} twig_arena_block_t;
+
+struct twig_arena_chunk {
+    twig_mem_t *mem; // The one backend allocation (fd, mapping, IOMMU entry) every block in here shares
+    twig_arena_block_t *blocks;
+    int used;
+    twig_arena_chunk_t *next;
+};
+
+struct twig_arena {
+    pthread_mutex_t lock; // Decoder workers allocate from their own threads
+    size_t chunk_size;
+    twig_arena_chunk_t *chunks;
+    twig_arena_block_t *free_lists[TWIG_ARENA_CLASSES];
+};
+
+// floor(log2(size / 4K)), so everything in a class is at least 4K << class
+static int twig_arena_class(size_t size) {
+    int class = 0;
+    for (size /= TWIG_ARENA_ALIGN; size > 1 && class < TWIG_ARENA_CLASSES - 1; size >>= 1)
+        class++;
+    return class;
+}
+
+static void twig_arena_list_add(twig_arena_t *arena, twig_arena_block_t *block) {
+    twig_arena_block_t **head = &arena->free_lists[twig_arena_class(block->size)];
+    block->is_free = 1;
+    block->free_prev = NULL;
+    block->free_next = *head;
+    if (*head)
+        (*head)->free_prev = block;
+    *head = block;
+}
+
+static void twig_arena_list_remove(twig_arena_t *arena, twig_arena_block_t *block) {
+    if (block->free_prev)
+        block->free_prev->free_next = block->free_next;
+    else
+        arena->free_lists[twig_arena_class(block->size)] = block->free_next;
+    if (block->free_next)
+        block->free_next->free_prev = block->free_prev;
+    block->is_free = 0;
+}
+
+static twig_arena_chunk_t *twig_arena_add_chunk(twig_arena_t *arena, twig_dev_t *cedar) {
+    twig_arena_chunk_t *chunk = calloc(1, sizeof(*chunk));
+    twig_arena_block_t *block = calloc(1, sizeof(*block));
+    if (!chunk || !block)
+        goto err_free;
+
+    chunk->mem = cedar->backend->alloc(cedar, arena->chunk_size, 0);
+    if (!chunk->mem)
+        goto err_free;
+    ((twig_mem_priv_t *)chunk->mem)->cedar = cedar;
+
+    block->chunk = chunk;
+    block->size = arena->chunk_size;
+    chunk->blocks = block;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    twig_arena_list_add(arena, block);
+    return chunk;
+
+err_free:
+    free(block);
+    free(chunk);
+    return NULL;
+}
+
+// Only called once the chunk is a single free block again
+static void twig_arena_drop_chunk(twig_arena_t *arena, twig_dev_t *cedar, twig_arena_chunk_t *chunk) {
+    for (twig_arena_chunk_t **link = &arena->chunks; *link; link = &(*link)->next) {
+        if (*link == chunk) {
+            *link = chunk->next;
+            break;
+        }
+    }
+
+    twig_arena_list_remove(arena, chunk->blocks);
+    free(chunk->blocks);
+    cedar->backend->free(cedar, chunk->mem);
+    free(chunk);
+}
+
+// First fit, starting at the request's own class. Anything from a higher class is big enough by definition.
+static twig_arena_block_t *twig_arena_find(twig_arena_t *arena, size_t size) {
+    for (int class = twig_arena_class(size); class < TWIG_ARENA_CLASSES; class++) {
+        for (twig_arena_block_t *block = arena->free_lists[class]; block; block = block->free_next) {
+            if (block->size >= size)
+                return block;
+        }
+    }
+    return NULL;
+}
+
+twig_arena_t *twig_arena_create(size_t chunk_size) {
+    twig_arena_t *arena = calloc(1, sizeof(*arena));
+    if (!arena)
+        return NULL;
+
+    arena->chunk_size = chunk_size ? (chunk_size + TWIG_ARENA_ALIGN - 1) & ~(TWIG_ARENA_ALIGN - 1) : TWIG_ARENA_DEFAULT_CHUNK;
+    pthread_mutex_init(&arena->lock, NULL);
+    return arena;
+}
+
+void twig_arena_destroy(twig_arena_t *arena, twig_dev_t *cedar) {
+    if (!arena)
+        return;
+
+    int leaked = 0;
+    while (arena->chunks) {
+        twig_arena_chunk_t *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        leaked += chunk->used;
+        for (twig_arena_block_t *block = chunk->blocks, *next; block; block = next) {
+            next = block->next;
+            free(block);
+        }
+        cedar->backend->free(cedar, chunk->mem);
+        free(chunk);
+    }
+    if (leaked)
+        TWIG_LOG(WARN, "WARNING: %d arena allocations were never freed!\n", leaked);
+
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+// NULL if the request is bigger than a chunk, the caller goes to the backend directly for those
+twig_mem_t *twig_arena_alloc(twig_arena_t *arena, twig_dev_t *cedar, size_t size) {
+    size_t aligned_size = (size + TWIG_ARENA_ALIGN - 1) & ~(TWIG_ARENA_ALIGN - 1);
+    if (aligned_size > arena->chunk_size)
+        return NULL;
+
+    pthread_mutex_lock(&arena->lock);
+    twig_arena_block_t *block = twig_arena_find(arena, aligned_size);
+    if (!block && twig_arena_add_chunk(arena, cedar))
+        block = arena->chunks->blocks;
+    if (!block) {
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+
+    twig_arena_list_remove(arena, block);
+    twig_arena_block_t *rest = NULL;
+    if (block->size > aligned_size)
+        rest = calloc(1, sizeof(*rest));
+    if (rest) { // Out of memory for the bookkeeping just means handing out the whole block
+        rest->chunk = block->chunk;
+        rest->offset = block->offset + aligned_size;
+        rest->size = block->size - aligned_size;
+        rest->prev = block;
+        rest->next = block->next;
+        if (block->next)
+            block->next->prev = rest;
+        block->next = rest;
+        block->size = aligned_size;
+        twig_arena_list_add(arena, rest);
+    }
+
+    twig_arena_chunk_t *chunk = block->chunk;
+    chunk->used++;
+    pthread_mutex_unlock(&arena->lock);
+
+    memset(&block->priv, 0, sizeof(block->priv)); // Nothing of the last owner's (stale range, flags) carries over
+    twig_mem_t *pub = &block->priv.pub_mem;
+    pub->virt_addr = (uint8_t *)chunk->mem->virt_addr + block->offset;
+    pub->phys_addr = chunk->mem->phys_addr + block->offset;
+    pub->iommu_addr = chunk->mem->iommu_addr + block->offset;
+    pub->size = size;
+    pub->ion_fd = chunk->mem->ion_fd;
+    pub->fd_offset = block->offset;
+    block->priv.cedar = cedar;
+    block->priv.arena = arena;
+    return pub;
+}
+
+void twig_arena_free(twig_arena_t *arena, twig_mem_t *mem) {
+    twig_arena_block_t *block = (twig_arena_block_t *)mem;
+    twig_dev_t *cedar = block->priv.cedar;
+    twig_arena_chunk_t *chunk = block->chunk;
+
+    pthread_mutex_lock(&arena->lock);
+    chunk->used--;
+
+    twig_arena_block_t *next = block->next;
+    if (next && next->is_free) { // Swallow the free neighbour after us
+        twig_arena_list_remove(arena, next);
+        block->size += next->size;
+        block->next = next->next;
+        if (next->next)
+            next->next->prev = block;
+        free(next);
+    }
+
+    twig_arena_block_t *prev = block->prev;
+    if (prev && prev->is_free) { // And let the one before us swallow us
+        twig_arena_list_remove(arena, prev);
+        prev->size += block->size;
+        prev->next = block->next;
+        if (block->next)
+            block->next->prev = prev;
+        free(block);
+        block = prev;
+    }
+
+    twig_arena_list_add(arena, block);
+    if (chunk->used == 0 && arena->chunks->next) // Keep the last chunk around, hand spare ones back to the backend
+        twig_arena_drop_chunk(arena, cedar, chunk);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+void twig_arena_flush(twig_arena_t *arena, twig_mem_t *mem, size_t offset, size_t len) {
+    twig_arena_block_t *block = (twig_arena_block_t *)mem;
+    twig_dev_t *cedar = block->priv.cedar;
+    cedar->backend->flush(cedar, block->chunk->mem, block->offset + offset, len); // Just our range, not the whole chunk
+}
+
+void twig_arena_invalidate(twig_arena_t *arena, twig_mem_t *mem, size_t offset, size_t len) {
+    twig_arena_block_t *block = (twig_arena_block_t *)mem;
+    twig_dev_t *cedar = block->priv.cedar;
+    cedar->backend->invalidate(cedar, block->chunk->mem, block->offset + offset, len);
+}
+
+// Sub-allocates everything up to chunk_size from a few large backend allocations (0 picks 32 MB).
+// Buffers allocated before this stay plain backend ones, twig_free_mem tells them apart.
+EXPORT int twig_enable_arena(twig_dev_t *cedar, size_t chunk_size) {
+    if (!cedar)
+        return -1;
+
+    if (cedar->arena)
+        return 0;
+
+    cedar->arena = twig_arena_create(chunk_size);
+    return cedar->arena ? 0 : -1;
+}
\ No newline at end of file
@@ -0,0 +1,500 @@
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include "twig.h"
+#include "twig_bits.h"
+#include "twig_dec.h"
+#include "twig_regs.h"
+#include "twig_log.h"
+
+#define EXPORT __attribute__((visibility ("default")))
+
+static uint64_t twig_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Caller holds queue_lock, the service thread is done with us so the pool is ours
+static void twig_apply_returns(twig_h264_decoder_t *decoder) {
+    for (int i = 0; i < decoder->return_count; i++)
+        twig_h264_release_frame(decoder, decoder->returns[i]);
+    decoder->return_count = 0;
+}
+
+// Service thread only, the app is the one popping
+static void twig_push_completion(twig_h264_decoder_t *decoder, twig_mem_t *frame, uint64_t seq) {
+    uint64_t tail = atomic_load_explicit(&decoder->completion_tail, memory_order_relaxed);
+    uint64_t count = tail - atomic_load_explicit(&decoder->completion_head, memory_order_acquire);
+    if (!frame && count >= TWIG_MAX_PENDING)
+        return; // App isn't polling, one more error report doesn't help. Keeps room for every pool frame.
+
+    decoder->completions[tail % TWIG_MAX_COMPLETIONS].frame = frame;
+    decoder->completions[tail % TWIG_MAX_COMPLETIONS].seq = seq;
+    atomic_store_explicit(&decoder->completion_tail, tail + 1, memory_order_release);
+}
+
+// App side only. Returns 0 if there was nothing to pop.
+static int twig_pop_completion(twig_h264_decoder_t *decoder, twig_completion_t *done) {
+    uint64_t head = atomic_load_explicit(&decoder->completion_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&decoder->completion_tail, memory_order_acquire))
+        return 0;
+
+    *done = decoder->completions[head % TWIG_MAX_COMPLETIONS];
+    atomic_store_explicit(&decoder->completion_head, head + 1, memory_order_release);
+    return 1;
+}
+
+int twig_pending(twig_h264_decoder_t *decoder) {
+    return (int)(atomic_load_explicit(&decoder->submit_seq, memory_order_acquire)
+               - atomic_load_explicit(&decoder->done_seq, memory_order_acquire));
+}
+
+// Caller holds service_lock. Whatever stream has the earliest deadline on its next job goes first. Without any
+// deadlines queued, stays on the last stream for up to its weight in access units while it has work, then goes
+// round the others starting after it. Streams without deadlines only get the VE when no deadline is waiting.
+static twig_h264_decoder_t *twig_next_stream(twig_dev_t *cedar) {
+    twig_h264_decoder_t *earliest = NULL;
+    uint64_t earliest_deadline = UINT64_MAX;
+    for (twig_h264_decoder_t *decoder = cedar->streams; decoder; decoder = decoder->next_stream) {
+        if (!twig_pending(decoder)) // Also makes the job below visible
+            continue;
+        uint64_t deadline = decoder->jobs[decoder->done_seq % TWIG_MAX_PENDING].deadline;
+        if (deadline && deadline < earliest_deadline) {
+            earliest = decoder;
+            earliest_deadline = deadline;
+        }
+    }
+    if (earliest) {
+        cedar->current = earliest;
+        cedar->current_turns = 1;
+        return earliest;
+    }
+
+    twig_h264_decoder_t *current = cedar->current;
+    if (current && twig_pending(current) && cedar->current_turns < current->weight) {
+        cedar->current_turns++;
+        return current;
+    }
+
+    twig_h264_decoder_t *decoder = current;
+    for (int i = 0; i < cedar->stream_count; i++) { // Comes back round to the last stream at the very end
+        decoder = (decoder && decoder->next_stream) ? decoder->next_stream : cedar->streams;
+        if (twig_pending(decoder)) {
+            cedar->current = decoder;
+            cedar->current_turns = 1;
+            return decoder;
+        }
+    }
+    return NULL;
+}
+
+// Decodes the oldest job of the stream and hands out whatever it bumped. decoding was set under queue_lock by
+// the caller, so the app keeps its hands off the pool until this clears it again.
+static void twig_run_job(twig_h264_decoder_t *decoder) {
+    uint64_t seq = atomic_load_explicit(&decoder->done_seq, memory_order_relaxed);
+    twig_job_t job = decoder->jobs[seq % TWIG_MAX_PENDING]; // The slot stays ours until done_seq moves past it
+
+    uint64_t start = twig_now_ns();
+    int may_drop = job.deadline && start + decoder->decode_ns > job.deadline; // Can't make it even if it went right now
+    int ret = twig_h264_decode_au(decoder, job.buf, job.offset, job.len, may_drop); // VE waits happen here, not in the caller
+    uint64_t end = twig_now_ns();
+    if (ret != 1) { // Dropped ones never reached the VE, they'd drag the estimate down
+        decoder->decode_ns = decoder->decode_ns ? decoder->decode_ns - decoder->decode_ns / 8 + (end - start) / 8 : end - start;
+        TWIG_STAT_STAGE_NS(decoder->cedar, TWIG_STAGE_DECODE, end - start);
+    }
+    TWIG_TRACE(decoder, TWIG_TRACE_DECODE, job.seq, ret == 1);
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    decoder->decoding = 0;
+    if (job.ring_end) // The VE is done reading it, producers can have the space back
+        atomic_store_explicit(&decoder->ring.tail, job.ring_end, memory_order_release);
+    twig_apply_returns(decoder);
+
+    for (int i = 0; i < decoder->ready_count; i++) // Zero or more frames, depending on how far the stream reorders
+        twig_push_completion(decoder, decoder->ready[i], job.seq);
+    decoder->ready_count = 0;
+    if (ret < 0)
+        twig_push_completion(decoder, NULL, job.seq);
+    if (ret == 1)
+        decoder->stats.dropped++;
+    else
+        decoder->stats.decoded++;
+    if (ret != 1 && job.deadline && end > job.deadline)
+        decoder->stats.late++;
+    decoder->stats.mmio_issued = decoder->shadow.issued; // Only the service thread writes these, the app reads the copy
+    decoder->stats.mmio_elided = decoder->shadow.elided;
+
+    atomic_store_explicit(&decoder->done_seq, seq + 1, memory_order_release);
+    pthread_cond_broadcast(&decoder->queue_cond);
+
+    uint64_t one = 1; // Once per access unit, even without output, so apps waiting on a free bitstream buffer wake up too
+    if (write(decoder->event_fd, &one, sizeof(one)) != sizeof(one))
+        TWIG_LOG(WARN, "WARNING: Failed to signal decode completion on the eventfd!\n");
+    pthread_mutex_unlock(&decoder->queue_lock); // Last touch, the decoder may be destroyed right after this
+}
+
+// The one thread that touches the VE. Streams only ever meet here, so none of them needs a lock to submit.
+static void *twig_service_main(void *arg) {
+    twig_dev_t *cedar = arg;
+
+    pthread_mutex_lock(&cedar->service_lock);
+    while (!cedar->service_stop) {
+        twig_h264_decoder_t *decoder = twig_next_stream(cedar);
+        if (!decoder) { // Sleep until the next submission. One that came in since the scan left the eventfd readable.
+            pthread_mutex_unlock(&cedar->service_lock);
+            uint64_t count;
+            if (read(cedar->service_fd, &count, sizeof(count)) != sizeof(count) && errno != EINTR)
+                TWIG_LOG(WARN, "WARNING: Failed to wait on the service eventfd!\n");
+            pthread_mutex_lock(&cedar->service_lock);
+            continue;
+        }
+
+        // Marked before service_lock goes, so a decoder being destroyed right now waits for this job to finish
+        pthread_mutex_lock(&decoder->queue_lock);
+        decoder->decoding = 1;
+        pthread_mutex_unlock(&decoder->queue_lock);
+        pthread_mutex_unlock(&cedar->service_lock);
+
+        twig_run_job(decoder);
+
+        pthread_mutex_lock(&cedar->service_lock);
+    }
+    pthread_mutex_unlock(&cedar->service_lock);
+    return NULL;
+}
+
+// Caller holds service_lock
+static int twig_service_start(twig_dev_t *cedar) {
+    cedar->service_fd = eventfd(0, EFD_CLOEXEC); // Blocking, the service thread sleeps in read()
+    if (cedar->service_fd < 0)
+        return -1;
+
+    cedar->service_stop = 0;
+    if (pthread_create(&cedar->service, NULL, twig_service_main, cedar) != 0) {
+        TWIG_LOG(ERROR, "ERROR: Failed to start the decode service thread!\n");
+        close(cedar->service_fd);
+        cedar->service_fd = -1;
+        return -1;
+    }
+    cedar->service_running = 1;
+    return 0;
+}
+
+void twig_service_stop(twig_dev_t *cedar) {
+    pthread_mutex_lock(&cedar->service_lock);
+    int running = cedar->service_running;
+    cedar->service_stop = 1;
+    pthread_mutex_unlock(&cedar->service_lock);
+    if (!running)
+        return;
+
+    uint64_t one = 1;
+    if (write(cedar->service_fd, &one, sizeof(one)) != sizeof(one))
+        TWIG_LOG(WARN, "WARNING: Failed to wake the service thread!\n");
+    pthread_join(cedar->service, NULL);
+    close(cedar->service_fd);
+    cedar->service_fd = -1;
+    cedar->service_running = 0;
+}
+
+int twig_async_init(twig_h264_decoder_t *decoder) {
+    // Counter mode, twig_h264_poll drains it so the fd stays readable only while something new happened
+    decoder->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (decoder->event_fd < 0)
+        return -1;
+
+    pthread_mutex_init(&decoder->queue_lock, NULL);
+    pthread_cond_init(&decoder->queue_cond, NULL);
+    atomic_init(&decoder->submit_seq, 0);
+    atomic_init(&decoder->done_seq, 0);
+    atomic_init(&decoder->completion_head, 0);
+    atomic_init(&decoder->completion_tail, 0);
+    decoder->return_count = 0;
+    decoder->decoding = 0;
+    decoder->weight = 1;
+
+    twig_dev_t *cedar = decoder->cedar;
+    pthread_mutex_lock(&cedar->service_lock);
+    int ret = cedar->service_running ? 0 : twig_service_start(cedar);
+    if (ret == 0) { // Last in the list, so streams get their turns in the order they were created
+        twig_h264_decoder_t **link = &cedar->streams;
+        while (*link)
+            link = &(*link)->next_stream;
+        *link = decoder;
+        decoder->next_stream = NULL;
+        cedar->stream_count++;
+    }
+    pthread_mutex_unlock(&cedar->service_lock);
+
+    if (ret < 0) {
+        pthread_cond_destroy(&decoder->queue_cond);
+        pthread_mutex_destroy(&decoder->queue_lock);
+        close(decoder->event_fd);
+        decoder->event_fd = -1;
+    }
+    return ret;
+}
+
+void twig_async_cleanup(twig_h264_decoder_t *decoder) {
+    twig_dev_t *cedar = decoder->cedar;
+    pthread_mutex_lock(&cedar->service_lock); // Out of the list, the service thread won't pick it again
+    for (twig_h264_decoder_t **link = &cedar->streams; *link; link = &(*link)->next_stream) {
+        if (*link == decoder) {
+            *link = decoder->next_stream;
+            cedar->stream_count--;
+            break;
+        }
+    }
+    if (cedar->current == decoder)
+        cedar->current = NULL;
+    pthread_mutex_unlock(&cedar->service_lock);
+
+    pthread_mutex_lock(&decoder->queue_lock); // But it may be in the middle of one, anything still queued is dropped
+    while (decoder->decoding)
+        pthread_cond_wait(&decoder->queue_cond, &decoder->queue_lock);
+    twig_apply_returns(decoder);
+    pthread_mutex_unlock(&decoder->queue_lock);
+
+    pthread_cond_destroy(&decoder->queue_cond);
+    pthread_mutex_destroy(&decoder->queue_lock);
+    if (decoder->event_fd >= 0)
+        close(decoder->event_fd);
+    decoder->event_fd = -1;
+}
+
+// Producer side, lock-free. One thread at a time per decoder, but any thread.
+int twig_queue_job(twig_h264_decoder_t *decoder, twig_mem_t *buf, size_t offset, size_t len, uint64_t ring_end, uint64_t deadline) {
+    uint64_t seq = atomic_load_explicit(&decoder->submit_seq, memory_order_relaxed);
+    if (seq - atomic_load_explicit(&decoder->done_seq, memory_order_acquire) >= TWIG_MAX_PENDING)
+        return -1; // Full, wait for the eventfd and poll something out first
+
+    twig_job_t *job = &decoder->jobs[seq % TWIG_MAX_PENDING];
+    job->buf = buf;
+    job->offset = offset;
+    job->len = len;
+    job->seq = seq + 1;
+    job->ring_end = ring_end;
+    job->deadline = deadline;
+    if (!deadline && decoder->frame_period_ns) // Live stream, has to be out before the next one arrives
+        job->deadline = twig_now_ns() + decoder->frame_period_ns;
+    atomic_store_explicit(&decoder->submit_seq, seq + 1, memory_order_release); // Publishes the job
+    TWIG_TRACE(decoder, TWIG_TRACE_SUBMIT, seq, len);
+
+    uint64_t one = 1;
+    if (write(decoder->cedar->service_fd, &one, sizeof(one)) != sizeof(one))
+        TWIG_LOG(WARN, "WARNING: Failed to wake the service thread!\n");
+    return 0;
+}
+
+// Access units the service thread decodes from this stream in a row before it moves on to the next stream with
+// work, 1 by default. A main stream that has to keep up next to a pile of substreams gets a bigger share this way,
+// and fewer switches between decoders. Takes effect right away.
+EXPORT int twig_h264_decoder_set_weight(twig_h264_decoder_t *decoder, int weight) {
+    if (!decoder || weight < 1 || weight > TWIG_MAX_PENDING)
+        return -1;
+
+    pthread_mutex_lock(&decoder->cedar->service_lock);
+    decoder->weight = weight;
+    pthread_mutex_unlock(&decoder->cedar->service_lock);
+    return 0;
+}
+
+// Gives every access unit submitted from now on a deadline one frame period after it came in, 0 turns that off.
+// The service thread then goes earliest deadline first, and drops non-reference pictures it can't get done in time.
+EXPORT int twig_h264_decoder_set_target_fps(twig_h264_decoder_t *decoder, int fps) {
+    if (!decoder || fps < 0)
+        return -1;
+
+    decoder->frame_period_ns = fps ? 1000000000ull / fps : 0;
+    return 0;
+}
+
+// Queues len bytes at the start of bitstream_buf as one access unit and returns right away.
+// The buffer has to stay untouched until it's been decoded, see twig_h264_get_pending.
+EXPORT int twig_h264_submit(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf, size_t len) {
+    if (!decoder || !bitstream_buf || len == 0 || len > bitstream_buf->size)
+        return -1;
+
+    return twig_queue_job(decoder, bitstream_buf, 0, len, 0, 0);
+}
+
+// Same as twig_h264_submit, with the CLOCK_MONOTONIC time in ns the picture should be decoded by. Streams with
+// the earliest deadline go first, and a non-reference picture that can't make its deadline anymore is dropped
+// instead of decoded. Reference pictures are always decoded, late or not. 0 means no deadline.
+EXPORT int twig_h264_submit_deadline(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf, size_t len, uint64_t deadline_ns) {
+    if (!decoder || !bitstream_buf || len == 0 || len > bitstream_buf->size)
+        return -1;
+
+    return twig_queue_job(decoder, bitstream_buf, 0, len, 0, deadline_ns);
+}
+
+// Returns 1 with the next frame in output order, 0 if nothing is ready yet, -1 if a submission failed.
+// Frames come out in POC order, so the first few submissions of a reordering stream produce nothing.
+EXPORT int twig_h264_poll(twig_h264_decoder_t *decoder, twig_mem_t **output_buf) {
+    if (!decoder || !output_buf)
+        return -1;
+
+    *output_buf = NULL;
+    uint64_t count; // Drained before looking, so anything the service thread finishes after this signals again
+    if (read(decoder->event_fd, &count, sizeof(count)) != sizeof(count) && errno != EAGAIN)
+        TWIG_LOG(WARN, "WARNING: Failed to drain the completion eventfd!\n");
+
+    twig_completion_t done;
+    if (!twig_pop_completion(decoder, &done))
+        return 0;
+
+    *output_buf = done.frame;
+    return done.frame ? 1 : -1;
+}
+
+// Readable once an access unit finishes decoding (with or without output), made for epoll/poll loops.
+// Keep calling twig_h264_poll until it returns 0 after every wakeup.
+EXPORT int twig_h264_get_fd(twig_h264_decoder_t *decoder) {
+    if (!decoder)
+        return -1;
+
+    return decoder->event_fd;
+}
+
+// How the stream fared against its deadlines so far, dropped pictures never show up in twig_h264_poll
+EXPORT int twig_h264_get_stream_stats(twig_h264_decoder_t *decoder, twig_stream_stats_t *stats) {
+    if (!decoder || !stats)
+        return -1;
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    *stats = decoder->stats;
+    pthread_mutex_unlock(&decoder->queue_lock);
+    return 0;
+}
+
+// Device-wide, so one call covers every stream sharing the VE. -1 (and all zeroes) when built without TWIG_ENABLE_STATS.
+EXPORT int twig_h264_get_stats(twig_h264_decoder_t *decoder, twig_stats_t *stats) {
+    if (!decoder || !stats)
+        return -1;
+
+    memset(stats, 0, sizeof(*stats));
+#ifdef TWIG_ENABLE_STATS
+    twig_dev_stats_t *dev = &decoder->cedar->stats;
+    for (int i = 0; i < TWIG_STAGE_COUNT; i++) {
+        stats->stages[i].count = atomic_load_explicit(&dev->stages[i].count, memory_order_relaxed);
+        stats->stages[i].total_ns = atomic_load_explicit(&dev->stages[i].total_ns, memory_order_relaxed);
+        for (int j = 0; j < TWIG_STATS_BUCKETS; j++)
+            stats->stages[i].hist[j] = atomic_load_explicit(&dev->stages[i].hist[j], memory_order_relaxed);
+    }
+    stats->mmio_reads = atomic_load_explicit(&dev->mmio_reads, memory_order_relaxed);
+    stats->mmio_writes = atomic_load_explicit(&dev->mmio_writes, memory_order_relaxed);
+    stats->vld_starts = atomic_load_explicit(&dev->vld_starts, memory_order_relaxed);
+    stats->ve_waits = atomic_load_explicit(&dev->ve_waits, memory_order_relaxed);
+    stats->slices = atomic_load_explicit(&dev->slices, memory_order_relaxed);
+    stats->frames = atomic_load_explicit(&dev->frames, memory_order_relaxed);
+    stats->allocs = atomic_load_explicit(&dev->allocs, memory_order_relaxed);
+    stats->bytes_in_use = atomic_load_explicit(&dev->bytes_in_use, memory_order_relaxed);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+// Copies out the newest events, oldest first. Slots being written right now are skipped, so the app can dump this
+// any time, even while streams are running. -1 unless built with TWIG_LOG_LEVEL 5.
+EXPORT int twig_h264_get_trace(twig_h264_decoder_t *decoder, twig_trace_event_t *events, int max_events) {
+    if (!decoder || !events || max_events < 0)
+        return -1;
+
+#ifdef TWIG_TRACING
+    twig_trace_ring_t *ring = &decoder->trace;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t first = head > TWIG_TRACE_SIZE ? head - TWIG_TRACE_SIZE : 0;
+    if (head - first > (uint64_t)max_events)
+        first = head - max_events;
+
+    int count = 0;
+    for (uint64_t seq = first; seq < head; seq++) {
+        twig_trace_slot_t *slot = &ring->slots[seq % TWIG_TRACE_SIZE];
+        twig_trace_event_t event = { .seq = seq };
+        uint64_t before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        event.time_ns = atomic_load_explicit(&slot->time_ns, memory_order_relaxed);
+        event.event = atomic_load_explicit(&slot->event, memory_order_relaxed);
+        event.arg0 = atomic_load_explicit(&slot->arg0, memory_order_relaxed);
+        event.arg1 = atomic_load_explicit(&slot->arg1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (before != seq + 1 || atomic_load_explicit(&slot->seq, memory_order_relaxed) != before)
+            continue; // Still being written, or already lapped by a newer event
+        events[count++] = event;
+    }
+    return count;
+#else
+    (void)max_events;
+    return -1;
+#endif
+}
+
+// Submitted access units not decoded yet. They're decoded in order, so only the newest this many bitstream buffers are still in use.
+EXPORT int twig_h264_get_pending(twig_h264_decoder_t *decoder) {
+    if (!decoder)
+        return -1;
+
+    return twig_pending(decoder);
+}
+
+EXPORT twig_mem_t *twig_h264_decode_frame(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf) {
+    if (!decoder || !bitstream_buf)
+        return NULL;
+
+    if (twig_pending(decoder)) {
+        TWIG_LOG(ERROR, "ERROR: twig_h264_decode_frame called with async submissions still outstanding!\n");
+        return NULL;
+    }
+
+    if (twig_h264_submit(decoder, bitstream_buf, bitstream_buf->size) < 0)
+        return NULL;
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    while (twig_pending(decoder))
+        pthread_cond_wait(&decoder->queue_cond, &decoder->queue_lock);
+    pthread_mutex_unlock(&decoder->queue_lock);
+
+    twig_mem_t *output_buf; // NULL while the reorder window fills up, twig_h264_flush gets the rest out at the end
+    twig_h264_poll(decoder, &output_buf);
+    return output_buf;
+}
+
+// End of stream: waits for anything still decoding, then hands out the remaining frames in POC order, one per call.
+// Returns NULL once everything is out.
+EXPORT twig_mem_t *twig_h264_flush(twig_h264_decoder_t *decoder) {
+    if (!decoder)
+        return NULL;
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    while (twig_pending(decoder))
+        pthread_cond_wait(&decoder->queue_cond, &decoder->queue_lock);
+
+    twig_mem_t *output_buf = NULL;
+    twig_completion_t done;
+    while (!output_buf && twig_pop_completion(decoder, &done)) // Already bumped ones go first, failed submissions are skipped
+        output_buf = done.frame;
+
+    if (!output_buf) { // Nothing queued, and the service thread needs queue_lock to start on us, so the pool is ours
+        twig_frame_t *frame = twig_bump_frame(&decoder->frame_pool);
+        if (frame)
+            output_buf = twig_frame_output(&decoder->frame_pool, frame);
+    }
+    pthread_mutex_unlock(&decoder->queue_lock);
+    return output_buf;
+}
+
+EXPORT void twig_h264_return_frame(twig_h264_decoder_t *decoder, twig_mem_t *output_buf) {
+    if (!decoder || !output_buf)
+        return;
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    while (decoder->decoding && decoder->return_count == MAX_FRAME_POOL_SIZE)
+        pthread_cond_wait(&decoder->queue_cond, &decoder->queue_lock); // Shouldn't happen, but don't drop a frame
+
+    if (decoder->decoding)
+        decoder->returns[decoder->return_count++] = output_buf; // Service thread is in the pool, let it apply this after
+    else
+        twig_h264_release_frame(decoder, output_buf);
+    pthread_mutex_unlock(&decoder->queue_lock);
+}
\ No newline at end of file
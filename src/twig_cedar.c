@@ -0,0 +1,131 @@
+#include "twig.h"
+#include "twig_dev.h"
+#include "twig_regs.h"
+#include "twig_log.h"
+#include "allwinner/cedardev_api.h"
+
+twig_mem_t *twig_ion_alloc_mem(int cedar_fd, int dev_fd, size_t size, unsigned int flags);
+twig_mem_t *twig_ion_import_mem(int cedar_fd, int fd, size_t size);
+void twig_ion_flush_mem(twig_mem_t *pub_mem, size_t offset, size_t len);
+void twig_ion_invalidate_mem(twig_mem_t *pub_mem, size_t offset, size_t len);
+void twig_ion_free_mem(int cedar_fd, twig_mem_t *pub_mem);
+
+struct cedar_priv {
+    int ion_fd; // /dev/ion, one per device and opened up front so allocations from any thread can share it
+};
+
+static int cedar_open(twig_dev_t *cedar) {
+    struct cedar_priv *priv = calloc(1, sizeof(*priv));
+    if (!priv)
+        return -1;
+
+    priv->ion_fd = open("/dev/ion", O_RDWR | O_CLOEXEC);
+    if (priv->ion_fd < 0)
+        goto err_free;
+
+    cedar->fd = open("/dev/cedar_dev", O_RDWR);
+    if (cedar->fd == -1)
+        goto err_close_ion;
+
+    cedar->regs = mmap(NULL, VE_REGS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, cedar->fd, VE_BASE);
+    if (cedar->regs == MAP_FAILED)
+        goto err_close;
+
+    if(twig_readl(cedar, VE_CTRL) & 0x00000001) {
+        TWIG_LOG(WARN, "WARNING: Cedar VE is still in H.264 mode, but twig_open was called again!\n");
+        TWIG_LOG(WARN, "         Forcing a hardware reset in case the previous instance crashed!\n");
+        TWIG_LOG(WARN, "         (Several streams can share one device, twig_h264_decoder_init it once per stream)\n");
+        ioctl(cedar->fd, IOCTL_SET_REFCOUNT, 0);
+    }
+
+    if (ioctl(cedar->fd, IOCTL_ENABLE_VE, 0) < 0)
+        goto err_unmap;
+
+    if (ioctl(cedar->fd, IOCTL_ENGINE_REQ, 0) < 0)
+        goto err_disable;
+
+    cedar->priv = priv;
+    return 0;
+
+err_disable:
+    ioctl(cedar->fd, IOCTL_DISABLE_VE, 0);
+err_unmap:
+    munmap(cedar->regs, VE_REGS_SIZE);
+err_close:
+    cedar->regs = NULL;
+    close(cedar->fd);
+    cedar->fd = -1;
+err_close_ion:
+    close(priv->ion_fd);
+err_free:
+    free(priv);
+    return -1;
+}
+
+static void cedar_close(twig_dev_t *cedar) {
+    munmap(cedar->regs, VE_REGS_SIZE);
+    cedar->regs = NULL;
+
+    ioctl(cedar->fd, IOCTL_ENGINE_REL, 0);
+    ioctl(cedar->fd, IOCTL_DISABLE_VE, 0);
+
+    close(cedar->fd);
+    cedar->fd = -1;
+
+    struct cedar_priv *priv = cedar->priv;
+    close(priv->ion_fd);
+    free(priv);
+    cedar->priv = NULL;
+}
+
+// Only reached if something clears the direct mapping, twig_readl/twig_writel normally go straight to MMIO
+static uint32_t cedar_readl(twig_dev_t *cedar, uint32_t reg) {
+    return *((volatile uint32_t*)(cedar->regs + reg));
+}
+
+static void cedar_writel(twig_dev_t *cedar, uint32_t reg, uint32_t value) {
+    *((volatile uint32_t*)(cedar->regs + reg)) = value;
+}
+
+static int cedar_wait(twig_dev_t *cedar) {
+    int ret = ioctl(cedar->fd, IOCTL_WAIT_VE_DE, 1);
+    if (ret < 0)
+        return -1;
+
+    return 0;
+}
+
+static twig_mem_t *cedar_alloc(twig_dev_t *cedar, size_t size, unsigned int flags) {
+    struct cedar_priv *priv = cedar->priv;
+    return twig_ion_alloc_mem(cedar->fd, priv->ion_fd, size, flags);
+}
+
+static twig_mem_t *cedar_import(twig_dev_t *cedar, int fd, size_t size) {
+    return twig_ion_import_mem(cedar->fd, fd, size);
+}
+
+static void cedar_flush(twig_dev_t *cedar, twig_mem_t *mem, size_t offset, size_t len) {
+    twig_ion_flush_mem(mem, offset, len);
+}
+
+static void cedar_invalidate(twig_dev_t *cedar, twig_mem_t *mem, size_t offset, size_t len) {
+    twig_ion_invalidate_mem(mem, offset, len);
+}
+
+static void cedar_free(twig_dev_t *cedar, twig_mem_t *mem) {
+    twig_ion_free_mem(cedar->fd, mem);
+}
+
+const twig_backend_t twig_cedar_backend = {
+    .name = "cedar",
+    .open = cedar_open,
+    .close = cedar_close,
+    .readl = cedar_readl,
+    .writel = cedar_writel,
+    .wait = cedar_wait,
+    .alloc = cedar_alloc,
+    .import = cedar_import,
+    .flush = cedar_flush,
+    .invalidate = cedar_invalidate,
+    .free = cedar_free,
+};
\ No newline at end of file
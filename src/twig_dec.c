@@ -1,6 +1,9 @@
 #include "twig.h"
 #include "twig_bits.h"
 #include "twig_dec.h"
+#include "twig_regs.h"
+#include "twig_scan.h"
+#include "twig_log.h"
 
 #define EXPORT __attribute__((visibility ("default")))
 
@@ -40,43 +43,33 @@ static const uint8_t default_8x8_inter[64] = {
     24, 25, 27, 28, 30, 32, 33, 35
 };
 
-static int twig_find_nal_header(const uint8_t *data, int len, int start) {
-    int pos = start;
-    while (pos + 3 < len) { // Make sure that we're not trying to read past EOF
-        if (data[pos] == 0x00 && data[pos + 1] == 0x00) {
-            if (data[pos + 2] == 0x01)
-                return pos + 3; // 3-byte start code + header
-
-            if (pos + 4 <= len && data[pos + 2] == 0x00 && data[pos + 3] == 0x01)
-                return pos + 4; // 4-byte start code + header
-        }
-        pos++;
-    }
-    return len; // No NAL header found, probably EOF
-}
-
-static int twig_find_slice(const uint8_t *data, int len, int start) {
-    int pos = start;
+// One pass over the access unit, every later stage walks this table instead of the buffer
+static int twig_index_nals(twig_h264_decoder_t *decoder, const uint8_t *data, int len) {
+    decoder->nal_count = 0;
+    int pos = twig_find_nal_header(data, len, 0);
     while (pos < len) {
-        pos = twig_find_nal_header(data, len, pos);
-        if (pos < 0 || pos >= len) // Make sure the start code isn't EOF
+        int next_pos = twig_find_nal_header(data, len, pos);
+        if (decoder->nal_count == TWIG_MAX_NALS) {
+            TWIG_LOG(WARN, "WARNING: More than %d NAL units in one access unit, ignoring the rest!\n", TWIG_MAX_NALS);
             break;
+        }
 
-        uint8_t nal_type = data[pos] & 0x1f;
-        if (nal_type == NAL_SLICE || nal_type == NAL_IDR_SLICE) // Type 1 (Non-IDR) or Type 5 (IDR) only
-            return pos; // Valid slice, return its header position
-
-        pos++;
+        twig_nal_t *nal = &decoder->nals[decoder->nal_count++];
+        nal->offset = pos;
+        nal->size = (next_pos < len ? next_pos - 3 : len) - pos; // Any leading zero of a 4-byte start code just reads as trailing_zero_8bits
+        nal->type = data[pos] & 0x1f;
+        nal->ref_idc = (data[pos] >> 5) & 0x3;
+        pos = next_pos;
     }
-    return len; // No more slices, probably EOF
+    return decoder->nal_count;
 }
 
-static int twig_parse_pred_weight_table(void *regs, twig_h264_hdr_t *hdr) {
+static int twig_parse_pred_weight_table(twig_bits_t *bits, twig_h264_hdr_t *hdr, twig_slice_t *slice) {
     int i, j, ChromaArrayType = 1; // NOTE: Currently assumes 1 (YUV420), may need to find out how to detect later?
-    uint8_t luma_log2_weight_denom = twig_get_ue(regs);
+    uint8_t luma_log2_weight_denom = twig_get_ue(bits);
     uint8_t chroma_log2_weight_denom = 0;
     if (ChromaArrayType != 0)
-        chroma_log2_weight_denom = twig_get_ue(regs);
+        chroma_log2_weight_denom = twig_get_ue(bits);
 
     int8_t luma_weight_l0[32], luma_offset_l0[32];
     int8_t chroma_weight_l0[32][2], chroma_offset_l0[32][2]; 
@@ -96,17 +89,17 @@ static int twig_parse_pred_weight_table(void *regs, twig_h264_hdr_t *hdr) {
     }
 
     for (i = 0; i <= hdr->num_ref_idx_l0_active_minus1; i++) {
-        int luma_weight_l0_flag = twig_get_1bit(regs);
+        int luma_weight_l0_flag = twig_get_1bit(bits);
         if (luma_weight_l0_flag) {
-            luma_weight_l0[i] = twig_get_se(regs);
-            luma_offset_l0[i] = twig_get_se(regs);
+            luma_weight_l0[i] = twig_get_se(bits);
+            luma_offset_l0[i] = twig_get_se(bits);
         }
         if (ChromaArrayType != 0) {
-            int chroma_weight_l0_flag = twig_get_1bit(regs);
+            int chroma_weight_l0_flag = twig_get_1bit(bits);
             if (chroma_weight_l0_flag) {
                 for (j = 0; j < 2; j++) {
-                    chroma_weight_l0[i][j] = twig_get_se(regs);
-                    chroma_offset_l0[i][j] = twig_get_se(regs);
+                    chroma_weight_l0[i][j] = twig_get_se(bits);
+                    chroma_offset_l0[i][j] = twig_get_se(bits);
                 }
             }
         }
@@ -114,61 +107,50 @@ static int twig_parse_pred_weight_table(void *regs, twig_h264_hdr_t *hdr) {
 
     if (hdr->slice_type == SLICE_TYPE_B) {
         for (i = 0; i <= hdr->num_ref_idx_l1_active_minus1; i++) {
-            int luma_weight_l1_flag = twig_get_1bit(regs);
+            int luma_weight_l1_flag = twig_get_1bit(bits);
             if (luma_weight_l1_flag) {
-                luma_weight_l1[i] = twig_get_se(regs);
-                luma_offset_l1[i] = twig_get_se(regs);
+                luma_weight_l1[i] = twig_get_se(bits);
+                luma_offset_l1[i] = twig_get_se(bits);
             }
             if (ChromaArrayType != 0) {
-                int chroma_weight_l1_flag = twig_get_1bit(regs);
+                int chroma_weight_l1_flag = twig_get_1bit(bits);
                 if (chroma_weight_l1_flag) {
                     for (j = 0; j < 2; j++) {
-                        chroma_weight_l1[i][j] = twig_get_se(regs);
-                        chroma_offset_l1[i][j] = twig_get_se(regs);
+                        chroma_weight_l1[i][j] = twig_get_se(bits);
+                        chroma_offset_l1[i][j] = twig_get_se(bits);
                     }
                 }
             }
         }
     }
 
-    void *h264_base = regs + H264_OFFSET;
-
-    twig_writel(h264_base, H264_PRED_WEIGHT, 
-                ((chroma_log2_weight_denom & 0xf) << 4) |
-                ((luma_log2_weight_denom & 0xf) << 0));
-
-    twig_writel(h264_base, H264_RAM_WRITE_PTR, VE_SRAM_H264_PRED_WEIGHT_TABLE);
+    // Only fill in the SRAM image here, the VE may still be busy with the slice before this one
+    uint32_t *table = slice->pred_weight_table;
+    slice->pred_weight = ((chroma_log2_weight_denom & 0xf) << 4) | ((luma_log2_weight_denom & 0xf) << 0);
+    slice->has_pred_weights = 1;
 
     for (i = 0; i < 32; i++)
-        twig_writel(h264_base, H264_RAM_WRITE_DATA,
-                    ((luma_offset_l0[i] & 0x1ff) << 16) |
-                    (luma_weight_l0[i] & 0xff));
+        *table++ = ((luma_offset_l0[i] & 0x1ff) << 16) | (luma_weight_l0[i] & 0xff);
 
     for (i = 0; i < 32; i++)
         for (j = 0; j < 2; j++)
-            twig_writel(h264_base, H264_RAM_WRITE_DATA,
-                        ((chroma_offset_l0[i][j] & 0x1ff) << 16) |
-                        (chroma_weight_l0[i][j] & 0xff));
+            *table++ = ((chroma_offset_l0[i][j] & 0x1ff) << 16) | (chroma_weight_l0[i][j] & 0xff);
 
     for (i = 0; i < 32; i++)
-        twig_writel(h264_base, H264_RAM_WRITE_DATA,
-                    ((luma_offset_l1[i] & 0x1ff) << 16) |
-                    (luma_weight_l1[i] & 0xff));
+        *table++ = ((luma_offset_l1[i] & 0x1ff) << 16) | (luma_weight_l1[i] & 0xff);
 
     for (i = 0; i < 32; i++)
         for (j = 0; j < 2; j++)
-            twig_writel(h264_base, H264_RAM_WRITE_DATA,
-                        ((chroma_offset_l1[i][j] & 0x1ff) << 16) |
-                        (chroma_weight_l1[i][j] & 0xff));
+            *table++ = ((chroma_offset_l1[i][j] & 0x1ff) << 16) | (chroma_weight_l1[i][j] & 0xff);
 
     return 0;
 }
 
-static void twig_parse_scaling_list_4x4(void *regs, uint8_t *scaling_list) {
+static void twig_parse_scaling_list_4x4(twig_bits_t *bits, uint8_t *scaling_list) {
     int last_scale = 8, next_scale = 8;
     for (int j = 0; j < 16; j++) {
         if (next_scale != 0) {
-            int delta_scale = twig_get_se(regs);
+            int delta_scale = twig_get_se(bits);
             next_scale = (last_scale + delta_scale + 256) % 256;
         }
         scaling_list[j] = (next_scale == 0) ? last_scale : next_scale;
@@ -176,11 +158,11 @@ static void twig_parse_scaling_list_4x4(void *regs, uint8_t *scaling_list) {
     }
 }
 
-static void twig_parse_scaling_list_8x8(void *regs, uint8_t *scaling_list) {
+static void twig_parse_scaling_list_8x8(twig_bits_t *bits, uint8_t *scaling_list) {
     int last_scale = 8, next_scale = 8;
     for (int j = 0; j < 64; j++) {
         if (next_scale != 0) {
-            int delta_scale = twig_get_se(regs);
+            int delta_scale = twig_get_se(bits);
             next_scale = (last_scale + delta_scale + 256) % 256;
         }
         scaling_list[j] = (next_scale == 0) ? last_scale : next_scale;
@@ -232,7 +214,7 @@ static int twig_are_scaling_lists_default(twig_h264_sps_t *sps, twig_h264_pps_t
     return 1;
 }
 
-static void twig_write_scaling_lists(void *h264_base, twig_h264_sps_t *sps, twig_h264_pps_t *pps) {
+static void twig_write_scaling_lists(twig_cmd_list_t *cmds, twig_shadow_t *shadow, twig_h264_sps_t *sps, twig_h264_pps_t *pps) {
     uint8_t final_4x4[6][16];
     uint8_t final_8x8[2][64];
     
@@ -267,46 +249,137 @@ static void twig_write_scaling_lists(void *h264_base, twig_h264_sps_t *sps, twig
         memcpy(final_8x8[i], source_list, 64);
     }
     
-    twig_writel(h264_base, H264_RAM_WRITE_PTR, VE_SRAM_H264_SCALING_LISTS);
-    
-    const uint32_t *sl8 = (const uint32_t *)&final_8x8[0][0];
-    for (int i = 0; i < 2 * 64 / 4; i++) {
-        twig_writel(h264_base, H264_RAM_WRITE_DATA, sl8[i]);
+    uint32_t words[(2 * 64 + 6 * 16) / 4]; // 8x8 lists first, then the 4x4 ones
+    memcpy(words, final_8x8, sizeof(final_8x8));
+    memcpy(words + sizeof(final_8x8) / 4, final_4x4, sizeof(final_4x4));
+    twig_shadow_write_sram(cmds, shadow, VE_SRAM_H264_SCALING_LISTS, words, sizeof(words) / 4);
+}
+
+static void twig_skip_hrd_parameters(twig_bits_t *bits) {
+    uint32_t cpb_cnt_minus1 = twig_get_ue(bits);
+    twig_skip_bits(bits, 8); // bit_rate_scale + cpb_size_scale
+    for (uint32_t i = 0; i <= cpb_cnt_minus1 && i < 32; i++) {
+        twig_get_ue(bits); // bit_rate_value_minus1
+        twig_get_ue(bits); // cpb_size_value_minus1
+        twig_skip_1bit(bits); // cbr_flag
     }
-    
-    const uint32_t *sl4 = (const uint32_t *)&final_4x4[0][0];
-    for (int i = 0; i < 6 * 16 / 4; i++) {
-        twig_writel(h264_base, H264_RAM_WRITE_DATA, sl4[i]);
+    twig_skip_bits(bits, 20); // Four 5-bit delay/offset lengths
+}
+
+// Everything up to bitstream_restriction is skipped, it's only there to size the output queue
+static void twig_parse_vui(twig_bits_t *bits, twig_h264_sps_t *sps) {
+    if (twig_get_1bit(bits)) { // aspect_ratio_info_present_flag
+        if (twig_get_bits(bits, 8) == 255) // Extended_SAR
+            twig_skip_bits(bits, 32);
+    }
+    if (twig_get_1bit(bits)) // overscan_info_present_flag
+        twig_skip_1bit(bits);
+    if (twig_get_1bit(bits)) { // video_signal_type_present_flag
+        twig_skip_bits(bits, 4);
+        if (twig_get_1bit(bits)) // colour_description_present_flag
+            twig_skip_bits(bits, 24);
+    }
+    if (twig_get_1bit(bits)) { // chroma_loc_info_present_flag
+        twig_get_ue(bits);
+        twig_get_ue(bits);
+    }
+    if (twig_get_1bit(bits)) { // timing_info_present_flag
+        twig_skip_bits(bits, 32);
+        twig_skip_bits(bits, 32);
+        twig_skip_1bit(bits);
+    }
+    int nal_hrd = twig_get_1bit(bits);
+    if (nal_hrd)
+        twig_skip_hrd_parameters(bits);
+    int vcl_hrd = twig_get_1bit(bits);
+    if (vcl_hrd)
+        twig_skip_hrd_parameters(bits);
+    if (nal_hrd || vcl_hrd)
+        twig_skip_1bit(bits); // low_delay_hrd_flag
+    twig_skip_1bit(bits); // pic_struct_present_flag
+
+    sps->bitstream_restriction_flag = twig_get_1bit(bits);
+    if (sps->bitstream_restriction_flag) {
+        twig_skip_1bit(bits); // motion_vectors_over_pic_boundaries_flag
+        twig_get_ue(bits);    // max_bytes_per_pic_denom
+        twig_get_ue(bits);    // max_bits_per_mb_denom
+        twig_get_ue(bits);    // log2_max_mv_length_horizontal
+        twig_get_ue(bits);    // log2_max_mv_length_vertical
+        sps->max_num_reorder_frames = twig_get_ue(bits);
+        sps->max_dec_frame_buffering = twig_get_ue(bits);
+        if (bits->overrun) // Plenty of encoders truncate the VUI, don't trust what we got
+            sps->bitstream_restriction_flag = 0;
+    }
+}
+
+// MaxDpbFrames from Table A-1 when the stream doesn't tell us how much reordering it does
+static void twig_set_reorder_defaults(twig_h264_sps_t *sps) {
+    int frame_mbs = (sps->pic_width_in_mbs_minus1 + 1) * (sps->pic_height_in_mbs_minus1 + 1);
+    int max_dpb_mbs;
+    switch (sps->level_idc) {
+        case 9: case 10: max_dpb_mbs = 396; break;
+        case 11: max_dpb_mbs = (sps->constraint_set_flags & 0x10) ? 396 : 900; break; // Level 1b
+        case 12: case 13: case 20: max_dpb_mbs = 2376; break;
+        case 21: max_dpb_mbs = 4752; break;
+        case 22: case 30: max_dpb_mbs = 8100; break;
+        case 31: max_dpb_mbs = 18000; break;
+        case 32: max_dpb_mbs = 20480; break;
+        case 40: case 41: max_dpb_mbs = 32768; break;
+        case 42: max_dpb_mbs = 34816; break;
+        case 50: max_dpb_mbs = 110400; break;
+        case 51: case 52: max_dpb_mbs = 184320; break;
+        default: max_dpb_mbs = 696320; break; // Level 6+ or garbage, assume the worst
+    }
+    int max_dpb_frames = max_dpb_mbs / frame_mbs;
+    if (max_dpb_frames > 16)
+        max_dpb_frames = 16;
+    if (max_dpb_frames < sps->max_num_ref_frames)
+        max_dpb_frames = sps->max_num_ref_frames;
+
+    if (!sps->bitstream_restriction_flag) {
+        sps->max_dec_frame_buffering = max_dpb_frames;
+        // POC type 2 is output order by definition, Baseline has no B-frames and intra-only profiles have no references
+        int intra_only = (sps->constraint_set_flags & 0x10) && (sps->profile_idc == 44 || sps->profile_idc == 86 ||
+                         sps->profile_idc == 100 || sps->profile_idc == 110 || sps->profile_idc == 122 || sps->profile_idc == 244);
+        if (sps->pic_order_cnt_type == 2 || sps->profile_idc == 66 || intra_only)
+            sps->max_num_reorder_frames = 0;
+        else
+            sps->max_num_reorder_frames = max_dpb_frames;
     }
+
+    if (sps->max_dec_frame_buffering > 16)
+        sps->max_dec_frame_buffering = 16;
+    if (sps->max_num_reorder_frames > sps->max_dec_frame_buffering)
+        sps->max_num_reorder_frames = sps->max_dec_frame_buffering;
 }
 
-static int twig_parse_sps(void *regs, twig_h264_sps_t *sps) {
+static int twig_parse_sps(twig_bits_t *bits, twig_h264_sps_t *sps) {
     memset(sps, 0, sizeof(twig_h264_sps_t));
 
-    sps->profile_idc = twig_get_bits(regs, 8);
-    twig_skip_bits(regs, 8);
-    sps->level_idc = twig_get_bits(regs, 8);
-    twig_get_ue(regs);
+    sps->profile_idc = twig_get_bits(bits, 8);
+    sps->constraint_set_flags = twig_get_bits(bits, 8);
+    sps->level_idc = twig_get_bits(bits, 8);
+    twig_get_ue(bits);
     if (sps->profile_idc >= 100) {
-        sps->chroma_format_idc = twig_get_ue(regs);
+        sps->chroma_format_idc = twig_get_ue(bits);
         if (sps->chroma_format_idc == 3) {
-            twig_skip_1bit(regs);
+            twig_skip_1bit(bits);
         }
-        sps->bit_depth_luma_minus8 = twig_get_ue(regs);
-        sps->bit_depth_chroma_minus8 = twig_get_ue(regs);
-        twig_skip_1bit(regs);
+        sps->bit_depth_luma_minus8 = twig_get_ue(bits);
+        sps->bit_depth_chroma_minus8 = twig_get_ue(bits);
+        twig_skip_1bit(bits);
         if (sps->profile_idc == 100 || sps->profile_idc == 110 || sps->profile_idc == 122 ||
             sps->profile_idc == 244 || sps->profile_idc == 44 || sps->profile_idc == 83 ||
             sps->profile_idc == 86 || sps->profile_idc == 118 || sps->profile_idc == 128) {
-            sps->seq_scaling_matrix_present_flag = twig_get_1bit(regs);
+            sps->seq_scaling_matrix_present_flag = twig_get_1bit(bits);
             if (sps->seq_scaling_matrix_present_flag) {
                 for (int i = 0; i < 8; i++) {
-                    sps->seq_scaling_list_present_flag[i] = twig_get_1bit(regs);
+                    sps->seq_scaling_list_present_flag[i] = twig_get_1bit(bits);
                     if (sps->seq_scaling_list_present_flag[i]) {
                         if (i < 6)
-                            twig_parse_scaling_list_4x4(regs, sps->scaling_list_4x4[i]);
+                            twig_parse_scaling_list_4x4(bits, sps->scaling_list_4x4[i]);
                         else
-                            twig_parse_scaling_list_8x8(regs, sps->scaling_list_8x8[i-6]);
+                            twig_parse_scaling_list_8x8(bits, sps->scaling_list_8x8[i-6]);
                     }
                 }
             }
@@ -317,68 +390,74 @@ static int twig_parse_sps(void *regs, twig_h264_sps_t *sps) {
         sps->bit_depth_chroma_minus8 = 0;
     }
 
-    sps->log2_max_frame_num_minus4 = twig_get_ue(regs);
-    sps->pic_order_cnt_type = twig_get_ue(regs);
+    sps->log2_max_frame_num_minus4 = twig_get_ue(bits);
+    sps->pic_order_cnt_type = twig_get_ue(bits);
     if (sps->pic_order_cnt_type == 0) {
-        sps->log2_max_pic_order_cnt_lsb_minus4 = twig_get_ue(regs);
+        sps->log2_max_pic_order_cnt_lsb_minus4 = twig_get_ue(bits);
     } else if (sps->pic_order_cnt_type == 1) {
-        sps->delta_pic_order_always_zero_flag = twig_get_1bit(regs);
-        twig_get_se(regs);
-        twig_get_se(regs);
-        uint32_t num_ref_frames_in_poc_cycle = twig_get_ue(regs);
+        sps->delta_pic_order_always_zero_flag = twig_get_1bit(bits);
+        twig_get_se(bits);
+        twig_get_se(bits);
+        uint32_t num_ref_frames_in_poc_cycle = twig_get_ue(bits);
         for (uint32_t i = 0; i < num_ref_frames_in_poc_cycle; i++) {
-            twig_get_se(regs);
+            twig_get_se(bits);
         }
     }
 
-    sps->max_num_ref_frames = twig_get_ue(regs);
-    sps->gaps_in_frame_num_value_allowed_flag = twig_get_1bit(regs);
-    sps->pic_width_in_mbs_minus1 = twig_get_ue(regs);
-    sps->pic_height_in_map_units_minus1 = twig_get_ue(regs);
-    sps->frame_mbs_only_flag = twig_get_1bit(regs);
+    sps->max_num_ref_frames = twig_get_ue(bits);
+    sps->gaps_in_frame_num_value_allowed_flag = twig_get_1bit(bits);
+    sps->pic_width_in_mbs_minus1 = twig_get_ue(bits);
+    sps->pic_height_in_map_units_minus1 = twig_get_ue(bits);
+    sps->frame_mbs_only_flag = twig_get_1bit(bits);
     if (!sps->frame_mbs_only_flag) {
-        sps->mb_adaptive_frame_field_flag = twig_get_1bit(regs);
+        sps->mb_adaptive_frame_field_flag = twig_get_1bit(bits);
         sps->pic_height_in_mbs_minus1 = (sps->pic_height_in_map_units_minus1 + 1) * 2 - 1;
     } else {
         sps->pic_height_in_mbs_minus1 = sps->pic_height_in_map_units_minus1;
     }
 
-    sps->direct_8x8_inference_flag = twig_get_1bit(regs);
-    sps->frame_cropping_flag = twig_get_1bit(regs);
+    sps->direct_8x8_inference_flag = twig_get_1bit(bits);
+    sps->frame_cropping_flag = twig_get_1bit(bits);
     if (sps->frame_cropping_flag) {
-        sps->frame_crop_left_offset = twig_get_ue(regs);
-        sps->frame_crop_right_offset = twig_get_ue(regs);
-        sps->frame_crop_top_offset = twig_get_ue(regs);
-        sps->frame_crop_bottom_offset = twig_get_ue(regs);
+        sps->frame_crop_left_offset = twig_get_ue(bits);
+        sps->frame_crop_right_offset = twig_get_ue(bits);
+        sps->frame_crop_top_offset = twig_get_ue(bits);
+        sps->frame_crop_bottom_offset = twig_get_ue(bits);
         
     }
+
+    sps->vui_parameters_present_flag = twig_get_1bit(bits);
+    if (sps->vui_parameters_present_flag)
+        twig_parse_vui(bits, sps);
+
+    twig_set_reorder_defaults(sps);
     return 0;
 }
 
-static int twig_parse_pps(void *regs, twig_h264_pps_t *pps, size_t pps_size) {
+static int twig_parse_pps(twig_bits_t *bits, twig_h264_pps_t *pps) {
     memset(pps, 0, sizeof(twig_h264_pps_t));
 
-    pps->pic_parameter_set_id = twig_get_ue(regs);
-    pps->seq_parameter_set_id = twig_get_ue(regs);
-    pps->entropy_coding_mode_flag = twig_get_1bit(regs);
-    pps->bottom_field_pic_order_in_frame_present_flag = twig_get_1bit(regs);
-    pps->num_slice_groups_minus1 = twig_get_ue(regs);
+    pps->pic_parameter_set_id = twig_get_ue(bits);
+    pps->seq_parameter_set_id = twig_get_ue(bits);
+    pps->entropy_coding_mode_flag = twig_get_1bit(bits);
+    pps->bottom_field_pic_order_in_frame_present_flag = twig_get_1bit(bits);
+    pps->num_slice_groups_minus1 = twig_get_ue(bits);
     if (pps->num_slice_groups_minus1 > 0) {
-        pps->slice_group_map_type = twig_get_ue(regs);
+        pps->slice_group_map_type = twig_get_ue(bits);
         if (pps->slice_group_map_type == 0) {
             for (int i = 0; i <= pps->num_slice_groups_minus1; i++) {
-                pps->run_length_minus1[i] = twig_get_ue(regs);
+                pps->run_length_minus1[i] = twig_get_ue(bits);
             }
         } else if (pps->slice_group_map_type == 2) {
             for (int i = 0; i < pps->num_slice_groups_minus1; i++) {
-                pps->top_left[i] = twig_get_ue(regs);
-                pps->bottom_right[i] = twig_get_ue(regs);
+                pps->top_left[i] = twig_get_ue(bits);
+                pps->bottom_right[i] = twig_get_ue(bits);
             }
         } else if (pps->slice_group_map_type >= 3 && pps->slice_group_map_type <= 5) {
-            pps->slice_group_change_direction_flag = twig_get_1bit(regs);
-            pps->slice_group_change_rate_minus1 = twig_get_ue(regs);
+            pps->slice_group_change_direction_flag = twig_get_1bit(bits);
+            pps->slice_group_change_rate_minus1 = twig_get_ue(bits);
         } else if (pps->slice_group_map_type == 6) {
-            pps->pic_size_in_map_units_minus1 = twig_get_ue(regs);
+            pps->pic_size_in_map_units_minus1 = twig_get_ue(bits);
             int map_units = pps->pic_size_in_map_units_minus1 + 1;
             int bits_needed = 1;
             while ((1 << bits_needed) <= pps->num_slice_groups_minus1) bits_needed++;
@@ -388,67 +467,109 @@ static int twig_parse_pps(void *regs, twig_h264_pps_t *pps, size_t pps_size) {
                 return -1;
 
             for (int i = 0; i < map_units; i++) {
-                pps->slice_group_id[i] = twig_get_bits(regs, bits_needed);
+                pps->slice_group_id[i] = twig_get_bits(bits, bits_needed);
             }
         }
     }
 
-    pps->num_ref_idx_l0_default_active_minus1 = twig_get_ue(regs);
-    pps->num_ref_idx_l1_default_active_minus1 = twig_get_ue(regs);
-    pps->weighted_pred_flag = twig_get_1bit(regs);
-    pps->weighted_bipred_idc = twig_get_bits(regs, 2);
-    pps->pic_init_qp_minus26 = twig_get_se(regs);
-    pps->pic_init_qs_minus26 = twig_get_se(regs);
-    pps->chroma_qp_index_offset = twig_get_se(regs);
-    pps->deblocking_filter_control_present_flag = twig_get_1bit(regs);
-    pps->constrained_intra_pred_flag = twig_get_1bit(regs);
-    pps->redundant_pic_cnt_present_flag = twig_get_1bit(regs);
-    if ((pps_size * 8) - twig_readl(regs, H264_VLD_OFFSET) > 0) {
-        pps->transform_8x8_mode_flag = twig_get_1bit(regs);
-        pps->pic_scaling_matrix_present_flag = twig_get_1bit(regs);
+    pps->num_ref_idx_l0_default_active_minus1 = twig_get_ue(bits);
+    pps->num_ref_idx_l1_default_active_minus1 = twig_get_ue(bits);
+    pps->weighted_pred_flag = twig_get_1bit(bits);
+    pps->weighted_bipred_idc = twig_get_bits(bits, 2);
+    pps->pic_init_qp_minus26 = twig_get_se(bits);
+    pps->pic_init_qs_minus26 = twig_get_se(bits);
+    pps->chroma_qp_index_offset = twig_get_se(bits);
+    pps->deblocking_filter_control_present_flag = twig_get_1bit(bits);
+    pps->constrained_intra_pred_flag = twig_get_1bit(bits);
+    pps->redundant_pic_cnt_present_flag = twig_get_1bit(bits);
+    if (twig_bits_more_rbsp_data(bits)) {
+        pps->transform_8x8_mode_flag = twig_get_1bit(bits);
+        pps->pic_scaling_matrix_present_flag = twig_get_1bit(bits);
         if (pps->pic_scaling_matrix_present_flag) {
             int loop_count = 6 + (pps->transform_8x8_mode_flag ? 2 : 0);
             for (int i = 0; i < loop_count; i++) {
-                pps->pic_scaling_list_present_flag[i] = twig_get_1bit(regs);
+                pps->pic_scaling_list_present_flag[i] = twig_get_1bit(bits);
                 if (pps->pic_scaling_list_present_flag[i]) {
                     if (i < 6)
-                        twig_parse_scaling_list_4x4(regs, pps->scaling_list_4x4[i]);
+                        twig_parse_scaling_list_4x4(bits, pps->scaling_list_4x4[i]);
                     else
-                        twig_parse_scaling_list_8x8(regs, pps->scaling_list_8x8[i-6]);
+                        twig_parse_scaling_list_8x8(bits, pps->scaling_list_8x8[i-6]);
                 }
             }
         }
-        pps->second_chroma_qp_index_offset = twig_get_se(regs);
+        pps->second_chroma_qp_index_offset = twig_get_se(bits);
     } else {
         pps->second_chroma_qp_index_offset = pps->chroma_qp_index_offset;
     }
     return 0;
 }
 
-static int twig_setup_vld_registers(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf) {
-    void *h264_base = decoder->ve_regs + H264_OFFSET;
+// Point the VLD at bits [bit_start, bit_end) of the buffer. With more_data set it stops at the end of the buffer
+// and asks for the rest (status bit 2) instead of treating that as the end of the slice.
+static void twig_vld_program(twig_cmd_list_t *cmds, twig_mem_t *bitstream_buf, size_t bit_start, size_t bit_end, int first, int more_data) {
+    uint32_t bitstream_addr = bitstream_buf->iommu_addr & ~0xf; // VLD_ADDR only holds 16-byte granular addresses...
+    uint32_t bit_offset = bit_start + (bitstream_buf->iommu_addr & 0xf) * 8; // ...so anything below that goes into the offset
+    uint32_t buffer_end = bitstream_buf->iommu_addr + (more_data ? bitstream_buf->size : (bit_end + 7) / 8); // Will be auto-padded to 1024 - 1 boundary (1KB)
+
+    // Bitstream address packing. Bit 30 is "first_slice_data", Bit 29 is "last_slice_data", Bit 28 is "slice_data_valid" 
+    uint32_t vld_addr = (bitstream_addr & 0x0ffffff0) | (bitstream_addr >> 28) | ((first & 0x1) << 30) | ((!more_data) << 29) | (0x1 << 28);
+
+    twig_cmd_add(cmds, H264_VLD_LEN, bit_end - bit_start); // Bits left from the seek point, not from VLD_ADDR
+    twig_cmd_add(cmds, H264_VLD_OFFSET, bit_offset);
+    twig_cmd_add(cmds, H264_VLD_END, buffer_end);
+    twig_cmd_add(cmds, H264_VLD_ADDR, vld_addr); 
+}
+
+// Point the VLD straight at a bit position in the access unit at offset/len and restart it there, no matter how far in it is.
+// Ring access units can run past the end of the buffer, returns how many bits of that wrapped part are still to come.
+static size_t twig_vld_seek(twig_cmd_list_t *cmds, twig_mem_t *bitstream_buf, size_t offset, size_t len, size_t bit_offset) {
+    size_t buffer_bits = bitstream_buf->size * 8;
+    size_t bit_start = offset * 8 + bit_offset;
+    size_t bit_end = (offset + len) * 8;
+    if (bit_start >= buffer_bits) { // Slice itself starts past the wrap, so it's all in one piece at the front
+        bit_start -= buffer_bits;
+        bit_end -= buffer_bits;
+    }
+
+    size_t wrapped_bits = (bit_end > buffer_bits) ? bit_end - buffer_bits : 0;
+    twig_vld_program(cmds, bitstream_buf, bit_start, bit_end - wrapped_bits, 1, wrapped_bits != 0);
+    twig_cmd_add(cmds, H264_TRIGGER, 0x7); // INIT_SWDEC, latches the above and restarts the bit engine
+    return wrapped_bits;
+}
+
+// Headers are parsed on the CPU, so the VLD only ever needs to land on the slice data
+static size_t twig_setup_vld_registers(twig_cmd_list_t *cmds, twig_mem_t *bitstream_buf, size_t offset, size_t len, size_t data_bit_offset) {
     // Bit 25 is "startcode_detect_enable" (WHAT HOW DOES THIS WORK)
     // Bit 24 is "eptb_detection_bypass" (eptb = Emulation PrevenTion Byte? May be necessary?)
     // Bit 10 is "mcri_cache_enable" (Macroblock Intraprediction Cache, maybe?)
     // Bit 8 is "write_rec_disable" (Disables writing reconstruced picture. We read from buffers directly, so this may be necessary?)
     uint32_t vld_ctrl = (0x1 << 25) | (0x1 << 24) | (0x1 << 10) | (0x1 << 8);
-    twig_writel(h264_base, H264_CTRL, vld_ctrl);
-
-    uint32_t bitstream_addr = bitstream_buf->iommu_addr;
-    uint32_t buffer_size = bitstream_buf->size * 8; // Size of the buffer in bits
-    uint32_t buffer_end = bitstream_addr + bitstream_buf->size; // Address of the end of the buffer, will be auto-padded to 1024 - 1 boundary (1KB)
+    twig_cmd_add(cmds, H264_CTRL, vld_ctrl);
 
-    // Bitstream address packing. Bit 30 is "first_slice_data", Bit 29 is "last_slice_data", Bit 28 is "slice_data_valid" 
-    uint32_t vld_addr = (bitstream_addr & 0x0ffffff0) | (bitstream_addr >> 28) | (0x1 << 30) | (0x1 << 29) | (0x1 << 28);
+    return twig_vld_seek(cmds, bitstream_buf, offset, len, data_bit_offset);
+}
 
-    // Write the needed values to their registers
-    twig_writel(h264_base, H264_VLD_LEN, buffer_size);
-    twig_writel(h264_base, H264_VLD_OFFSET, 0x0); // Set to 0 until this VLD wants to behave...
-    twig_writel(h264_base, H264_VLD_END, buffer_end);
-    twig_writel(h264_base, H264_VLD_ADDR, vld_addr); 
-    twig_writel(h264_base, H264_TRIGGER, 0x7); // Supposedly INIT_SWDEC, to start the bit reader?
+// Waits out one slice. If the VE hit VLD_END with data still to come, it asks for more instead of finishing,
+// so hand it the wrapped part from the start of the ring and let it carry on.
+static int twig_wait_for_slice(twig_dev_t *cedar, twig_mem_t *bitstream_buf, size_t wrapped_bits) {
+    int ret = twig_wait_for_ve(cedar);
+    if (ret == 0 && wrapped_bits && (twig_readl(cedar, H264_STATUS) & 0x4)) {
+        twig_cmd_list_t cmds = { 0 };
+        twig_vld_program(&cmds, bitstream_buf, 0, wrapped_bits, 0, 0);
+        twig_cmd_list_apply(cedar, &cmds);
+        twig_writel(cedar, H264_STATUS, 0x4); // Clearing the data request resumes the VLD
+        TWIG_STAT_ADD(cedar, vld_starts, 1);
+        ret = twig_wait_for_ve(cedar);
+    }
+    return ret;
+}
 
-    return 0;
+// Cache maintenance for just the access unit, in two pieces if it wraps
+static void twig_flush_bitstream(twig_mem_t *bitstream_buf, size_t offset, size_t len) {
+    size_t first = (offset + len > bitstream_buf->size) ? bitstream_buf->size - offset : len;
+    twig_flush_range(bitstream_buf, offset, first);
+    if (first < len)
+        twig_flush_range(bitstream_buf, 0, len - first);
 }
 
 // Dummy function, mainly to warn user at the moment
@@ -456,91 +577,91 @@ static int twig_validate_slice_groups(twig_h264_pps_t *pps) {
     if (!pps || pps->num_slice_groups_minus1 == 0)
         return 0;
     
-    fprintf(stderr, "WARNING: Stream uses slice groups (FMO) - type %d, %d groups\n", 
+    TWIG_LOG(WARN, "WARNING: Stream uses slice groups (FMO) - type %d, %d groups\n", 
             pps->slice_group_map_type, pps->num_slice_groups_minus1 + 1);
-    fprintf(stderr, "         Slice groups are parsed but not validated. Decode may fail.\n");
+    TWIG_LOG(WARN, "         Slice groups are parsed but not validated. Decode may fail.\n");
     
     return 0;
 }
 
-static int twig_parse_hdr(const uint8_t *data, twig_h264_decoder_t *decoder) {
-    if (!data || !decoder)
+static int twig_parse_hdr(twig_bits_t *bits, uint8_t nal_header, twig_h264_decoder_t *decoder, twig_slice_t *slice) {
+    if (!bits || !decoder)
         return -1;
 
     twig_h264_sps_t *sps = decoder->sps;
     twig_h264_pps_t *pps = decoder->pps;
-    twig_h264_hdr_t *hdr = decoder->hdr;
-    void *regs = decoder->ve_regs + H264_OFFSET;
+    twig_h264_hdr_t *hdr = &slice->hdr;
 
-    memset(decoder->hdr, 0, sizeof(twig_h264_hdr_t));
+    memset(hdr, 0, sizeof(twig_h264_hdr_t));
+    slice->has_pred_weights = 0;
 
-    hdr->nal_unit_type = data[0] & 0x1f;
+    hdr->nal_unit_type = nal_header & 0x1f;
 
-    hdr->first_mb_in_slice = twig_get_ue(regs);
+    hdr->first_mb_in_slice = twig_get_ue(bits);
     hdr->first_slice_in_pic = (hdr->first_mb_in_slice == 0) ? 1 : 0;
 
-    uint32_t slice_type = twig_get_ue(regs);
+    uint32_t slice_type = twig_get_ue(bits);
     if (slice_type > 9)
         return -1;
     hdr->slice_type = (slice_type > 4) ? slice_type - 5 : slice_type;
 
-    hdr->pic_parameter_set_id = twig_get_ue(regs);
+    hdr->pic_parameter_set_id = twig_get_ue(bits);
     if (hdr->pic_parameter_set_id >= 256)
         return -1;
 
-    hdr->frame_num = twig_get_bits(regs, sps->log2_max_frame_num_minus4 + 4);
+    hdr->frame_num = twig_get_bits(bits, sps->log2_max_frame_num_minus4 + 4);
 
     if (!sps->frame_mbs_only_flag) {
-        hdr->field_pic_flag = twig_get_1bit(regs);
+        hdr->field_pic_flag = twig_get_1bit(bits);
         if (hdr->field_pic_flag)
-            hdr->bottom_field_pic_flag = twig_get_1bit(regs);
+            hdr->bottom_field_pic_flag = twig_get_1bit(bits);
     }
 
     if (hdr->nal_unit_type == 5)
-        hdr->idr_pic_id = twig_get_ue(regs);
+        hdr->idr_pic_id = twig_get_ue(bits);
 
     if (sps->pic_order_cnt_type == 0) {
-        hdr->pic_order_cnt_lsb = twig_get_bits(regs, sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+        hdr->pic_order_cnt_lsb = twig_get_bits(bits, sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
         if (pps->bottom_field_pic_order_in_frame_present_flag && !hdr->field_pic_flag)
-            hdr->delta_pic_order_cnt_bottom = twig_get_se(regs);
+            hdr->delta_pic_order_cnt_bottom = twig_get_se(bits);
     }
 
     if (sps->pic_order_cnt_type == 1 && !sps->delta_pic_order_always_zero_flag) {
-        hdr->delta_pic_order_cnt[0] = twig_get_se(regs);
+        hdr->delta_pic_order_cnt[0] = twig_get_se(bits);
         if (pps->bottom_field_pic_order_in_frame_present_flag && !hdr->field_pic_flag)
-            hdr->delta_pic_order_cnt[1] = twig_get_se(regs);
+            hdr->delta_pic_order_cnt[1] = twig_get_se(bits);
     }
 
     if (pps->redundant_pic_cnt_present_flag)
-        hdr->redundant_pic_cnt = twig_get_ue(regs);
+        hdr->redundant_pic_cnt = twig_get_ue(bits);
 
     if (hdr->slice_type == SLICE_TYPE_B)
-        hdr->direct_spatial_mv_pred_flag = twig_get_1bit(regs);
+        hdr->direct_spatial_mv_pred_flag = twig_get_1bit(bits);
 
     hdr->num_ref_idx_l0_active_minus1 = pps->num_ref_idx_l0_default_active_minus1;
     hdr->num_ref_idx_l1_active_minus1 = pps->num_ref_idx_l1_default_active_minus1;
 
     if (hdr->slice_type == SLICE_TYPE_P || hdr->slice_type == SLICE_TYPE_SP || hdr->slice_type == SLICE_TYPE_B) {
-        hdr->num_ref_idx_active_override_flag = twig_get_1bit(regs);
+        hdr->num_ref_idx_active_override_flag = twig_get_1bit(bits);
         if (hdr->num_ref_idx_active_override_flag) {
-            hdr->num_ref_idx_l0_active_minus1 = twig_get_ue(regs);
+            hdr->num_ref_idx_l0_active_minus1 = twig_get_ue(bits);
             if (hdr->slice_type == SLICE_TYPE_B)
-                hdr->num_ref_idx_l1_active_minus1 = twig_get_ue(regs);
+                hdr->num_ref_idx_l1_active_minus1 = twig_get_ue(bits);
         }
     }
 
     if (hdr->slice_type != SLICE_TYPE_I && hdr->slice_type != SLICE_TYPE_SI) {
-        hdr->ref_pic_list_modification_flag_l0 = twig_get_1bit(regs);
+        hdr->ref_pic_list_modification_flag_l0 = twig_get_1bit(bits);
         hdr->modification_count_l0 = 0;
     if (hdr->ref_pic_list_modification_flag_l0) {
         uint32_t modification_of_pic_nums_idc;
         do {
-            modification_of_pic_nums_idc = twig_get_ue(regs);
+            modification_of_pic_nums_idc = twig_get_ue(bits);
             hdr->modification_of_pic_nums_idc[hdr->modification_count_l0] = modification_of_pic_nums_idc;
             if (modification_of_pic_nums_idc == 0 || modification_of_pic_nums_idc == 1)
-                hdr->abs_diff_pic_num_minus1[hdr->modification_count_l0] = twig_get_ue(regs);
+                hdr->abs_diff_pic_num_minus1[hdr->modification_count_l0] = twig_get_ue(bits);
             else if (modification_of_pic_nums_idc == 2)
-                hdr->long_term_pic_num[hdr->modification_count_l0] = twig_get_ue(regs);
+                hdr->long_term_pic_num[hdr->modification_count_l0] = twig_get_ue(bits);
 
             if (modification_of_pic_nums_idc != 3)
                 hdr->modification_count_l0++;
@@ -549,17 +670,17 @@ static int twig_parse_hdr(const uint8_t *data, twig_h264_decoder_t *decoder) {
     }
 
     if (hdr->slice_type == SLICE_TYPE_B) {
-        hdr->ref_pic_list_modification_flag_l1 = twig_get_1bit(regs);
+        hdr->ref_pic_list_modification_flag_l1 = twig_get_1bit(bits);
         hdr->modification_count_l1 = 0;
         if (hdr->ref_pic_list_modification_flag_l1) {
             uint32_t modification_of_pic_nums_idc;
             do {
-                modification_of_pic_nums_idc = twig_get_ue(regs);
+                modification_of_pic_nums_idc = twig_get_ue(bits);
                 hdr->modification_of_pic_nums_idc[hdr->modification_count_l1] = modification_of_pic_nums_idc;
                 if (modification_of_pic_nums_idc == 0 || modification_of_pic_nums_idc == 1)
-                    hdr->abs_diff_pic_num_minus1[hdr->modification_count_l1] = twig_get_ue(regs);
+                    hdr->abs_diff_pic_num_minus1[hdr->modification_count_l1] = twig_get_ue(bits);
                 else if (modification_of_pic_nums_idc == 2)
-                    hdr->long_term_pic_num[hdr->modification_count_l1] = twig_get_ue(regs);
+                    hdr->long_term_pic_num[hdr->modification_count_l1] = twig_get_ue(bits);
 
                 if (modification_of_pic_nums_idc != 3)
                       hdr->modification_count_l1++;
@@ -569,36 +690,40 @@ static int twig_parse_hdr(const uint8_t *data, twig_h264_decoder_t *decoder) {
 
     if ((pps->weighted_pred_flag && (hdr->slice_type == SLICE_TYPE_P || hdr->slice_type == SLICE_TYPE_SP)) ||
         (pps->weighted_bipred_idc == 1 && hdr->slice_type == SLICE_TYPE_B))
-        twig_parse_pred_weight_table(regs, hdr);
+        twig_parse_pred_weight_table(bits, hdr, slice);
 
     if (hdr->nal_unit_type == 5) {
-        hdr->long_term_reference_flag = twig_get_1bit(regs);
-        decoder->mmco_count = 0;
-    } else if ((data[0] >> 5) & 0x3) {
-        if (twig_parse_mmco_commands(regs, decoder->mmco_commands, &decoder->mmco_count) < 0)
+        hdr->no_output_of_prior_pics_flag = twig_get_1bit(bits);
+        hdr->long_term_reference_flag = twig_get_1bit(bits);
+        slice->mmco_count = 0;
+    } else if ((nal_header >> 5) & 0x3) {
+        if (twig_parse_mmco_commands(bits, slice->mmco_commands, &slice->mmco_count) < 0)
             return -1;
     } else {
-        decoder->mmco_count = 0;
+        slice->mmco_count = 0;
     }
 
     if (pps->entropy_coding_mode_flag && hdr->slice_type != SLICE_TYPE_I && hdr->slice_type != SLICE_TYPE_SI)
-        hdr->cabac_init_idc = twig_get_ue(regs);
+        hdr->cabac_init_idc = twig_get_ue(bits);
 
-    hdr->slice_qp_delta = twig_get_se(regs);
+    hdr->slice_qp_delta = twig_get_se(bits);
 
     if (hdr->slice_type == SLICE_TYPE_SP || hdr->slice_type == SLICE_TYPE_SI) {
         if (hdr->slice_type == SLICE_TYPE_SP)
-            hdr->sp_for_switch_flag = twig_get_1bit(regs);
-        hdr->slice_qs_delta = twig_get_se(regs);
+            hdr->sp_for_switch_flag = twig_get_1bit(bits);
+        hdr->slice_qs_delta = twig_get_se(bits);
     }
 
     if (pps->deblocking_filter_control_present_flag) {
-        hdr->disable_deblocking_filter_idc = twig_get_ue(regs);
+        hdr->disable_deblocking_filter_idc = twig_get_ue(bits);
         if (hdr->disable_deblocking_filter_idc != 1) {
-            hdr->slice_alpha_c0_offset_div2 = twig_get_se(regs);
-            hdr->slice_beta_offset_div2 = twig_get_se(regs);
+            hdr->slice_alpha_c0_offset_div2 = twig_get_se(bits);
+            hdr->slice_beta_offset_div2 = twig_get_se(bits);
         }
     }
+
+    if (bits->overrun) // Header claims to be longer than the NAL it lives in
+        return -1;
     return 0;
 }
 
@@ -606,6 +731,11 @@ static int twig_calculate_poc(twig_h264_decoder_t *decoder) {
     twig_h264_sps_t *sps = decoder->sps;
     twig_h264_hdr_t *hdr = decoder->hdr;
 
+    if (hdr->nal_unit_type == NAL_IDR_SLICE) { // IDR always starts from scratch
+        decoder->ref_state.prev_poc_lsb = 0;
+        decoder->ref_state.prev_poc_msb = 0;
+    }
+
     switch (sps->pic_order_cnt_type) {
         case 0: {
             int max_poc_lsb = 1 << (sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
@@ -640,8 +770,7 @@ EXPORT twig_h264_decoder_t *twig_h264_decoder_init(twig_dev_t *cedar) {
         return NULL;
 
     decoder->cedar = cedar;
-    decoder->ve_regs = twig_get_ve_regs(cedar); // Set VE state to H.264
-    if (!decoder->ve_regs) {
+    if (twig_get_ve_regs(cedar) < 0) { // Set VE state to H.264
         free(decoder);
         return NULL;
     }
@@ -654,12 +783,123 @@ EXPORT twig_h264_decoder_t *twig_h264_decoder_init(twig_dev_t *cedar) {
     decoder->extra_buf = NULL;
     decoder->coded_width = -1;
     decoder->coded_height = -1;
-    decoder->current_pos = 0;
+    decoder->app_hold_frames = TWIG_DEFAULT_APP_HOLD;
+    decoder->ring_size = TWIG_DEFAULT_RING_SIZE;
+    if (twig_async_init(decoder) < 0) { // Submission rings, completion eventfd and a place in the service thread's round
+        twig_put_ve_regs(cedar, decoder);
+        free(decoder);
+        return NULL;
+    }
     return decoder;
 }
 
-static int twig_decode_params(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf) {
-    if (!decoder || !bitstream_buf)
+// How many frames the app keeps out of the pool at once (displayed, queued for display, not polled yet).
+// Takes effect from the next access unit, the pool only ever grows to match.
+EXPORT int twig_h264_decoder_set_pool_hint(twig_h264_decoder_t *decoder, int app_hold_frames) {
+    if (!decoder || app_hold_frames < 0 || app_hold_frames > MAX_FRAME_POOL_SIZE - TWIG_FRAMEBUFFER_SLOTS)
+        return -1;
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    decoder->app_hold_frames = app_hold_frames;
+    pthread_mutex_unlock(&decoder->queue_lock);
+    return 0;
+}
+
+// The DPB the stream declared (or MaxDpbFrames), the picture being decoded, and what the app holds
+static int twig_pool_size(twig_h264_decoder_t *decoder) {
+    int dpb_size = decoder->sps->max_dec_frame_buffering;
+    if (dpb_size < decoder->sps->max_num_ref_frames)
+        dpb_size = decoder->sps->max_num_ref_frames;
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    int size = dpb_size + 1 + decoder->app_hold_frames;
+    pthread_mutex_unlock(&decoder->queue_lock);
+    return (size > MAX_FRAME_POOL_SIZE) ? MAX_FRAME_POOL_SIZE : size;
+}
+
+// Caller holds queue_lock. Anything in flight or out with the app pins the pool as it is.
+static int twig_frames_busy(twig_h264_decoder_t *decoder) {
+    int busy = twig_pending(decoder) + (int)(decoder->completion_tail - decoder->completion_head);
+    for (int i = 0; i < decoder->frame_pool.allocated_count; i++) {
+        twig_frame_t *frame = &decoder->frame_pool.frames[i];
+        busy += (frame->state == FRAME_STATE_APP_HELD || frame->needs_output);
+    }
+    return busy;
+}
+
+// Decode into the app's own buffers (its allocations or imported dma-bufs) instead of the library's.
+// Each needs at least width * height * 3 / 2 bytes of the coded size, NV12 with chroma right after luma.
+// Only while nothing is decoding and the app holds no frames (flush and return everything first), and the
+// next access unit should start with an IDR. Output and twig_h264_return_frame work as before, on these buffers.
+EXPORT int twig_h264_decoder_use_external_frames(twig_h264_decoder_t *decoder, twig_mem_t **buffers, int count) {
+    if (!decoder || !buffers || count <= 0 || count > MAX_FRAME_POOL_SIZE)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        if (!buffers[i])
+            return -1;
+    }
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    int ret = -1;
+    if (twig_frames_busy(decoder))
+        TWIG_LOG(ERROR, "ERROR: Can't swap frame buffers while frames are decoding, waiting for output or held by the app!\n");
+    else if (decoder->frame_pool.output_info.format != TWIG_OUTPUT_TILED)
+        TWIG_LOG(ERROR, "ERROR: External frames only work with tiled output for now!\n");
+    else
+        ret = twig_frame_pool_use_external(&decoder->frame_pool, decoder->cedar, buffers, count);
+    pthread_mutex_unlock(&decoder->queue_lock);
+    return ret;
+}
+
+// Have the VE write a linear NV12/NV21/YV12 copy of every picture next to its tiled reconstruction, and hand that
+// out instead. twig_h264_get_frame_info has the strides and plane offsets. Costs one extra buffer per frame.
+// Same rules as swapping frame buffers: nothing decoding, waiting for output or held by the app.
+EXPORT int twig_h264_decoder_set_output_format(twig_h264_decoder_t *decoder, twig_output_format_t format) {
+    if (!decoder || format < TWIG_OUTPUT_TILED || format > TWIG_OUTPUT_YV12)
+        return -1;
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    int ret = -1;
+    if (twig_frames_busy(decoder))
+        TWIG_LOG(ERROR, "ERROR: Can't change the output format while frames are decoding, waiting for output or held by the app!\n");
+    else if (decoder->frame_pool.external && format != TWIG_OUTPUT_TILED)
+        TWIG_LOG(ERROR, "ERROR: External frames only work with tiled output for now!\n");
+    else
+        ret = 0;
+    if (ret == 0 && format != decoder->frame_pool.output_info.format) {
+        decoder->frame_pool.output_info.format = format;
+        twig_frame_pool_set_output(&decoder->frame_pool, decoder->cedar);
+    }
+    pthread_mutex_unlock(&decoder->queue_lock);
+    return ret;
+}
+
+// Scale the secondary output down by 1 << scale_shift (up to 1/8) and rotate it, for previews and thumbnails.
+// Only does anything with a linear format from twig_h264_decoder_set_output_format. With keep_full set the app keeps
+// getting the full tiled frame and finds the small copy with twig_h264_get_secondary, otherwise it gets the copy instead.
+// Same rules as changing the format.
+EXPORT int twig_h264_decoder_set_output_transform(twig_h264_decoder_t *decoder, int scale_shift, twig_rotation_t rotation, int keep_full) {
+    if (!decoder || scale_shift < 0 || scale_shift > 3 || rotation < TWIG_ROTATE_0 || rotation > TWIG_ROTATE_270)
+        return -1;
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    twig_frame_pool_t *pool = &decoder->frame_pool;
+    int ret = twig_frames_busy(decoder) ? -1 : 0;
+    if (ret < 0)
+        TWIG_LOG(ERROR, "ERROR: Can't change the output transform while frames are decoding, waiting for output or held by the app!\n");
+    if (ret == 0 && (scale_shift != pool->output_info.scale_shift || rotation != pool->output_info.rotation || !!keep_full != pool->keep_full)) {
+        pool->output_info.scale_shift = scale_shift;
+        pool->output_info.rotation = rotation;
+        pool->keep_full = !!keep_full;
+        twig_frame_pool_set_output(pool, decoder->cedar);
+    }
+    pthread_mutex_unlock(&decoder->queue_lock);
+    return ret;
+}
+
+static int twig_decode_params(twig_h264_decoder_t *decoder, const uint8_t *data) {
+    if (!decoder || !data)
         return -1;
 
     if (!decoder->sps)
@@ -669,253 +909,381 @@ static int twig_decode_params(twig_h264_decoder_t *decoder, twig_mem_t *bitstrea
     if (!decoder->sps || !decoder->pps)
         return -1;
 
-    void *h264_base = decoder->ve_regs + H264_OFFSET;
-    const uint8_t *data = (const uint8_t *)bitstream_buf->virt_addr;
-    size_t len = bitstream_buf->size;
-    size_t pos = 0;
     int sps_found = 0;
     int pps_found = 0;
-    while (pos < len) {
-        pos = twig_find_nal_header(data, len, pos);
-        if (pos < 0 || pos >= len)
-            break;
-
-        uint8_t nal_type = data[pos] & 0x1f;
-        int next_pos = twig_find_nal_header(data, len, pos);
-        switch (nal_type) {
+    for (int i = 0; i < decoder->nal_count; i++) {
+        twig_nal_t *nal = &decoder->nals[i];
+        if (nal->type != NAL_SPS && nal->type != NAL_PPS)
+            continue;
+
+        size_t pos = nal->offset;
+        twig_bits_t bits;
+        twig_bits_init(&bits, data + pos + 1, nal->size - 1);
+        switch (nal->type) {
             case NAL_SPS:
-                printf("Parsing SPS at %zu\n", pos);
-                printf("DEBUG: current VLD reading = 0x%x (%d)\n", twig_readl(h264_base, H264_VLD_OFFSET), (int)twig_readl(h264_base, H264_VLD_OFFSET));
-                twig_skip_bits(h264_base, (pos - decoder->current_pos + 1) * 8);
-                if (twig_parse_sps(h264_base, decoder->sps) == 0) {
+                TWIG_LOG(DEBUG, "Parsing SPS at %zu\n", pos);
+                TWIG_TRACE(decoder, TWIG_TRACE_PARAMS, NAL_SPS, pos);
+                if (twig_parse_sps(&bits, decoder->sps) == 0) {
                     decoder->coded_width = (decoder->sps->pic_width_in_mbs_minus1 + 1) * 16;
                     decoder->coded_height = (decoder->sps->pic_height_in_mbs_minus1 + 1) * 16;
-                    decoder->current_pos += (decoder->current_pos > 0) ? next_pos - pos : next_pos;
-                    printf("VLD should now be at 0x%x\n", (uint32_t)(decoder->current_pos * 8));
-                    printf("DEBUG: current VLD reading = 0x%x (%d)\n", twig_readl(h264_base, H264_VLD_OFFSET), (int)twig_readl(h264_base, H264_VLD_OFFSET));
                     sps_found = 1;
                 }
                 break;
             case NAL_PPS:
-                printf("Parsing PPS at %zu\n", pos);
-                twig_skip_bits(h264_base, (pos - decoder->current_pos + 1) * 8);
-                if (twig_parse_pps(h264_base, decoder->pps, next_pos - pos) == 0) {
+                TWIG_LOG(DEBUG, "Parsing PPS at %zu\n", pos);
+                TWIG_TRACE(decoder, TWIG_TRACE_PARAMS, NAL_PPS, pos);
+                if (twig_parse_pps(&bits, decoder->pps) == 0) {
                     twig_validate_slice_groups(decoder->pps);
-                    decoder->current_pos += (decoder->current_pos > 0) ? next_pos - pos : next_pos;
-                    printf("VLD should now be at 0x%x\n", (uint32_t)(decoder->current_pos * 8));
                     pps_found = 1;
                 }
                 break;
             default:
                 break;
         }
-        if (sps_found == 1 && pps_found == 1) // Break out early if we've found both SPS and PPS, and therefore don't need to keep looking.
-            break;                            // Otherwise, we'll search the whole buffer to be safe!
+        decoder->scaling_loaded = 0; // Whatever the lists are now, the SRAM doesn't have them yet
+        if (sps_found == 1 && pps_found == 1) // Found both, nothing else in the table is interesting here
+            break;
     }
     return 0;
 }
 
-EXPORT twig_mem_t *twig_h264_decode_frame(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf) {
-    if (!decoder || !bitstream_buf)
-        return NULL;
+// Slice header of NAL nal into slice->hdr, with whatever the VE needs from it that isn't a register value yet
+static int twig_parse_slice(twig_h264_decoder_t *decoder, const uint8_t *data, int nal, twig_slice_t *slice) {
+    size_t pos = decoder->nals[nal].offset;
+    twig_bits_t bits;
+    TWIG_STAT_CLOCK(start);
+    twig_bits_init(&bits, data + pos + 1, decoder->nals[nal].size - 1);
+    int ret = twig_parse_hdr(&bits, data[pos], decoder, slice);
+    TWIG_STAT_STAGE(decoder->cedar, TWIG_STAGE_PARSE, start);
+    if (ret < 0)
+        return -1;
 
-    twig_flush_mem(bitstream_buf); // Sync the buffer, caller might do this but should be safe to do twice if so
+    slice->nal_type = decoder->nals[nal].type;
+    slice->nal_ref_idc = decoder->nals[nal].ref_idc;
+    slice->data_bit_offset = (pos + 1) * 8 + twig_bits_raw_offset(&bits);
+    return 0;
+}
 
-    twig_setup_vld_registers(decoder, bitstream_buf);
-    if (twig_decode_params(decoder, bitstream_buf) < 0) // Check for new SPS and/or PPS
-        return NULL;
+// Command list for the slice just parsed, CPU only. Safe while the VE is busy with the one before.
+static void twig_prepare_slice(twig_h264_decoder_t *decoder, twig_slice_t *slice, twig_mem_t *bitstream_buf, size_t offset, size_t len, int current_poc) {
+    twig_h264_sps_t *sps = decoder->sps;
+    twig_h264_pps_t *pps = decoder->pps;
+    twig_h264_hdr_t *hdr = &slice->hdr;
+    twig_shadow_t *shadow = &decoder->shadow;
+    twig_cmd_list_t *cmds = &slice->cmds;
+
+    twig_frame_t *ref_list0[16], *ref_list1[16];
+    int l0_count = 0, l1_count = 0;
+    TWIG_STAT_CLOCK(start);
+    twig_build_ref_lists(&decoder->frame_pool, hdr, ref_list0, &l0_count, ref_list1, &l1_count, current_poc);
+    TWIG_STAT_STAGE(decoder->cedar, TWIG_STAGE_REF_LISTS, start);
+    if (hdr->slice_type != SLICE_TYPE_I && hdr->slice_type != SLICE_TYPE_SI)
+        twig_write_ref_list0_registers(cmds, shadow, ref_list0, l0_count);
+    if (hdr->slice_type == SLICE_TYPE_B)
+        twig_write_ref_list1_registers(cmds, shadow, ref_list1, l1_count);
+
+    if (slice->has_pred_weights) { // Usually the same table for every slice of a picture, often for whole GOPs
+        twig_shadow_writel(cmds, shadow, H264_PRED_WEIGHT, slice->pred_weight);
+        twig_shadow_write_sram(cmds, shadow, VE_SRAM_H264_PRED_WEIGHT_TABLE, slice->pred_weight_table, TWIG_PRED_WEIGHT_WORDS);
+    }
+
+    // Register? I hardly know her! hahaha
+    // Only first_mb moves between slices of a picture, the rest mostly stays put for the whole stream.
+    // The SPS header...
+    twig_shadow_writel(cmds, shadow, H264_SEQ_HDR, (0x1 << 19)
+                     | ((sps->frame_mbs_only_flag & 0x1) << 18)
+                     | ((sps->mb_adaptive_frame_field_flag & 0x1) << 17)
+                     | ((sps->direct_8x8_inference_flag & 0x1) << 16)
+                     | ((sps->pic_width_in_mbs_minus1 & 0xff) << 8)
+                     | ((sps->pic_height_in_mbs_minus1 & 0xff) << 0));
+
+    // Then PPS header info...
+    twig_shadow_writel(cmds, shadow, H264_PIC_HDR,
+                       ((pps->entropy_coding_mode_flag & 0x1) << 15)
+                     | ((pps->num_ref_idx_l0_default_active_minus1 & 0x1f) << 10)
+                     | ((pps->num_ref_idx_l1_default_active_minus1 & 0x1f) << 5) 
+                     | ((pps->weighted_pred_flag & 0x1) << 4)
+                     | ((pps->weighted_bipred_idc & 0x3) << 2)
+                     | ((pps->constrained_intra_pred_flag & 0x1) << 1)
+                     | ((pps->transform_8x8_mode_flag & 0x1) << 0));
+
+    // Then the first 32 bytes of slice header info..
+    twig_shadow_writel(cmds, shadow, H264_SLICE_HDR,
+                       (((hdr->first_mb_in_slice % (sps->pic_width_in_mbs_minus1 + 1)) & 0xff) << 24)
+                     | (((hdr->first_mb_in_slice / (sps->pic_width_in_mbs_minus1 + 1)) & 0xff)
+                         * (sps->mb_adaptive_frame_field_flag ? 2 : 1) << 16)
+                     | (((slice->nal_ref_idc != 0 ? 0x1 : 0x0) & 0x1) << 12)
+                     | ((hdr->slice_type & 0xf) << 8)
+                     | ((hdr->first_slice_in_pic ? 0x1 : 0x0) << 5)
+                     | ((hdr->field_pic_flag & 0x1) << 4)
+                     | ((hdr->bottom_field_pic_flag & 0x1) << 3)
+                     | ((hdr->direct_spatial_mv_pred_flag & 0x1) << 2)
+                     | ((hdr->cabac_init_idc & 0x3) << 0));
+
+    // Then the next 32 bytes of slice header info...
+    twig_shadow_writel(cmds, shadow, H264_SLICE_HDR2,
+                       ((hdr->num_ref_idx_l0_active_minus1 & 0x1f) << 24)
+                     | ((hdr->num_ref_idx_l1_active_minus1 & 0x1f) << 16)
+                     | ((hdr->num_ref_idx_active_override_flag & 0x1) << 12)
+                     | ((hdr->disable_deblocking_filter_idc & 0x3) << 8)
+                     | ((hdr->slice_alpha_c0_offset_div2 & 0xf) << 4)
+                     | ((hdr->slice_beta_offset_div2 & 0xf) << 0));
+
+    // And then the Quantization info.
+    twig_shadow_writel(cmds, shadow, H264_QP,
+                       ((decoder->is_default_scaling & 0x1) << 24)
+                     | ((pps->second_chroma_qp_index_offset & 0x3f) << 16)
+                     | ((pps->chroma_qp_index_offset & 0x3f) << 8)
+                     | ((pps->pic_init_qp_minus26 + 26 + hdr->slice_qp_delta) & 0x3f) << 0);
+
+    // Slice header is done on the CPU, so park the VLD right on the slice data
+    slice->wrapped_bits = twig_setup_vld_registers(cmds, bitstream_buf, offset, len, slice->data_bit_offset);
+    TWIG_STAT_ADD(decoder->cedar, vld_starts, 1);
+}
+
+// Hand a prepared slice to the VE and start it. Only once the previous slice is done, the registers are shared.
+static int twig_program_slice(twig_h264_decoder_t *decoder, twig_slice_t *slice) {
+    twig_dev_t *cedar = decoder->cedar;
+    TWIG_STAT_CLOCK(start);
+    if (twig_cmd_list_apply(cedar, &slice->cmds) < 0) {
+        twig_shadow_invalidate(&decoder->shadow); // It never got what the shadow thinks it did
+        return -1;
+    }
+
+    twig_writel(cedar, H264_STATUS, twig_readl(cedar, H264_STATUS)); // Clear any previous statuses by writing to each bit it reports back
+    twig_writel(cedar, H264_CTRL, twig_readl(cedar, H264_CTRL) | 0x7); // Enable interrupts by writing 1 to bits 2:0
+    twig_writel(cedar, H264_TRIGGER, 0x8); // Bang, bang, bang! Pull my DECODE trigger!
+    TWIG_STAT_STAGE(cedar, TWIG_STAGE_REG_WRITE, start);
+    TWIG_STAT_ADD(cedar, slices, 1);
+    return 0;
+}
+
+// Decodes one access unit of len bytes at offset in bitstream_buf. Runs on the device's service thread.
+// Whatever the access unit bumped out lands in decoder->ready, in POC order. With may_drop set, a non-reference
+// picture is skipped right after its parameter sets are taken in and 1 comes back, nothing else ever depends on it.
+int twig_h264_decode_au(twig_h264_decoder_t *decoder, twig_mem_t *bitstream_buf, size_t offset, size_t len, int may_drop) {
+    if (!decoder || !bitstream_buf || len > bitstream_buf->size)
+        return -1;
+
+    int is_ring = (bitstream_buf == decoder->ring.mem);
+    if (!is_ring && offset + len > bitstream_buf->size)
+        return -1;
+
+    decoder->ready_count = 0;
+
+    twig_flush_bitstream(bitstream_buf, offset, len); // Just the access unit, and nothing at all for uncached buffers
+
+    // Ring access units may wrap, the mirrored mapping keeps them contiguous for the CPU side
+    const uint8_t *data = is_ring ? decoder->ring.mirror : twig_map_mem(bitstream_buf); // Imports get mapped on first use
+    if (!data)
+        return -1;
+
+    data += offset;
+    TWIG_STAT_CLOCK(scan_start);
+    int nal_count = twig_index_nals(decoder, data, len);
+    TWIG_STAT_STAGE(decoder->cedar, TWIG_STAGE_NAL_SCAN, scan_start);
+    if (nal_count == 0)
+        return -1;
+
+    TWIG_STAT_CLOCK(parse_start);
+    int params = twig_decode_params(decoder, data); // Check for new SPS and/or PPS
+    TWIG_STAT_STAGE(decoder->cedar, TWIG_STAGE_PARSE, parse_start);
+    if (params < 0)
+        return -1;
+
+    if (may_drop) { // Too late for this one. Skipping is fine if it's no reference, POC prediction only follows those too
+        int nal = 0;
+        while (nal < decoder->nal_count && decoder->nals[nal].type != NAL_SLICE && decoder->nals[nal].type != NAL_IDR_SLICE)
+            nal++;
+        if (nal < decoder->nal_count && decoder->nals[nal].ref_idc == 0)
+            return 1;
+    }
 
     if (!decoder->hdr) { // Allocate header space
         decoder->hdr = calloc(1, sizeof(twig_h264_hdr_t));
         if (!decoder->hdr)
-            return NULL;
+            return -1;
     }
 
     if (decoder->pool_initialized == 0 || decoder->last_width != decoder->coded_width || decoder->last_height != decoder->coded_height) {
-        if (decoder->pool_initialized == 1) // Reinitialize pool if it exists and resolution changed
-            twig_frame_pool_cleanup(&decoder->frame_pool, decoder->cedar);
-
-        if (twig_frame_pool_init(&decoder->frame_pool, decoder->coded_width, decoder->coded_height) < 0)
-            return NULL;
+        if (decoder->pool_initialized == 1) { // Resolution changed, reshape the pool but keep whatever buffers still fit
+            twig_drain_output(decoder, 0); // Old pictures go out first, the app keeps them through the switch
+            twig_frame_pool_resize(&decoder->frame_pool, decoder->cedar, decoder->coded_width, decoder->coded_height, twig_pool_size(decoder));
+        } else if (twig_frame_pool_init(&decoder->frame_pool, decoder->coded_width, decoder->coded_height) < 0) {
+            return -1;
+        }
 
         decoder->last_width = decoder->coded_width;   // Track frame resolution
         decoder->last_height = decoder->coded_height; // ^^^^^^^^^^^^^^^^^^^^^^
         decoder->frame_pool.max_frame_num = 1 << (decoder->sps->log2_max_frame_num_minus4 + 4);
         decoder->pool_initialized = 1;
     }
+    decoder->frame_pool.max_refs = decoder->sps->max_num_ref_frames ? decoder->sps->max_num_ref_frames : 1;
+    if (twig_frame_pool_reserve(&decoder->frame_pool, decoder->cedar, twig_pool_size(decoder)) < 0)
+        return -1; // Everything the stream will need, allocated now instead of one frame at a time mid-decode
 
     if (!decoder->extra_buf) { // Allocate intra-frame prediction buffer
         decoder->extra_buf = twig_alloc_mem(decoder->cedar, 1048576); // 1048576 == (1024 * 1024) aka 1MB
         if (!decoder->extra_buf)
-            return NULL;
+            return -1;
     }
 
-    void *ve_base = decoder->ve_regs;
-    void *h264_base = ve_base + H264_OFFSET; // TODO: Store h264_base in decoder as well, prevents unnecessary re-calculations
+    twig_frame_t *output_frame = twig_frame_pool_get(&decoder->frame_pool, decoder->cedar);
+    if (!output_frame)
+        return -1;
+
+    int nal = 0;
+    while (nal < decoder->nal_count && decoder->nals[nal].type != NAL_SLICE && decoder->nals[nal].type != NAL_IDR_SLICE)
+        nal++; // Type 1 (Non-IDR) or Type 5 (IDR) only
+    if (nal == decoder->nal_count)
+        return -1;
+
+    twig_slice_t *slice = &decoder->slices[0];
+    if (twig_parse_slice(decoder, data, nal, slice) < 0) // Parse the header of the first valid slice, mostly to get early POC info
+        return -1;
+    *decoder->hdr = slice->hdr; // What the picture goes by after the loop, later headers can't change (or break) it
+    memcpy(decoder->mmco_commands, slice->mmco_commands, slice->mmco_count * sizeof(twig_mmco_cmd_t));
+    decoder->mmco_count = slice->mmco_count;
+
+    // Nothing goes to the VE directly from here on, it all lands in the first slice's command list and the
+    // shadow assumes it went out. Which is why the one header that can still fail is parsed above.
+    twig_dev_t *cedar = decoder->cedar;
+    twig_shadow_t *shadow = &decoder->shadow;
+    twig_cmd_list_t *cmds = &slice->cmds;
+    cmds->count = cmds->overflow = 0;
+
+    // The service thread takes streams a picture at a time. If another decoder ran since our last one, its mode and
+    // scaling lists are in the VE instead of ours. Framebuffer list, ref lists and pred weights get written per picture anyway.
+    if (twig_ve_switch(cedar, decoder)) {
+        TWIG_TRACE(decoder, TWIG_TRACE_VE_SWITCH, 0, 0);
+        decoder->ve_ctrl = 0;
+        decoder->scaling_loaded = 0;
+        twig_shadow_invalidate(shadow);
+    }
+
+    uint32_t ve_ctrl = 0x00130001;
+    if (decoder->coded_width >= 2048) // If frame is high-width, inform the VE and shift buffers to provide more space... I think?
+        ve_ctrl |= 0x200000;
+    if (ve_ctrl != decoder->ve_ctrl) // Only on a switch or when the width crosses over, otherwise it's still there
+        twig_cmd_add(cmds, VE_CTRL, ve_ctrl);
+    decoder->ve_ctrl = ve_ctrl;
 
     uint32_t extra_buffer = decoder->extra_buf->iommu_addr;
-    if (decoder->coded_width >= 2048) { // If frame is high-width, inform the VE and shift buffers to provide more space... I think?
-        uint32_t ctrl_val = twig_readl(ve_base, VE_CTRL) | 0x200000;
-        twig_writel(ve_base, VE_CTRL, ctrl_val);
+    if (decoder->coded_width >= 2048) {
         int size = (decoder->sps->pic_width_in_mbs_minus1 + 32) * 192;
         size = (size + 4095) & ~4095;
-        twig_writel(h264_base, H264_FIELD_INTRA_INFO_BUF, 0x5);
-        twig_writel(h264_base, H264_NEIGHBOR_INFO_BUF, extra_buffer + 0x50000);
-        twig_writel(h264_base, H264_PIC_MBSIZE, extra_buffer + 0x50000 + size);
+        twig_shadow_writel(cmds, shadow, H264_FIELD_INTRA_INFO_BUF, 0x5);
+        twig_shadow_writel(cmds, shadow, H264_NEIGHBOR_INFO_BUF, extra_buffer + 0x50000);
+        twig_shadow_writel(cmds, shadow, H264_PIC_MBSIZE, extra_buffer + 0x50000 + size);
     } else { // Otherwise, standard buffer setup
-        twig_writel(h264_base, H264_FIELD_INTRA_INFO_BUF, extra_buffer);
-        twig_writel(h264_base, H264_NEIGHBOR_INFO_BUF, extra_buffer + 0x48000);
+        twig_shadow_writel(cmds, shadow, H264_FIELD_INTRA_INFO_BUF, extra_buffer);
+        twig_shadow_writel(cmds, shadow, H264_NEIGHBOR_INFO_BUF, extra_buffer + 0x48000);
     }
 
-    decoder->is_default_scaling = twig_are_scaling_lists_default(decoder->sps, decoder->pps);
-    if (decoder->is_default_scaling != 1) // Above function will aggregate any non-default scaling lists into sps/pps
-        twig_write_scaling_lists(h264_base, decoder->sps, decoder->pps);
-
-    twig_writel(h264_base, H264_SDROT_CTRL, 0x0); // Unused as far as I can tell, write zero I guess.
-
-    twig_frame_t *output_frame = twig_frame_pool_get(&decoder->frame_pool, decoder->cedar, decoder->sps->pic_width_in_mbs_minus1);
-    if (!output_frame)
-        return NULL;
-
-    const uint8_t *data = (const uint8_t *)bitstream_buf->virt_addr;
-    size_t len = bitstream_buf->size;
-
-    // Gonna be honest, these four line are dubious at best right now...
-    int prelim_pos = twig_find_slice(data, len, 0);
-    int next_pos = twig_find_nal_header(data, len, prelim_pos);
-    twig_skip_bits(h264_base, (prelim_pos - decoder->current_pos + 1) * 8);
-    decoder->current_pos += (decoder->current_pos > 0) ? next_pos - prelim_pos : next_pos;
+    if (!decoder->scaling_loaded) { // Same lists as last picture and nobody else in between, the SRAM still has them
+        decoder->is_default_scaling = twig_are_scaling_lists_default(decoder->sps, decoder->pps);
+        if (decoder->is_default_scaling != 1) // Above function will aggregate any non-default scaling lists into sps/pps
+            twig_write_scaling_lists(cmds, shadow, decoder->sps, decoder->pps);
+        decoder->scaling_loaded = 1;
+    }
 
-    if (twig_parse_hdr(data + prelim_pos, decoder) < 0) // Parse the header of the first valid slice, mostly to get early POC info
-        return NULL;
+    twig_write_output_registers(cmds, shadow, &decoder->frame_pool, output_frame); // Linear copy if the app asked for one, off otherwise
 
     int current_poc = twig_calculate_poc(decoder); 
-    twig_write_framebuffer_list(decoder->cedar, decoder->ve_regs, &decoder->frame_pool, output_frame, current_poc);
+    twig_write_framebuffer_list(cmds, shadow, &decoder->frame_pool, output_frame, current_poc);
     //   ^^^^^^^^^^^^^^^^^^^^^^ Must be done only ONCE so it is BEFORE the decode loop
 
+    // Two slices in flight: while the VE chews on one, the CPU parses the next and builds its command list.
+    // That list only goes to the VE after this one's interrupt, nothing may touch the registers before that.
+    twig_prepare_slice(decoder, slice, bitstream_buf, offset, len, current_poc);
     uint8_t nal_ref_idc = 0;
     uint8_t nal_type = 0;
-    int pos = prelim_pos;
-    int slice = 0;
-    while (pos < len) {
-        if (pos < 0 || pos >= len)
-                break;
+    int next = 1, slice_count = 0, ret = 0;
+    while (slice) {
+        nal_type = slice->nal_type;
+        nal_ref_idc = slice->nal_ref_idc;
+        TWIG_TRACE(decoder, TWIG_TRACE_SLICE, slice_count, slice->cmds.count);
+        if ((ret = twig_program_slice(decoder, slice)) < 0)
+            break;
 
-        if (slice > 0) { // Don't reparse slice header on first slice, already done above
-            int next_slice = twig_find_slice(data, len, pos) + 1;
-            int slice_diff_bits = (next_slice - pos) * 8;
-            twig_skip_bits(h264_base, slice_diff_bits);
-            twig_parse_hdr(data + pos, decoder);
+        twig_slice_t *following = NULL;
+        while (++nal < decoder->nal_count && decoder->nals[nal].type != NAL_SLICE && decoder->nals[nal].type != NAL_IDR_SLICE)
+            ;
+        if (nal < decoder->nal_count && twig_parse_slice(decoder, data, nal, &decoder->slices[next]) == 0) {
+            following = &decoder->slices[next];
+            following->cmds.count = following->cmds.overflow = 0;
+            twig_prepare_slice(decoder, following, bitstream_buf, offset, len, current_poc);
+            next ^= 1;
         }
 
-        if (decoder->mmco_count > 0) { // If we found any MMCOs, apply them here
-            twig_execute_mmco_commands(decoder, output_frame);
-            twig_remove_stale_frames(&decoder->frame_pool); // Update the ref_lists, in case the build function doesn't catch updates
-        }
+        ret = twig_wait_for_slice(cedar, bitstream_buf, slice->wrapped_bits); // Wait up to 1 second for it to finish
+        twig_writel(cedar, H264_STATUS, twig_readl(cedar, H264_STATUS)); // Same read-to-clear as before
+        TWIG_TRACE(decoder, TWIG_TRACE_SLICE_DONE, slice_count, ret);
+        if (ret < 0) // No interrupt, so the next slice must not go in. It isn't done, nor may anything refer to it
+            break;
+        slice_count++;
+        slice = following; // A broken header ends the picture here, same as it always did
+    }
 
-        twig_frame_t *ref_list0[16], *ref_list1[16]; // TODO: Possible FIXME, may need to move these into decoder struct for multi-frame decoding?
-        int l0_count = 0, l1_count = 0;              // ^^^^  These l0/1 counts too?
-        twig_build_ref_lists(&decoder->frame_pool, decoder->hdr, ref_list0, &l0_count, ref_list1, &l1_count, current_poc);
-        if (decoder->hdr->slice_type != SLICE_TYPE_I && decoder->hdr->slice_type != SLICE_TYPE_SI)
-            twig_write_ref_list0_registers(decoder->cedar, decoder->ve_regs, &decoder->frame_pool, ref_list0, l0_count);
-        if (decoder->hdr->slice_type == SLICE_TYPE_B)
-            twig_write_ref_list1_registers(decoder->cedar, decoder->ve_regs, &decoder->frame_pool, ref_list1, l1_count);
-
-        // Register? I hardly know her! hahaha
-        // Write the SPS header to registers...
-        twig_writel(h264_base, H264_SEQ_HDR, (0x1 << 19)
-                  | ((decoder->sps->frame_mbs_only_flag & 0x1) << 18)
-                  | ((decoder->sps->mb_adaptive_frame_field_flag & 0x1) << 17)
-                  | ((decoder->sps->direct_8x8_inference_flag & 0x1) << 16)
-                  | ((decoder->sps->pic_width_in_mbs_minus1 & 0xff) << 8)
-                  | ((decoder->sps->pic_height_in_mbs_minus1 & 0xff) << 0));
-
-        // Then PPS header info...
-        twig_writel(h264_base, H264_PIC_HDR,
-                    ((decoder->pps->entropy_coding_mode_flag & 0x1) << 15)
-                  | ((decoder->pps->num_ref_idx_l0_default_active_minus1 & 0x1f) << 10)
-                  | ((decoder->pps->num_ref_idx_l1_default_active_minus1 & 0x1f) << 5) 
-                  | ((decoder->pps->weighted_pred_flag & 0x1) << 4)
-                  | ((decoder->pps->weighted_bipred_idc & 0x3) << 2)
-                  | ((decoder->pps->constrained_intra_pred_flag & 0x1) << 1)
-                  | ((decoder->pps->transform_8x8_mode_flag & 0x1) << 0));
-
-        // Then the first 32 bytes of slice header info..
-        twig_writel(h264_base, H264_SLICE_HDR,
-                    (((decoder->hdr->first_mb_in_slice % (decoder->sps->pic_width_in_mbs_minus1 + 1)) & 0xff) << 24)
-                  | (((decoder->hdr->first_mb_in_slice / (decoder->sps->pic_width_in_mbs_minus1 + 1)) & 0xff)
-                      * (decoder->sps->mb_adaptive_frame_field_flag ? 2 : 1) << 16)
-                  | (((nal_ref_idc != 0 ? 0x1 : 0x0) & 0x1) << 12)
-                  | ((decoder->hdr->slice_type & 0xf) << 8)
-                  | ((decoder->hdr->first_slice_in_pic ? 0x1 : 0x0) << 5)
-                  | ((decoder->hdr->field_pic_flag & 0x1) << 4)
-                  | ((decoder->hdr->bottom_field_pic_flag & 0x1) << 3)
-                  | ((decoder->hdr->direct_spatial_mv_pred_flag & 0x1) << 2)
-                  | ((decoder->hdr->cabac_init_idc & 0x3) << 0));
-
-        // Then the next 32 bytes of slice header info...
-        twig_writel(h264_base, H264_SLICE_HDR2,
-                    ((decoder->hdr->num_ref_idx_l0_active_minus1 & 0x1f) << 24)
-                  | ((decoder->hdr->num_ref_idx_l1_active_minus1 & 0x1f) << 16)
-                  | ((decoder->hdr->num_ref_idx_active_override_flag & 0x1) << 12)
-                  | ((decoder->hdr->disable_deblocking_filter_idc & 0x3) << 8)
-                  | ((decoder->hdr->slice_alpha_c0_offset_div2 & 0xf) << 4)
-                  | ((decoder->hdr->slice_beta_offset_div2 & 0xf) << 0));
-
-        // And then the Quantization info.
-        twig_writel(h264_base, H264_QP,
-                    ((decoder->is_default_scaling & 0x1) << 24)
-                  | ((decoder->pps->second_chroma_qp_index_offset & 0x3f) << 16)
-                  | ((decoder->pps->chroma_qp_index_offset & 0x3f) << 8)
-                  | ((decoder->pps->pic_init_qp_minus26 + 26 + decoder->hdr->slice_qp_delta) & 0x3f) << 0);
-
-        twig_writel(h264_base, H264_STATUS, twig_readl(h264_base, H264_STATUS)); // Clear any previous statuses by writing to each bit it reports back
-        twig_writel(h264_base, H264_CTRL, twig_readl(h264_base, H264_CTRL) | 0x7); // Enable interrupts by writing 1 to bits 2:0
-        twig_writel(h264_base, H264_TRIGGER, 0x8); // Bang, bang, bang! Pull my DECODE trigger!
-        twig_wait_for_ve(decoder->cedar); // Wait up to 1 second for it to finish
-        twig_writel(h264_base, H264_STATUS, twig_readl(h264_base, H264_STATUS)); // Same read-to-clear as before
-
-        decoder->current_pos = pos; // Store pos for next skip calculation 
-        pos = twig_find_slice(data, len, pos); // Go to next slice
-        printf("VLD should now be at 0x%x\n", (uint32_t)(pos * 8));
-        slice++; // Track slices so that we parse headers properly
+    if (ret < 0) { // Picture never (fully) went through the VE. Its lists may have been built ahead, the shadow can't be trusted
+        twig_shadow_invalidate(&decoder->shadow);
+        twig_frame_pool_release(&decoder->frame_pool, cedar, output_frame);
+        return -1;
     }
 
     // Update the current frame (output_frame) values for tracking
     output_frame->frame_num = decoder->hdr->frame_num;
     output_frame->poc = current_poc;
-    if (nal_ref_idc != 0) {
+
+    int has_mmco5 = 0;
+    for (int i = 0; i < decoder->mmco_count; i++)
+        has_mmco5 |= (decoder->mmco_commands[i].memory_management_control_operation == 5);
+    if (nal_type == NAL_IDR_SLICE || has_mmco5) // POC starts over, so nothing from before can wait behind this picture
+        twig_drain_output(decoder, nal_type == NAL_IDR_SLICE && decoder->hdr->no_output_of_prior_pics_flag);
+
+    if (nal_ref_idc != 0) { // Reference marking happens once the whole picture is decoded, not per slice
         if (nal_type == NAL_IDR_SLICE) { // Track reference frames (IDR slices)
             for (int i = 0; i < decoder->frame_pool.allocated_count; i++) {
                 if (decoder->frame_pool.frames[i].is_reference)
                     twig_mark_frame_unref(&decoder->frame_pool, &decoder->frame_pool.frames[i]);
             }
+        } else if (decoder->mmco_count > 0) { // If we found any MMCOs, apply them here
+            twig_execute_mmco_commands(decoder, output_frame);
+            twig_remove_stale_frames(&decoder->frame_pool); // Update the ref_lists, in case the build function doesn't catch updates
         }
-        twig_add_short_term_ref(&decoder->frame_pool, output_frame); // All frames start as short-term, possible FIXME if wrong
+        if (!output_frame->is_long_term) // MMCO 6 may have already made it long-term
+            twig_add_short_term_ref(&decoder->frame_pool, output_frame); // All frames start as short-term, possible FIXME if wrong
     }
 
-    // Update POC in the decoder (picture order count)
-    if (decoder->sps->pic_order_cnt_type == 0) {
+    if (has_mmco5) { // 8.2.1: the picture itself counts as POC 0 afterwards, and so does the next prediction
+        current_poc = 0;
+        output_frame->poc = 0;
+        decoder->ref_state.prev_poc_lsb = 0;
+        decoder->ref_state.prev_poc_msb = 0;
+    } else if (decoder->sps->pic_order_cnt_type == 0 && nal_ref_idc != 0) { // Only reference pictures feed POC prediction
         decoder->ref_state.prev_poc_lsb = decoder->hdr->pic_order_cnt_lsb;
         decoder->ref_state.prev_poc_msb = current_poc - decoder->ref_state.prev_poc_lsb;
     }
-    decoder->current_pos = 0; // Reset pos for next frame
-    twig_flush_mem(bitstream_buf); // Sync in case the app doesn't. Again, should be safe if they do too.
-    output_frame->state = FRAME_STATE_APP_HELD;
-    return output_frame->buffer; // Here's your order, m'app.
+    twig_mem_device_wrote(output_frame->buffer); // CPU readers invalidate on twig_mem_begin_cpu_access, nobody else pays
+    if (output_frame->output)
+        twig_mem_device_wrote(output_frame->output);
+    TWIG_TRACE(decoder, TWIG_TRACE_FRAME, current_poc, output_frame->slot);
+    twig_queue_output(decoder, output_frame); // Out it goes once its turn in POC order comes up
+    TWIG_STAT_ADD(decoder->cedar, frames, 1);
+    return 0;
 }
 
 EXPORT int twig_h264_get_frame_res(twig_h264_decoder_t *decoder, int *width, int *height) {
     if (width){
         if (decoder->coded_width == -1) {
-            fprintf(stderr, "ERROR: No valid frame width yet, but it was requested!\n");
+            TWIG_LOG(ERROR, "ERROR: No valid frame width yet, but it was requested!\n");
             return -1;
         }
         *width = decoder->coded_width;
     }
     if (height){
         if (decoder->coded_height == -1) {
-            fprintf(stderr, "ERROR: No valid frame height yet, but it was requested!\n");
+            TWIG_LOG(ERROR, "ERROR: No valid frame height yet, but it was requested!\n");
             return -1;
         }
         *height = decoder->coded_height;
@@ -923,18 +1291,53 @@ EXPORT int twig_h264_get_frame_res(twig_h264_decoder_t *decoder, int *width, int
     return 0;
 }
 
-EXPORT void twig_h264_return_frame(twig_h264_decoder_t *decoder, twig_mem_t *output_buf) {
+// Caller holds queue_lock. Waits out the access unit being decoded, if any, since that may reshape the pool.
+static twig_frame_t *twig_find_handed_out(twig_h264_decoder_t *decoder, twig_mem_t *output_buf) {
+    while (decoder->decoding)
+        pthread_cond_wait(&decoder->queue_cond, &decoder->queue_lock);
+    for (int i = 0; i < decoder->frame_pool.allocated_count; i++) {
+        twig_frame_t *frame = &decoder->frame_pool.frames[i];
+        if (frame->buffer == output_buf || (frame->output && frame->output == output_buf))
+            return frame;
+    }
+    return NULL;
+}
+
+// Format, size and plane layout of a frame the decoder handed out, or of its secondary copy. Frames from before
+// a resolution or format change keep the layout they were decoded with.
+EXPORT int twig_h264_get_frame_info(twig_h264_decoder_t *decoder, twig_mem_t *output_buf, twig_frame_info_t *info) {
+    if (!decoder || !output_buf || !info)
+        return -1;
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    twig_frame_t *frame = twig_find_handed_out(decoder, output_buf);
+    if (frame)
+        *info = (frame->buffer == output_buf) ? frame->tiled_info : frame->output_info;
+    pthread_mutex_unlock(&decoder->queue_lock);
+    return frame ? 0 : -1;
+}
+
+// The scaled/rotated copy that came along with a full frame when keep_full is set, NULL if there isn't one.
+// It belongs to the frame, twig_h264_return_frame on the full frame gives both back. info is optional.
+EXPORT twig_mem_t *twig_h264_get_secondary(twig_h264_decoder_t *decoder, twig_mem_t *output_buf, twig_frame_info_t *info) {
     if (!decoder || !output_buf)
-        return;
+        return NULL;
 
-    for (int i = 0; i < decoder->frame_pool.allocated_count; i++) {
-        if (decoder->frame_pool.frames[i].buffer == output_buf) {
-            twig_frame_t *frame = &decoder->frame_pool.frames[i];            
-            if (frame->is_reference)
-                frame->state = FRAME_STATE_DECODER_HELD; // Still a reference frame, don't reuse
-            else
-                frame->state = FRAME_STATE_FREE; // Mark as reusable
+    pthread_mutex_lock(&decoder->queue_lock);
+    twig_frame_t *frame = twig_find_handed_out(decoder, output_buf);
+    twig_mem_t *secondary = (frame && frame->output != output_buf) ? frame->output : NULL;
+    if (secondary && info)
+        *info = frame->output_info;
+    pthread_mutex_unlock(&decoder->queue_lock);
+    return secondary;
+}
+
+// Only safe while the service thread isn't decoding for us, twig_h264_return_frame takes care of that
+void twig_h264_release_frame(twig_h264_decoder_t *decoder, twig_mem_t *output_buf) {
 
+    for (int i = 0; i < decoder->frame_pool.allocated_count; i++) {
+        if (twig_frame_output(&decoder->frame_pool, &decoder->frame_pool.frames[i]) == output_buf) {
+            twig_frame_pool_release(&decoder->frame_pool, decoder->cedar, &decoder->frame_pool.frames[i]);
             return;
         }
     }
@@ -952,7 +1355,10 @@ EXPORT void twig_h264_decoder_destroy(twig_h264_decoder_t* decoder) {
     if (!decoder)
         return;
 
-    twig_put_ve_regs(decoder->cedar); // Return the slab- I mean, the VE state back to idle
+    twig_async_cleanup(decoder); // Off the service thread's round before pulling anything out from under it
+    twig_ring_cleanup(decoder);
+
+    twig_put_ve_regs(decoder->cedar, decoder); // Return the slab- I mean, the VE state back to idle, once nobody else is decoding
 
     twig_frame_pool_cleanup(&decoder->frame_pool, decoder->cedar); // Everyone out of the pool
 
@@ -1,6 +1,8 @@
 #include "twig.h"
 #include "twig_bits.h"
 #include "twig_dec.h"
+#include "twig_regs.h"
+#include "twig_log.h"
 
 #define FRAME_TYPE_PROGRESSIVE       0
 #define FRAME_TYPE_INTERLACED_FRAME  1  
@@ -9,6 +11,67 @@
 #define FIELD_BOTTOM_REF             0x2
 #define FIELD_BOTH_REF               0x3
 
+static size_t twig_extra_size(int width) {
+    int pwimm1 = width / 16 - 1;
+    int extra_buf_size = 327680; // 327680 = 320 * 1024
+    if (width >= 2048) {
+        extra_buf_size += (pwimm1 + 32) * 192;
+        extra_buf_size = (extra_buf_size + 4095) & ~4095;
+        extra_buf_size += (pwimm1 + 64) * 80;
+    }
+    return extra_buf_size;
+}
+
+// Linear planes for the secondary output, scaled and rotated. Luma stride is kept a multiple of 32 so YV12's
+// half-width chroma rows stay 16-aligned, scaled sizes are rounded up to even so chroma doesn't lose a line.
+static void twig_output_geometry(twig_frame_pool_t *pool) {
+    twig_frame_info_t *tiled = &pool->tiled_info;
+    memset(tiled, 0, sizeof(*tiled));
+    tiled->format = TWIG_OUTPUT_TILED;
+    tiled->width = pool->frame_width;
+    tiled->height = pool->frame_height;
+    tiled->planes = 2; // Stride and offset only say where chroma starts, the planes are in 32x32 tiles
+    tiled->stride[0] = tiled->stride[1] = pool->frame_width;
+    tiled->offset[1] = (size_t)pool->frame_width * pool->frame_height;
+
+    twig_frame_info_t *info = &pool->output_info;
+    int width = ((pool->frame_width >> info->scale_shift) + 1) & ~1;
+    int height = ((pool->frame_height >> info->scale_shift) + 1) & ~1;
+    if (info->rotation == TWIG_ROTATE_90 || info->rotation == TWIG_ROTATE_270) {
+        int swap = width;
+        width = height;
+        height = swap;
+    }
+
+    int stride = (width + 31) & ~31;
+    size_t luma_size = (size_t)stride * height;
+    info->width = width;
+    info->height = height;
+    info->offset[0] = 0;
+    info->stride[0] = stride;
+    switch (info->format) {
+        case TWIG_OUTPUT_NV12:
+        case TWIG_OUTPUT_NV21:
+            info->planes = 2;
+            info->stride[1] = stride;
+            info->offset[1] = luma_size;
+            info->stride[2] = 0;
+            info->offset[2] = 0;
+            pool->output_size = luma_size * 3 / 2;
+            break;
+        case TWIG_OUTPUT_YV12: // V before U
+            info->planes = 3;
+            info->stride[1] = info->stride[2] = stride / 2;
+            info->offset[1] = luma_size;
+            info->offset[2] = luma_size + luma_size / 4;
+            pool->output_size = luma_size * 3 / 2;
+            break;
+        default: // Tiled, no secondary output at all
+            pool->output_size = 0;
+            break;
+    }
+}
+
 int twig_frame_pool_init(twig_frame_pool_t *pool, int width, int height) {
     if (!pool || width <= 0 || height <= 0)
         return -1;
@@ -16,16 +79,23 @@ int twig_frame_pool_init(twig_frame_pool_t *pool, int width, int height) {
     pool->frame_width = width;
     pool->frame_height = height;
     pool->frame_size = width * height * 3 / 2;
-    pool->allocated_count = 0;
+    pool->extra_size = twig_extra_size(width);
+    twig_output_geometry(pool);
 
-    for (int i = 0; i < MAX_FRAME_POOL_SIZE; i++) {
-        pool->frames[i].buffer = NULL;
-        pool->frames[i].state = FRAME_STATE_FREE;
-        pool->frames[i].frame_num = -1;
-        pool->frames[i].poc = 0;
-        pool->frames[i].is_reference = 0;
-        pool->frames[i].is_long_term = 0;
-        pool->frames[i].frame_idx = i;
+    if (!pool->external) { // App frames registered before the first access unit are already in place
+        pool->allocated_count = 0;
+        for (int i = 0; i < MAX_FRAME_POOL_SIZE; i++) {
+            pool->frames[i].buffer = NULL;
+            pool->frames[i].output = NULL;
+            pool->frames[i].state = FRAME_STATE_FREE;
+            pool->frames[i].frame_num = -1;
+            pool->frames[i].poc = 0;
+            pool->frames[i].is_reference = 0;
+            pool->frames[i].is_long_term = 0;
+            pool->frames[i].needs_output = 0;
+            pool->frames[i].slot = -1;
+            pool->frames[i].frame_idx = i;
+        }
     }
 
     pool->short_count = 0;
@@ -33,6 +103,7 @@ int twig_frame_pool_init(twig_frame_pool_t *pool, int width, int height) {
     pool->max_long_term_frame_idx = -1;
     pool->prev_frame_num = -1;
     pool->max_frame_num = 0;
+    pool->max_refs = 16;
 
     memset(pool->short_refs, 0, sizeof(pool->short_refs));
     memset(pool->long_refs, 0, sizeof(pool->long_refs));
@@ -40,56 +111,247 @@ int twig_frame_pool_init(twig_frame_pool_t *pool, int width, int height) {
     return 0;
 }
 
-twig_frame_t *twig_frame_pool_get(twig_frame_pool_t *pool, twig_dev_t *cedar, uint16_t pwimm1) {
+static int twig_frame_alloc(twig_frame_pool_t *pool, twig_dev_t *cedar, twig_frame_t *frame) {
+    if (!frame->external) // App frames come with a buffer, only the VE's side data is ours
+        frame->buffer = twig_alloc_mem(cedar, pool->frame_size);
+    if (!frame->buffer)
+        return -1;
+
+    frame->extra_data = twig_alloc_mem(cedar, pool->extra_size);
+    if (pool->output_size)
+        frame->output = twig_alloc_mem(cedar, pool->output_size);
+    if (!frame->extra_data || (pool->output_size && !frame->output)) {
+        twig_free_mem(cedar, frame->extra_data);
+        twig_free_mem(cedar, frame->output);
+        frame->extra_data = frame->output = NULL;
+        if (!frame->external) {
+            twig_free_mem(cedar, frame->buffer);
+            frame->buffer = NULL;
+        }
+        return -1;
+    }
+
+    frame->state = FRAME_STATE_FREE;
+    frame->frame_num = -1;
+    frame->poc = 0;
+    frame->is_reference = 0;
+    frame->is_long_term = 0;
+    frame->long_term_idx = -1;
+    frame->needs_output = 0;
+    frame->slot = -1;
+    return 0;
+}
+
+static int twig_frame_fits(twig_frame_pool_t *pool, twig_frame_t *frame) {
+    return frame->buffer && frame->buffer->size >= pool->frame_size && frame->extra_data && frame->extra_data->size >= pool->extra_size
+        && (!pool->output_size || (frame->output && frame->output->size >= pool->output_size));
+}
+
+static int twig_frame_pool_usable(twig_frame_pool_t *pool) {
+    int usable = 0;
+    for (int i = 0; i < pool->allocated_count; i++)
+        usable += twig_frame_fits(pool, &pool->frames[i]);
+    return usable;
+}
+
+// Leaves a hole, twig_frame_pool_reserve fills those before growing the pool. App frames are just forgotten.
+static void twig_frame_free(twig_frame_pool_t *pool, twig_dev_t *cedar, twig_frame_t *frame) {
+    if (!frame->external)
+        twig_free_mem(cedar, frame->buffer);
+    twig_free_mem(cedar, frame->extra_data);
+    twig_free_mem(cedar, frame->output);
+    frame->buffer = NULL;
+    frame->external = 0;
+    frame->extra_data = NULL;
+    frame->output = NULL;
+    frame->state = FRAME_STATE_FREE;
+    frame->slot = -1;
+}
+
+// Grows the pool to count usable frames right after the SPS is known, so decoding itself never has to allocate
+int twig_frame_pool_reserve(twig_frame_pool_t *pool, twig_dev_t *cedar, int count) {
     if (!pool || !cedar)
-        return NULL;
+        return -1;
 
-    for (int i = 0; i < pool->allocated_count; i++) { // Frame form pool is free, mark and return.
-        if (pool->frames[i].state == FRAME_STATE_FREE) {
-            pool->frames[i].state = FRAME_STATE_DECODER_HELD;
-            return &pool->frames[i];
+    if (count > MAX_FRAME_POOL_SIZE)
+        count = MAX_FRAME_POOL_SIZE;
+
+    if (pool->external) { // Whatever the app registered is all there is, just make sure each usable one has its side data
+        for (int i = 0; i < pool->allocated_count; i++) {
+            twig_frame_t *frame = &pool->frames[i];
+            if (frame->buffer && frame->buffer->size >= pool->frame_size && !frame->extra_data && twig_frame_alloc(pool, cedar, frame) < 0)
+                return -1;
         }
+        return 0;
     }
 
-    if (pool->allocated_count < MAX_FRAME_POOL_SIZE) { // No free frames, but we have space. Allocate and return.
-        twig_frame_t *frame = &pool->frames[pool->allocated_count];
-        
-        frame->buffer = twig_alloc_mem(cedar, pool->frame_size);
+    for (int i = 0; i < pool->allocated_count && pool->output_size; i++) { // Output format changed, frames keep their references
+        twig_frame_t *frame = &pool->frames[i];
+        if (frame->buffer && !frame->output && frame->state != FRAME_STATE_APP_HELD) {
+            frame->output = twig_alloc_mem(cedar, pool->output_size);
+            if (!frame->output)
+                return -1;
+        }
+    }
+
+    int live = twig_frame_pool_usable(pool); // Undersized leftovers the app still holds are on their way out, don't count them
+
+    for (int i = 0; live < count && i < MAX_FRAME_POOL_SIZE; i++) {
+        if (i < pool->allocated_count && pool->frames[i].buffer)
+            continue;
+
+        if (twig_frame_alloc(pool, cedar, &pool->frames[i]) < 0)
+            return -1;
+        if (i >= pool->allocated_count)
+            pool->allocated_count = i + 1;
+        live++;
+    }
+    return 0;
+}
+
+// New geometry. Every buffer that's still big enough stays, only undersized and surplus ones get freed.
+// App-held frames ride through untouched and get the same check once they come back.
+void twig_frame_pool_resize(twig_frame_pool_t *pool, twig_dev_t *cedar, int width, int height, int count) {
+    for (int i = 0; i < pool->allocated_count; i++) // Only happens at an IDR, nothing from before gets referenced again
+        twig_mark_frame_unref(pool, &pool->frames[i]);
+    pool->max_long_term_frame_idx = -1;
+
+    pool->frame_width = width;
+    pool->frame_height = height;
+    pool->frame_size = width * height * 3 / 2;
+    pool->extra_size = twig_extra_size(width);
+    twig_output_geometry(pool);
+
+    int kept = 0;
+    for (int i = 0; i < pool->allocated_count; i++) {
+        twig_frame_t *frame = &pool->frames[i];
         if (!frame->buffer)
-            return NULL;
+            continue;
 
-        int extra_buf_size = 327680; // 327680 = 320 * 1024
-        if (pool->frame_width >= 2048) {
-            extra_buf_size += (pwimm1 + 32) * 192;
-            extra_buf_size = (extra_buf_size + 4095) & ~4095;
-            extra_buf_size += (pwimm1 + 64) * 80;
+        int fits = twig_frame_fits(pool, frame);
+        if (frame->state == FRAME_STATE_APP_HELD) {
+            kept += fits;
+            continue;
         }
-        frame->extra_data = twig_alloc_mem(cedar, extra_buf_size);
-        if (!frame->extra_data) {
-            twig_free_mem(cedar, frame->buffer);
-            return NULL;
+
+        frame->needs_output = 0;
+        if (frame->external && !fits && frame->buffer->size >= pool->frame_size) { // App frame is fine, only the side data has to grow
+            twig_free_mem(cedar, frame->extra_data);
+            frame->extra_data = NULL;
+            frame->state = FRAME_STATE_FREE;
+        } else if (!fits || (kept >= count && !frame->external)) {
+            twig_frame_free(pool, cedar, frame);
+        } else {
+            frame->state = FRAME_STATE_FREE;
+            kept++;
         }
+    }
+}
 
-        frame->state = FRAME_STATE_DECODER_HELD;
-        frame->frame_num = -1;
-        frame->poc = 0;
-        frame->is_reference = 0;
-        frame->is_long_term = 0;
-        frame->long_term_idx = -1;
+// Frame came back from the app. Anything left over from before a resolution change that's too small goes for good,
+// except app frames that still fit, those only lose their side data and get it back on the next reserve.
+void twig_frame_pool_release(twig_frame_pool_t *pool, twig_dev_t *cedar, twig_frame_t *frame) {
+    if (frame->is_reference) {
+        frame->state = FRAME_STATE_DECODER_HELD; // Still a reference frame, don't reuse
+    } else {
+        frame->state = FRAME_STATE_FREE; // Mark as reusable
+        if (twig_frame_fits(pool, frame))
+            return;
+        if (frame->external && frame->buffer->size >= pool->frame_size) { // Same as on resize, only the side data has to grow
+            twig_free_mem(cedar, frame->extra_data);
+            frame->extra_data = NULL;
+        } else {
+            twig_frame_free(pool, cedar, frame);
+        }
+    }
+}
+
+// Any slot no reference is sitting in will do, the pool index doesn't have to fit in the SRAM list anymore
+static int twig_assign_slot(twig_frame_pool_t *pool, twig_frame_t *frame) {
+    uint32_t used = 0;
+    for (int i = 0; i < pool->allocated_count; i++) {
+        twig_frame_t *other = &pool->frames[i];
+        if (other != frame && other->is_reference && other->slot >= 0)
+            used |= 1u << other->slot;
+    }
 
-        pool->allocated_count++;
-        return frame;
+    for (int slot = 0; slot < TWIG_FRAMEBUFFER_SLOTS; slot++) {
+        if (!(used & (1u << slot))) {
+            frame->slot = slot;
+            return 0;
+        }
     }
+    return -1; // Can't happen with 16 references max, but don't hand out a frame the VE can't address
+}
 
-    for (int i = 0; i < pool->allocated_count; i++) { // Frame isn't a reference, but is still held? Basically a free frame, so make sure its state is correct and return.
-        if (!pool->frames[i].is_reference && pool->frames[i].state == FRAME_STATE_DECODER_HELD) {
-            pool->frames[i].state = FRAME_STATE_DECODER_HELD;
+static twig_frame_t *twig_find_free_frame(twig_frame_pool_t *pool) {
+    for (int i = 0; i < pool->allocated_count; i++) { // Frame form pool is free, mark and return.
+        if (twig_frame_fits(pool, &pool->frames[i]) && pool->frames[i].state == FRAME_STATE_FREE)
+            return &pool->frames[i];
+    }
+
+    for (int i = 0; i < pool->allocated_count; i++) { // Frame isn't a reference, but is still held? Basically a free frame, so reuse it.
+        if (twig_frame_fits(pool, &pool->frames[i]) && !pool->frames[i].is_reference && !pool->frames[i].needs_output && pool->frames[i].state == FRAME_STATE_DECODER_HELD)
             return &pool->frames[i];
-        }
     }
     return NULL;
 }
 
+twig_frame_t *twig_frame_pool_get(twig_frame_pool_t *pool, twig_dev_t *cedar) {
+    if (!pool || !cedar)
+        return NULL;
+
+    twig_frame_t *frame = twig_find_free_frame(pool);
+    if (!frame) { // Stream needs more than its SPS let on, or the app holds more than it hinted. Allocate, but it's the slow path.
+        if (twig_frame_pool_reserve(pool, cedar, twig_frame_pool_usable(pool) + 1) == 0)
+            frame = twig_find_free_frame(pool);
+    }
+
+    if (!frame && pool->external)
+        TWIG_LOG(ERROR, "ERROR: No free external frame, too few registered for %dx%d or the app holds them all!\n", pool->frame_width, pool->frame_height);
+    if (!frame || twig_assign_slot(pool, frame) < 0)
+        return NULL;
+
+    frame->state = FRAME_STATE_DECODER_HELD;
+    return frame;
+}
+
+// Swaps whatever the pool has for the app's own buffers. Caller made sure nothing is decoding, queued for output
+// or held by the app, so every frame can go. Nothing from before gets referenced again, the next picture should be an IDR.
+int twig_frame_pool_use_external(twig_frame_pool_t *pool, twig_dev_t *cedar, twig_mem_t **buffers, int count) {
+    for (int i = 0; i < pool->allocated_count; i++) {
+        twig_mark_frame_unref(pool, &pool->frames[i]);
+        if (pool->frames[i].buffer)
+            twig_frame_free(pool, cedar, &pool->frames[i]);
+    }
+    pool->max_long_term_frame_idx = -1;
+
+    for (int i = 0; i < count; i++) {
+        twig_frame_t *frame = &pool->frames[i];
+        memset(frame, 0, sizeof(*frame));
+        frame->buffer = buffers[i];
+        frame->external = 1;
+        frame->state = FRAME_STATE_FREE;
+        frame->frame_idx = i;
+        frame->frame_num = -1;
+        frame->long_term_idx = -1;
+        frame->slot = -1;
+    }
+    pool->allocated_count = count;
+    pool->external = 1;
+    return 0;
+}
+
+// Output settings in pool->output_info/keep_full changed. Caller made sure the app holds nothing and nothing waits
+// for output, so every linear copy can go. References stay, twig_frame_pool_reserve hands out new copies before the next decode.
+void twig_frame_pool_set_output(twig_frame_pool_t *pool, twig_dev_t *cedar) {
+    for (int i = 0; i < pool->allocated_count; i++) {
+        twig_free_mem(cedar, pool->frames[i].output);
+        pool->frames[i].output = NULL;
+    }
+    twig_output_geometry(pool);
+}
+
 static void twig_remove_short_term_ref(twig_frame_pool_t *pool, twig_frame_t *frame) {
     for (int i = 0; i < pool->short_count; i++) {
         if (pool->short_refs[i] == frame) {
@@ -129,35 +391,35 @@ static void twig_remove_long_term_ref(twig_frame_pool_t *pool, twig_frame_t *fra
     }
 }
 
-int twig_parse_mmco_commands(void *regs, twig_mmco_cmd_t *mmco_list, int *mmco_count) {
+int twig_parse_mmco_commands(twig_bits_t *bits, twig_mmco_cmd_t *mmco_list, int *mmco_count) {
     *mmco_count = 0;
-    int adaptive_mode = twig_get_1bit(regs);
+    int adaptive_mode = twig_get_1bit(bits);
     if (!adaptive_mode)
         return 0;
 
     do {
         twig_mmco_cmd_t *cmd = &mmco_list[*mmco_count];
-        cmd->memory_management_control_operation = twig_get_ue(regs);
+        cmd->memory_management_control_operation = twig_get_ue(bits);
         switch (cmd->memory_management_control_operation) {
             case 0:
                 return 0;
             case 1:
-                cmd->difference_of_pic_nums_minus1 = twig_get_ue(regs);
+                cmd->difference_of_pic_nums_minus1 = twig_get_ue(bits);
                 break;
             case 2: 
-                cmd->long_term_pic_num = twig_get_ue(regs);
+                cmd->long_term_pic_num = twig_get_ue(bits);
                 break;
             case 3:
-                cmd->difference_of_pic_nums_minus1 = twig_get_ue(regs);
-                cmd->long_term_frame_idx = twig_get_ue(regs);
+                cmd->difference_of_pic_nums_minus1 = twig_get_ue(bits);
+                cmd->long_term_frame_idx = twig_get_ue(bits);
                 break;
             case 4:
-                cmd->max_long_term_frame_idx_plus1 = twig_get_ue(regs);
+                cmd->max_long_term_frame_idx_plus1 = twig_get_ue(bits);
                 break;
             case 5:
                 break;
             case 6:
-                cmd->long_term_frame_idx = twig_get_ue(regs);
+                cmd->long_term_frame_idx = twig_get_ue(bits);
                 break;
             default:
                 return -1;
@@ -269,8 +531,7 @@ void twig_add_short_term_ref(twig_frame_pool_t *pool, twig_frame_t *frame) {
     frame->is_reference = 1;
     frame->is_long_term = 0;
 
-    int max_refs = 16;
-    if (pool->short_count > max_refs) {
+    if (pool->short_count + pool->long_count > pool->max_refs && pool->short_count > 0) { // Sliding window
         twig_frame_t *oldest = pool->short_refs[pool->short_count - 1];
         twig_mark_frame_unref(pool, oldest);
     }
@@ -292,11 +553,60 @@ void twig_mark_frame_unref(twig_frame_pool_t *pool, twig_frame_t *frame) {
 
 void twig_remove_stale_frames(twig_frame_pool_t *pool) {
     for (int i = 0; i < pool->allocated_count; i++) { // Frames were marked non-ref, but still held. Mark as free!
-        if (pool->frames[i].state == FRAME_STATE_DECODER_HELD && pool->frames[i].is_reference == 0)
+        if (pool->frames[i].state == FRAME_STATE_DECODER_HELD && pool->frames[i].is_reference == 0 && !pool->frames[i].needs_output)
             pool->frames[i].state = FRAME_STATE_FREE;
     }
 }
 
+// Hands the lowest POC still waiting for output over to the app
+twig_frame_t *twig_bump_frame(twig_frame_pool_t *pool) {
+    twig_frame_t *next = NULL;
+    for (int i = 0; i < pool->allocated_count; i++) {
+        if (pool->frames[i].needs_output && (!next || pool->frames[i].poc < next->poc))
+            next = &pool->frames[i];
+    }
+
+    if (next) {
+        next->needs_output = 0;
+        next->state = FRAME_STATE_APP_HELD;
+    }
+    return next;
+}
+
+// IDR or MMCO 5, POC restarts so everything before it has to go out first (or be dropped if the stream says so)
+void twig_drain_output(twig_h264_decoder_t *decoder, int discard) {
+    twig_frame_pool_t *pool = &decoder->frame_pool;
+    twig_frame_t *frame;
+    while ((frame = twig_bump_frame(pool))) {
+        if (discard)
+            frame->state = frame->is_reference ? FRAME_STATE_DECODER_HELD : FRAME_STATE_FREE;
+        else
+            decoder->ready[decoder->ready_count++] = twig_frame_output(pool, frame);
+    }
+}
+
+// C.4.5.3 bumping: output once more frames are waiting than the stream reorders, or once the DPB is full
+void twig_queue_output(twig_h264_decoder_t *decoder, twig_frame_t *frame) {
+    twig_frame_pool_t *pool = &decoder->frame_pool;
+    int max_reorder = decoder->sps->max_num_reorder_frames;
+    int dpb_size = decoder->sps->max_dec_frame_buffering;
+    if (dpb_size < decoder->sps->max_num_ref_frames)
+        dpb_size = decoder->sps->max_num_ref_frames;
+
+    frame->needs_output = 1;
+    for (;;) {
+        int waiting = 0, dpb_used = 0;
+        for (int i = 0; i < pool->allocated_count; i++) {
+            waiting += pool->frames[i].needs_output;
+            dpb_used += (pool->frames[i].needs_output || pool->frames[i].is_reference);
+        }
+        if (waiting == 0 || (waiting <= max_reorder && dpb_used <= dpb_size))
+            break;
+
+        decoder->ready[decoder->ready_count++] = twig_frame_output(pool, twig_bump_frame(pool));
+    }
+}
+
 void twig_frame_pool_cleanup(twig_frame_pool_t *pool, twig_dev_t *cedar) {
     if (!pool || !cedar)
         return;
@@ -309,13 +619,16 @@ void twig_frame_pool_cleanup(twig_frame_pool_t *pool, twig_dev_t *cedar) {
 
     for (int i = 0; i < pool->allocated_count; i++) {
         if (pool->frames[i].buffer) {
-            twig_free_mem(cedar, pool->frames[i].buffer);
+            if (!pool->frames[i].external) // App frames go back to the app, which frees them itself
+                twig_free_mem(cedar, pool->frames[i].buffer);
             pool->frames[i].buffer = NULL;
         }
         if (pool->frames[i].extra_data) {
             twig_free_mem(cedar, pool->frames[i].extra_data);
             pool->frames[i].extra_data = NULL;
         }
+        twig_free_mem(cedar, pool->frames[i].output);
+        pool->frames[i].output = NULL;
     }
 
     pool->allocated_count = 0; // Pool's closed
@@ -553,92 +866,102 @@ void twig_build_ref_lists(twig_frame_pool_t *pool, twig_h264_hdr_t *hdr,
     }
 }
 
-void twig_write_framebuffer_list(twig_dev_t *cedar, void *ve_regs, twig_frame_pool_t *pool,
+void twig_write_framebuffer_list(twig_cmd_list_t *cmds, twig_shadow_t *shadow, twig_frame_pool_t *pool,
                                     twig_frame_t *output_frame, int output_poc) {
-    if (!cedar || !ve_regs || !pool || !output_frame)
+    if (!cmds || !pool || !output_frame)
         return;
 
-    void *h264_base = ve_regs + H264_OFFSET;
-
-    twig_writel(h264_base, H264_RAM_WRITE_PTR, VE_SRAM_H264_FRAMEBUFFER_LIST);
-
-    int output_placed = 0;
-
-    for (int i = 0; i < 18; i++) {
-        twig_frame_t *frame = NULL;
-        int is_output = 0;
-        if (i < pool->allocated_count) {
-            frame = &pool->frames[i];
-            if (frame->state == FRAME_STATE_FREE && !output_placed) {
-                frame = output_frame;
-                is_output = 1;
-                output_placed = 1;
-            } else if (frame->state == FRAME_STATE_DECODER_HELD && frame->is_reference) {
-            } else {
-                    frame = NULL;
-            }
-        }
-
-        if (!frame) {
-            for (int j = 0; j < 8; j++) {
-                twig_writel(h264_base, H264_RAM_WRITE_DATA, 0);
-            }
-        } else {
-            uint32_t luma_addr = frame->buffer->iommu_addr;
-            uint32_t luma_size = pool->frame_width * pool->frame_height;
-            uint32_t extra_addr = frame->extra_data->iommu_addr;
-            uint32_t extra_size = frame->extra_data->size;
-            int frame_poc = is_output ? output_poc : frame->poc;
-
-            twig_writel(h264_base, H264_RAM_WRITE_DATA, (uint16_t)frame_poc); // FIXME: Use the correct POC for each slot?
-            twig_writel(h264_base, H264_RAM_WRITE_DATA, (uint16_t)frame_poc); //        Why did I write it this way? What?
-            twig_writel(h264_base, H264_RAM_WRITE_DATA, 0 << 8);              //        And this line too? Was I that tired?
-            twig_writel(h264_base, H264_RAM_WRITE_DATA, luma_addr);
-            twig_writel(h264_base, H264_RAM_WRITE_DATA, luma_addr + luma_size); 
-            twig_writel(h264_base, H264_RAM_WRITE_DATA, extra_addr);
-            twig_writel(h264_base, H264_RAM_WRITE_DATA, extra_addr + extra_size);
-            twig_writel(h264_base, H264_RAM_WRITE_DATA, 0); // At least I know this is supposed to be zero...
-        }
-    }
-    twig_writel(h264_base, H264_OUTPUT_FRAME_INDEX, output_frame->frame_idx);
+    twig_frame_t *slots[TWIG_FRAMEBUFFER_SLOTS] = { NULL };
+    for (int i = 0; i < pool->allocated_count; i++) { // References stay put even while the app is holding them
+        if (pool->frames[i].is_reference && pool->frames[i].slot >= 0)
+            slots[pool->frames[i].slot] = &pool->frames[i];
+    }
+    slots[output_frame->slot] = output_frame; // Slot has to match H264_OUTPUT_FRAME_INDEX below
+
+    // Built up front and handed over in one go, most slots are the same references as last picture
+    uint32_t list[TWIG_FRAMEBUFFER_SLOTS * 8] = { 0 };
+    for (int i = 0; i < TWIG_FRAMEBUFFER_SLOTS; i++) {
+        twig_frame_t *frame = slots[i];
+        uint32_t *entry = &list[i * 8];
+        if (!frame)
+            continue;
+
+        uint32_t luma_addr = frame->buffer->iommu_addr;
+        uint32_t luma_size = pool->frame_width * pool->frame_height;
+        uint32_t extra_addr = frame->extra_data->iommu_addr;
+        uint32_t extra_size = frame->extra_data->size;
+        int frame_poc = (frame == output_frame) ? output_poc : frame->poc;
+
+        entry[0] = (uint16_t)frame_poc; // FIXME: Use the correct POC for each slot?
+        entry[1] = (uint16_t)frame_poc; //        Why did I write it this way? What?
+        entry[2] = 0 << 8;              //        And this line too? Was I that tired?
+        entry[3] = luma_addr;
+        entry[4] = luma_addr + luma_size; 
+        entry[5] = extra_addr;
+        entry[6] = extra_addr + extra_size;
+        entry[7] = 0; // At least I know this is supposed to be zero...
+    }
+    twig_shadow_write_sram(cmds, shadow, VE_SRAM_H264_FRAMEBUFFER_LIST, list, TWIG_FRAMEBUFFER_SLOTS * 8);
+    twig_shadow_writel(cmds, shadow, H264_OUTPUT_FRAME_INDEX, output_frame->slot);
 }
 
-void twig_write_ref_list0_registers(twig_dev_t *cedar, void *ve_regs, twig_frame_pool_t *pool, twig_frame_t **ref_list0, int l0_count) {
-    if (!cedar || !ve_regs || !pool || !ref_list0)
+// Secondary output through the scale-down/rotate path, which also does the detile and format conversion.
+// Frames without a linear copy leave it off and the app gets the tiled reconstruction.
+void twig_write_output_registers(twig_cmd_list_t *cmds, twig_shadow_t *shadow, twig_frame_pool_t *pool, twig_frame_t *frame) {
+    frame->tiled_info = pool->tiled_info;
+    frame->output_info = pool->output_info;
+    if (!frame->output) {
+        twig_shadow_writel(cmds, shadow, H264_SDROT_CTRL, 0x0);
         return;
+    }
 
-    void *h264_base = ve_regs + H264_OFFSET;
-
-    twig_writel(h264_base, H264_RAM_WRITE_PTR, VE_SRAM_H264_REF_LIST0);
+    static const uint32_t formats[] = {
+        [TWIG_OUTPUT_NV12] = VE_OUTPUT_FMT_NV12,
+        [TWIG_OUTPUT_NV21] = VE_OUTPUT_FMT_NV21,
+        [TWIG_OUTPUT_YV12] = VE_OUTPUT_FMT_YV12
+    };
+    twig_frame_info_t *info = &frame->output_info;
+    uint32_t luma_addr = frame->output->iommu_addr;
+    uint32_t chroma_len = pool->output_size - info->offset[1];
+
+    twig_cmd_add(cmds, VE_OUTPUT_FORMAT, VE_PRIMARY_OUTPUT_FMT(VE_OUTPUT_FMT_TILED_32) | VE_EXTRA_OUTPUT_FMT(formats[info->format]));
+    twig_cmd_add(cmds, VE_EXTRA_OUT_STRIDE, VE_EXTRA_OUT_STRIDES(info->stride[0], info->stride[1]));
+    twig_cmd_add(cmds, VE_EXTRA_OUT_FMT_OFFSET, VE_EXTRA_OUT_CHROMA_LEN(chroma_len));
+    twig_shadow_writel(cmds, shadow, H264_SDROT_LUMA, luma_addr);
+    twig_shadow_writel(cmds, shadow, H264_SDROT_CHROMA, luma_addr + info->offset[1]);
+    twig_shadow_writel(cmds, shadow, H264_SDROT_CTRL, H264_SDROT_ENABLE | H264_SDROT_SCALE(info->scale_shift) | H264_SDROT_ROTATE(info->rotation));
+}
 
-    for (int i = 0; i < l0_count; i += 4) {
+// Four slot indices to a word, in the VE's field numbering (frame slot * 2)
+static int twig_pack_ref_list(twig_frame_t **ref_list, int count, uint32_t *words) {
+    int word_count = 0;
+    for (int i = 0; i < count; i += 4) {
         uint32_t list_word = 0;
         for (int j = 0; j < 4; j++) {
-            if (i + j < l0_count && ref_list0[i + j]) {
-                uint32_t packed_idx = ref_list0[i + j]->frame_idx * 2;
+            if (i + j < count && ref_list[i + j]) {
+                uint32_t packed_idx = ref_list[i + j]->slot * 2;
                 list_word |= (packed_idx << (j * 8));
             }
         }
-        twig_writel(h264_base, H264_RAM_WRITE_DATA, list_word);
+        words[word_count++] = list_word;
     }
+    return word_count;
 }
 
-void twig_write_ref_list1_registers(twig_dev_t *cedar, void *ve_regs, twig_frame_pool_t *pool, twig_frame_t **ref_list1, int l1_count) {
-    if (!cedar || !ve_regs || !pool || !ref_list1)
+void twig_write_ref_list0_registers(twig_cmd_list_t *cmds, twig_shadow_t *shadow, twig_frame_t **ref_list0, int l0_count) {
+    if (!cmds || !ref_list0)
         return;
 
-    void *h264_base = ve_regs + H264_OFFSET;
+    uint32_t words[32 / 4];
+    int count = twig_pack_ref_list(ref_list0, l0_count, words);
+    twig_shadow_write_sram(cmds, shadow, VE_SRAM_H264_REF_LIST0, words, count);
+}
 
-    twig_writel(h264_base, H264_RAM_WRITE_PTR, VE_SRAM_H264_REF_LIST1);
+void twig_write_ref_list1_registers(twig_cmd_list_t *cmds, twig_shadow_t *shadow, twig_frame_t **ref_list1, int l1_count) {
+    if (!cmds || !ref_list1)
+        return;
 
-    for (int i = 0; i < l1_count; i += 4) {
-        uint32_t list_word = 0;
-        for (int j = 0; j < 4; j++) {
-            if (i + j < l1_count && ref_list1[i + j]) {
-                uint32_t packed_idx = ref_list1[i + j]->frame_idx * 2;
-                list_word |= (packed_idx << (j * 8));
-            }
-        }
-        twig_writel(h264_base, H264_RAM_WRITE_DATA, list_word);
-    }
+    uint32_t words[32 / 4];
+    int count = twig_pack_ref_list(ref_list1, l1_count, words);
+    twig_shadow_write_sram(cmds, shadow, VE_SRAM_H264_REF_LIST1, words, count);
 }
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "twig.h"
+#include "twig_dev.h"
+#include "twig_log.h"
+
+#define EXPORT __attribute__((visibility ("default")))
+
+// One per dma-buf, however many fds the app has for it. The dup'd fd the backend holds keeps the
+// buffer alive, so its inode can't be reused by some other buffer while it sits in here.
+struct twig_import {
+    twig_mem_t *mem;
+    dev_t dev;
+    ino_t ino;
+    int refs; // Imports not freed yet, 0 means idle and up for eviction
+    uint64_t last_use;
+    twig_import_t *next;
+};
+
+// Caller holds import_lock
+static void twig_import_drop(twig_dev_t *cedar, twig_import_t *import) {
+    for (twig_import_t **link = &cedar->imports; *link; link = &(*link)->next) {
+        if (*link == import) {
+            *link = import->next;
+            break;
+        }
+    }
+
+    cedar->backend->free(cedar, import->mem); // Unmaps, releases the IOMMU entry and closes our fd
+    free(import);
+}
+
+// Caller holds import_lock. Least recently used idle ones go until the cache is back under its limit.
+static void twig_import_evict(twig_dev_t *cedar) {
+    for (;;) {
+        int idle = 0;
+        twig_import_t *oldest = NULL;
+        for (twig_import_t *import = cedar->imports; import; import = import->next) {
+            if (import->refs > 0)
+                continue;
+            idle++;
+            if (!oldest || import->last_use < oldest->last_use)
+                oldest = import;
+        }
+        if (idle <= TWIG_IMPORT_CACHE)
+            return;
+        twig_import_drop(cedar, oldest);
+    }
+}
+
+void twig_import_release(twig_dev_t *cedar, twig_mem_t *mem) {
+    twig_import_t *import = ((twig_mem_priv_t *)mem)->import;
+
+    pthread_mutex_lock(&cedar->import_lock);
+    if (import->refs > 0)
+        import->refs--;
+    import->last_use = ++cedar->import_clock;
+    twig_import_evict(cedar);
+    pthread_mutex_unlock(&cedar->import_lock);
+}
+
+void twig_import_cleanup(twig_dev_t *cedar) {
+    pthread_mutex_lock(&cedar->import_lock);
+    int leaked = 0;
+    while (cedar->imports) {
+        leaked += (cedar->imports->refs > 0);
+        twig_import_drop(cedar, cedar->imports);
+    }
+    pthread_mutex_unlock(&cedar->import_lock);
+
+    if (leaked)
+        TWIG_LOG(WARN, "WARNING: %d imported buffers were never freed!\n", leaked);
+}
+
+// Wraps somebody else's dma-buf (demuxer output, a display's scanout buffer, a memfd on the sim) as a twig_mem_t.
+// size 0 takes the whole buffer. The fd stays the caller's, free the result with twig_free_mem as usual.
+// Importing the same buffer again, through any fd, hands back the same twig_mem_t without touching the kernel.
+// virt_addr stays NULL until twig_map_mem, the VE only needs the IOMMU address.
+EXPORT twig_mem_t *twig_import_dmabuf(twig_dev_t *cedar, int fd, size_t size) {
+    if (!cedar || fd < 0 || !cedar->backend->import)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return NULL;
+
+    off_t pos = lseek(fd, 0, SEEK_CUR); // The offset is shared with the caller's fd (and every dup of it), put it back after
+    off_t buffer_size = lseek(fd, 0, SEEK_END); // dma-bufs report their size here, fstat has 0 for them
+    if (pos >= 0)
+        lseek(fd, pos, SEEK_SET);
+    if (buffer_size <= 0 || (size_t)buffer_size < size) {
+        TWIG_LOG(ERROR, "ERROR: dma-buf is smaller than the %zu bytes asked for!\n", size);
+        return NULL;
+    }
+    if (size == 0)
+        size = buffer_size;
+
+    pthread_mutex_lock(&cedar->import_lock);
+    twig_import_t *import = cedar->imports;
+    while (import && (import->dev != st.st_dev || import->ino != st.st_ino))
+        import = import->next;
+
+    if (import) { // Seen it before, mapping and IOMMU entry are still there
+        twig_mem_t *mem = NULL;
+        if (size <= import->mem->size) {
+            import->refs++;
+            import->last_use = ++cedar->import_clock;
+            mem = import->mem;
+        } else {
+            TWIG_LOG(ERROR, "ERROR: dma-buf was imported before with a smaller size!\n");
+        }
+        pthread_mutex_unlock(&cedar->import_lock);
+        return mem;
+    }
+
+    import = calloc(1, sizeof(*import));
+    int own_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0); // Ours to keep, the app can close theirs whenever
+    if (!import || own_fd < 0)
+        goto err_free;
+
+    import->mem = cedar->backend->import(cedar, own_fd, size);
+    if (!import->mem)
+        goto err_free;
+
+    twig_mem_priv_t *priv = (twig_mem_priv_t *)import->mem;
+    priv->cedar = cedar;
+    priv->import = import;
+    import->dev = st.st_dev;
+    import->ino = st.st_ino;
+    import->refs = 1;
+    import->last_use = ++cedar->import_clock;
+    import->next = cedar->imports;
+    cedar->imports = import;
+    pthread_mutex_unlock(&cedar->import_lock);
+    return import->mem;
+
+err_free:
+    pthread_mutex_unlock(&cedar->import_lock);
+    if (own_fd >= 0)
+        close(own_fd);
+    free(import);
+    TWIG_LOG(ERROR, "ERROR: Failed to import dma-buf!\n");
+    return NULL;
+}
+
+// CPU address of mem, mapping it first if it's an import nobody has looked at yet. NULL if that fails.
+EXPORT void *twig_map_mem(twig_mem_t *mem) {
+    if (!mem)
+        return NULL;
+
+    if (mem->virt_addr)
+        return mem->virt_addr;
+
+    twig_dev_t *cedar = ((twig_mem_priv_t *)mem)->cedar;
+    pthread_mutex_lock(&cedar->import_lock);
+    if (!mem->virt_addr) { // Somebody else may have got here first
+        void *virt = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_SHARED, mem->ion_fd, mem->fd_offset);
+        if (virt != MAP_FAILED)
+            mem->virt_addr = virt;
+    }
+    pthread_mutex_unlock(&cedar->import_lock);
+    return mem->virt_addr;
+}
\ No newline at end of file
@@ -1,4 +1,6 @@
+#include <linux/dma-buf.h>
 #include "twig.h"
+#include "twig_dev.h"
 #include "allwinner/ion.h"
 #include "allwinner/cedardev_api.h"
 
@@ -20,11 +22,11 @@ struct user_iommu_param {
 };
 
 struct ion_mem {
-    twig_mem_t pub_mem;
+    twig_mem_priv_t priv;
     int handle, dev_fd;
 };
 
-static int ion_alloc(int dev_fd, size_t size) {
+static int ion_alloc(int dev_fd, size_t size, unsigned int flags) {
     if (dev_fd < 0 || size <= 0)
         return -1;
 
@@ -33,7 +35,7 @@ static int ion_alloc(int dev_fd, size_t size) {
         .len = aligned_size,
         .align = 4096,
         .heap_id_mask = ION_HEAP_TYPE_DMA_MASK,
-        .flags = ION_FLAG_CACHED | ION_FLAG_CACHED_NEEDS_SYNC,
+        .flags = (flags & TWIG_MEM_UNCACHED) ? 0 : ION_FLAG_CACHED | ION_FLAG_CACHED_NEEDS_SYNC, // No CACHED means a write-combined mapping
     };
 
     int ret = ioctl(dev_fd, ION_IOC_ALLOC, &alloc);
@@ -115,68 +117,104 @@ static void ion_free_iommu_addr(int cedar_fd, int ion_fd) {
     ioctl(cedar_fd, IOCTL_FREE_IOMMU_ADDR, &iommu_param);
 }
 
-twig_mem_t *twig_ion_alloc_mem(int cedar_fd, size_t size) {
-    if (size <= 0)
+// dev_fd is the device's /dev/ion, every buffer keeps a copy of it but never closes it
+twig_mem_t *twig_ion_alloc_mem(int cedar_fd, int dev_fd, size_t size, unsigned int flags) {
+    if (size <= 0 || dev_fd < 0)
         return NULL;
 
     struct ion_mem *mem = calloc(1, sizeof(*mem));
     if (!mem)
         return NULL;
 
-    static int dev_fd = -1;
-    if (dev_fd < 0)
-        dev_fd = open("/dev/ion", O_RDWR);
-
     mem->dev_fd = dev_fd;
-    if (mem->dev_fd < 0)
-        goto err_free;
-
-    mem->handle = ion_alloc(mem->dev_fd, size);
+    mem->handle = ion_alloc(mem->dev_fd, size, flags);
     if (mem->handle < 0)
-        goto err_close;
+        goto err_free;
 
-    mem->pub_mem.phys_addr = ion_get_phys_addr(mem->dev_fd, mem->handle);
-    mem->pub_mem.ion_fd = ion_map(mem->dev_fd, mem->handle);
-    if (!mem->pub_mem.phys_addr || mem->pub_mem.ion_fd < 0)
+    mem->priv.pub_mem.phys_addr = ion_get_phys_addr(mem->dev_fd, mem->handle);
+    mem->priv.pub_mem.ion_fd = ion_map(mem->dev_fd, mem->handle);
+    if (!mem->priv.pub_mem.phys_addr || mem->priv.pub_mem.ion_fd < 0)
         goto err_free2;
 
-    mem->pub_mem.size = size;
-    mem->pub_mem.virt_addr = mmap(NULL, mem->pub_mem.size, PROT_READ | PROT_WRITE, MAP_SHARED, mem->pub_mem.ion_fd, 0);
-    if (mem->pub_mem.virt_addr == MAP_FAILED)
+    mem->priv.pub_mem.size = size;
+    mem->priv.pub_mem.virt_addr = mmap(NULL, mem->priv.pub_mem.size, PROT_READ | PROT_WRITE, MAP_SHARED, mem->priv.pub_mem.ion_fd, 0);
+    if (mem->priv.pub_mem.virt_addr == MAP_FAILED)
         goto err_close2;
 
-    mem->pub_mem.iommu_addr = ion_get_iommu_addr(cedar_fd, mem->pub_mem.ion_fd);
-    if (!mem->pub_mem.iommu_addr)
+    mem->priv.pub_mem.iommu_addr = ion_get_iommu_addr(cedar_fd, mem->priv.pub_mem.ion_fd);
+    if (!mem->priv.pub_mem.iommu_addr)
         goto err_unmap;
 
-    return &mem->pub_mem;
+    return &mem->priv.pub_mem;
 
 err_unmap:
-    munmap(mem->pub_mem.virt_addr, mem->pub_mem.size);
+    munmap(mem->priv.pub_mem.virt_addr, mem->priv.pub_mem.size);
 
 err_close2:
-    close(mem->pub_mem.ion_fd);
+    close(mem->priv.pub_mem.ion_fd);
 
 err_free2:
     ion_free(mem->dev_fd, mem->handle);
 
-err_close:
-    close(mem->dev_fd);
-
 err_free:
     free(mem);
     return NULL;
 }
 
-void twig_ion_flush_mem(twig_mem_t *pub_mem) {
+// Someone else's dma-buf, the cedar driver maps it into the VE's IOMMU straight from the fd
+twig_mem_t *twig_ion_import_mem(int cedar_fd, int fd, size_t size) {
+    struct ion_mem *mem = calloc(1, sizeof(*mem));
+    if (!mem)
+        return NULL;
+
+    mem->handle = -1; // Not ours, nothing to ION_IOC_FREE
+    mem->dev_fd = -1;
+    mem->priv.pub_mem.ion_fd = fd;
+    mem->priv.pub_mem.size = size;
+    mem->priv.pub_mem.iommu_addr = ion_get_iommu_addr(cedar_fd, fd);
+    if (!mem->priv.pub_mem.iommu_addr) {
+        free(mem);
+        return NULL;
+    }
+    return &mem->priv.pub_mem;
+}
+
+void twig_ion_flush_mem(twig_mem_t *pub_mem, size_t offset, size_t len) {
     if (!pub_mem)
         return;
 
     struct ion_mem *mem = (struct ion_mem*)pub_mem;
+    if (mem->handle < 0) { // Imported, the exporter does the cache maintenance. Nothing to do if we never mapped it.
+        struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW };
+        if (pub_mem->virt_addr)
+            ioctl(pub_mem->ion_fd, DMA_BUF_IOCTL_SYNC, &sync);
+        return;
+    }
+
+    struct sunxi_cache_range range = {
+        .start = (long)pub_mem->virt_addr + offset,
+        .end = (long)pub_mem->virt_addr + offset + len
+    };
+
+    ioctl(mem->dev_fd, ION_IOC_SUNXI_FLUSH_RANGE, &range);
+}
+
+// Drops the CPU's cached lines for the range so it sees what the VE wrote
+void twig_ion_invalidate_mem(twig_mem_t *pub_mem, size_t offset, size_t len) {
+    if (!pub_mem || !pub_mem->virt_addr)
+        return;
+
+    struct ion_mem *mem = (struct ion_mem*)pub_mem;
+    if (mem->handle < 0) { // Imported, let the exporter do it
+        struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ };
+        ioctl(pub_mem->ion_fd, DMA_BUF_IOCTL_SYNC, &sync);
+        return;
+    }
 
+    // sunxi only has clean+invalidate, fine here since the CPU shouldn't have anything dirty in there
     struct sunxi_cache_range range = {
-        .start = (long)pub_mem->virt_addr,
-        .end = (long)pub_mem->virt_addr + pub_mem->size
+        .start = (long)pub_mem->virt_addr + offset,
+        .end = (long)pub_mem->virt_addr + offset + len
     };
 
     ioctl(mem->dev_fd, ION_IOC_SUNXI_FLUSH_RANGE, &range);
@@ -189,7 +227,8 @@ void twig_ion_free_mem(int cedar_fd, twig_mem_t *pub_mem) {
     struct ion_mem *mem = (struct ion_mem*)pub_mem;
 
     ion_free_iommu_addr(cedar_fd, pub_mem->ion_fd);
-    munmap(pub_mem->virt_addr, pub_mem->size);
+    if (pub_mem->virt_addr) // Imports are only mapped if somebody asked
+        munmap(pub_mem->virt_addr, pub_mem->size);
     close(pub_mem->ion_fd);
     ion_free(mem->dev_fd, mem->handle);
     free(mem);
@@ -0,0 +1,107 @@
+#include "twig.h"
+#include "twig_bits.h"
+#include "twig_dec.h"
+#include "twig_regs.h"
+#include "twig_log.h"
+
+#define EXPORT __attribute__((visibility ("default")))
+
+// Caller holds queue_lock
+static int twig_ring_setup(twig_h264_decoder_t *decoder) {
+    twig_ring_t *ring = &decoder->ring;
+    size_t size = (decoder->ring_size + 4095) & ~(4095);
+    ring->mem = twig_alloc_mem(decoder->cedar, size);
+    if (!ring->mem)
+        goto err_out;
+
+    // Reserve twice the space, then put the same pages in both halves
+    uint8_t *mirror = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mirror == MAP_FAILED)
+        goto err_free;
+
+    for (int i = 0; i < 2; i++) {
+        void *half = mmap(mirror + i * size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, ring->mem->ion_fd, ring->mem->fd_offset);
+        if (half == MAP_FAILED)
+            goto err_unmap;
+    }
+
+    ring->mirror = mirror;
+    ring->size = size;
+    ring->head = ring->tail = 0;
+    return 0;
+
+err_unmap:
+    munmap(mirror, size * 2);
+
+err_free:
+    twig_free_mem(decoder->cedar, ring->mem);
+    ring->mem = NULL;
+
+err_out:
+    TWIG_LOG(ERROR, "ERROR: Failed to set up the bitstream ring!\n");
+    return -1;
+}
+
+// Service thread is done with us by now
+void twig_ring_cleanup(twig_h264_decoder_t *decoder) {
+    twig_ring_t *ring = &decoder->ring;
+    if (!ring->mem)
+        return;
+
+    munmap(ring->mirror, ring->size * 2);
+    twig_free_mem(decoder->cedar, ring->mem);
+    ring->mem = NULL;
+}
+
+// Ring size for twig_h264_ring_reserve. Has to fit the biggest access unit plus whatever is queued behind it.
+// Only before the first reserve, the ring keeps its size after that.
+EXPORT int twig_h264_decoder_set_ring_size(twig_h264_decoder_t *decoder, size_t size) {
+    if (!decoder || size == 0)
+        return -1;
+
+    pthread_mutex_lock(&decoder->queue_lock);
+    int ret = decoder->ring.mem ? -1 : 0;
+    if (ret == 0)
+        decoder->ring_size = size;
+    pthread_mutex_unlock(&decoder->queue_lock);
+    return ret;
+}
+
+// Room for len bytes of the next access unit, written straight into the decoder's bitstream ring.
+// Spans over the end of the ring are fine, the CPU mapping wraps with it and so does the VLD.
+// NULL while the ring or the job queue is full, wait for the eventfd and poll like with twig_h264_submit.
+EXPORT void *twig_h264_ring_reserve(twig_h264_decoder_t *decoder, size_t len) {
+    if (!decoder || len == 0)
+        return NULL;
+
+    twig_ring_t *ring = &decoder->ring;
+    if (!ring->mem) { // First use sets it up, apps that bring their own buffers never pay for it
+        pthread_mutex_lock(&decoder->queue_lock);
+        int ret = twig_ring_setup(decoder);
+        pthread_mutex_unlock(&decoder->queue_lock);
+        if (ret < 0)
+            return NULL;
+    }
+
+    // Lock-free from here on, only the service thread moves tail and it only ever frees space
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (len > ring->size - (ring->head - tail) || twig_pending(decoder) >= TWIG_MAX_PENDING)
+        return NULL;
+    return ring->mirror + ring->head % ring->size;
+}
+
+// Queues the first len bytes of the last reserved span as one access unit, len can be less than what was reserved.
+// The span belongs to the decoder from here on, reserve again for the next one.
+EXPORT int twig_h264_ring_commit(twig_h264_decoder_t *decoder, size_t len) {
+    if (!decoder || len == 0)
+        return -1;
+
+    twig_ring_t *ring = &decoder->ring;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    int ret = -1;
+    if (ring->mem && len <= ring->size - (ring->head - tail))
+        ret = twig_queue_job(decoder, ring->mem, ring->head % ring->size, len, ring->head + len, 0);
+    if (ret == 0)
+        ring->head += len;
+    return ret;
+}
\ No newline at end of file
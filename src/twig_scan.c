@@ -0,0 +1,131 @@
+#include <pthread.h>
+#include "twig_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TWIG_SCAN_X86 1
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define TWIG_SCAN_NEON 1
+#endif
+
+// Reference version, every vector variant has to agree with this one byte for byte
+static int twig_scan_scalar(const uint8_t *data, int len, int start) {
+    int pos = start;
+    while (pos + 3 < len) { // Make sure that we're not trying to read past EOF
+        if (data[pos] == 0x00 && data[pos + 1] == 0x00) {
+            if (data[pos + 2] == 0x01)
+                return pos + 3; // 3-byte start code + header
+
+            if (pos + 4 <= len && data[pos + 2] == 0x00 && data[pos + 3] == 0x01)
+                return pos + 4; // 4-byte start code + header
+        }
+        pos++;
+    }
+    return len; // No NAL header found, probably EOF
+}
+
+// pos already has a zero pair and pos + 3 < len, so both bytes after it can be read
+static inline int twig_check_candidate(const uint8_t *data, int pos) {
+    if (data[pos + 2] == 0x01)
+        return pos + 3;
+    if (data[pos + 2] == 0x00 && data[pos + 3] == 0x01)
+        return pos + 4;
+    return -1;
+}
+
+#ifdef TWIG_SCAN_X86
+// Zero pairs are rare in coded slice data (emulation prevention sees to that), so most blocks cost two loads and a compare
+__attribute__((target("sse2")))
+static int twig_scan_sse2(const uint8_t *data, int len, int start) {
+    const __m128i zero = _mm_setzero_si128();
+    int pos = start;
+    while (pos + 18 < len) { // Second load reads up to pos + 16, last candidate needs up to pos + 18
+        __m128i a = _mm_loadu_si128((const __m128i *)(data + pos));
+        __m128i b = _mm_loadu_si128((const __m128i *)(data + pos + 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)));
+        while (mask) {
+            int ret = twig_check_candidate(data, pos + __builtin_ctz(mask));
+            if (ret >= 0)
+                return ret;
+            mask &= mask - 1;
+        }
+        pos += 16;
+    }
+    return twig_scan_scalar(data, len, pos);
+}
+
+__attribute__((target("avx2")))
+static int twig_scan_avx2(const uint8_t *data, int len, int start) {
+    const __m256i zero = _mm256_setzero_si256();
+    int pos = start;
+    while (pos + 34 < len) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + pos));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(data + pos + 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)));
+        while (mask) {
+            int ret = twig_check_candidate(data, pos + __builtin_ctz(mask));
+            if (ret >= 0)
+                return ret;
+            mask &= mask - 1;
+        }
+        pos += 32;
+    }
+    return twig_scan_sse2(data, len, pos);
+}
+#endif
+
+#ifdef TWIG_SCAN_NEON
+static int twig_scan_neon(const uint8_t *data, int len, int start) {
+    const uint8x16_t zero = vdupq_n_u8(0);
+    int pos = start;
+    while (pos + 18 < len) {
+        uint8x16_t a = vld1q_u8(data + pos);
+        uint8x16_t b = vld1q_u8(data + pos + 1);
+        uint8x16_t pairs = vandq_u8(vceqq_u8(a, zero), vceqq_u8(b, zero));
+        // No movemask on NEON, narrowing shift packs it down to 4 bits per byte instead
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(pairs), 4)), 0);
+        while (mask) {
+            int i = __builtin_ctzll(mask) >> 2;
+            int ret = twig_check_candidate(data, pos + i);
+            if (ret >= 0)
+                return ret;
+            mask &= ~(0xfULL << (i * 4));
+        }
+        pos += 16;
+    }
+    return twig_scan_scalar(data, len, pos);
+}
+#endif
+
+static twig_scanner_t twig_scanners[4];
+static int twig_scanner_count;
+static twig_scan_fn_t twig_scan_best = twig_scan_scalar;
+static pthread_once_t twig_scan_once = PTHREAD_ONCE_INIT;
+
+static void twig_scan_init(void) {
+    twig_scanners[twig_scanner_count++] = (twig_scanner_t){ "scalar", twig_scan_scalar };
+#ifdef TWIG_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        twig_scanners[twig_scanner_count++] = (twig_scanner_t){ "sse2", twig_scan_sse2 };
+    if (__builtin_cpu_supports("avx2"))
+        twig_scanners[twig_scanner_count++] = (twig_scanner_t){ "avx2", twig_scan_avx2 };
+#endif
+#ifdef TWIG_SCAN_NEON
+    twig_scanners[twig_scanner_count++] = (twig_scanner_t){ "neon", twig_scan_neon }; // Built for NEON, so it's there
+#endif
+    twig_scan_best = twig_scanners[twig_scanner_count - 1].find;
+}
+
+int twig_find_nal_header(const uint8_t *data, int len, int start) {
+    pthread_once(&twig_scan_once, twig_scan_init);
+    return twig_scan_best(data, len, start);
+}
+
+const twig_scanner_t *twig_get_scanners(int *count) {
+    pthread_once(&twig_scan_once, twig_scan_init);
+    if (count)
+        *count = twig_scanner_count;
+    return twig_scanners;
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+#include "twig.h"
+#include "twig_bits.h"
+#include "twig_dec.h"
+#include "twig_regs.h"
+#include "twig_log.h"
+
+void twig_cmd_add(twig_cmd_list_t *cmds, uint32_t reg, uint32_t value) {
+    if (cmds->count == TWIG_CMD_LIST_SIZE) {
+        cmds->overflow = 1;
+        return;
+    }
+    cmds->cmds[cmds->count].reg = reg;
+    cmds->cmds[cmds->count].value = value;
+    cmds->count++;
+}
+
+// Straight run of stores. With the registers mapped that's all it is, no decisions left between them.
+int twig_cmd_list_apply(twig_dev_t *cedar, const twig_cmd_list_t *cmds) {
+    if (cmds->overflow) {
+        TWIG_LOG(ERROR, "ERROR: Register command list overflowed, not programming the VE!\n");
+        return -1;
+    }
+
+    const twig_cmd_t *cmd = cmds->cmds, *end = cmds->cmds + cmds->count;
+    TWIG_STAT_ADD(cedar, mmio_writes, cmds->count);
+    if (cedar->regs) {
+        for (; cmd < end; cmd++)
+            *((volatile uint32_t*)((uint8_t *)cedar->regs + cmd->reg)) = cmd->value;
+    } else {
+        for (; cmd < end; cmd++)
+            cedar->backend->writel(cedar, cmd->reg, cmd->value);
+    }
+    return 0;
+}
+
+void twig_shadow_invalidate(twig_shadow_t *shadow) {
+    shadow->regs_valid = 0;
+    memset(shadow->sram_valid, 0, sizeof(shadow->sram_valid));
+}
+
+// Only for plain settings the VE never writes back itself. Trigger, status, control and the VLD registers
+// move on their own (or act on every write), those always go in the list. The shadow runs ahead of the VE,
+// it's what the registers will hold once every list built so far has gone out.
+void twig_shadow_writel(twig_cmd_list_t *cmds, twig_shadow_t *shadow, uint32_t reg, uint32_t value) {
+    int idx = (reg - H264_OFFSET) / 4;
+    if ((shadow->regs_valid >> idx & 1) && shadow->regs[idx] == value) {
+        shadow->elided++;
+        return;
+    }
+
+    twig_cmd_add(cmds, reg, value);
+    shadow->regs[idx] = value;
+    shadow->regs_valid |= 1ull << idx;
+    shadow->issued++;
+}
+
+static int twig_shadow_sram_matches(twig_shadow_t *shadow, int idx, uint32_t value) {
+    return (shadow->sram_valid[idx / 64] >> (idx % 64) & 1) && shadow->sram[idx] == value;
+}
+
+// SRAM goes through an auto-incrementing pointer, so only the runs that changed get written. One unchanged word
+// in the middle of a run costs the same as moving the pointer past it, so runs only split on two or more.
+void twig_shadow_write_sram(twig_cmd_list_t *cmds, twig_shadow_t *shadow, uint32_t addr, const uint32_t *words, int count) {
+    int base = addr / 4, issued = 0;
+    if (count <= 0)
+        return;
+
+    for (int i = 0; i < count;) {
+        if (twig_shadow_sram_matches(shadow, base + i, words[i])) {
+            i++;
+            continue;
+        }
+
+        int end = i + 1;
+        for (int j = end; j < count && j < end + 2; j++)
+            if (!twig_shadow_sram_matches(shadow, base + j, words[j]))
+                end = j + 1;
+
+        twig_cmd_add(cmds, H264_RAM_WRITE_PTR, addr + i * 4);
+        issued += 1 + end - i;
+        for (; i < end; i++) {
+            twig_cmd_add(cmds, H264_RAM_WRITE_DATA, words[i]);
+            shadow->sram[base + i] = words[i];
+            shadow->sram_valid[(base + i) / 64] |= 1ull << ((base + i) % 64);
+        }
+    }
+
+    shadow->issued += issued;
+    shadow->elided += count + 1 - issued; // Against the pointer and every word, like it used to go
+}
\ No newline at end of file
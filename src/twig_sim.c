@@ -0,0 +1,447 @@
+#define _GNU_SOURCE // memfd_create
+#include <pthread.h>
+#include <time.h>
+#include "twig.h"
+#include "twig_dev.h"
+#include "twig_regs.h"
+#include "twig_log.h"
+
+#define EXPORT __attribute__((visibility ("default")))
+
+#define SIM_SRAM_SIZE  0x1000
+#define SIM_IOMMU_BASE 0x40000000
+
+struct sim_mem {
+    twig_mem_priv_t priv;
+    uint8_t *device_view; // How the simulated VE sees it, virt_addr may not be mapped yet for imports
+    struct sim_mem *next;
+};
+
+struct sim_vld {
+    const uint8_t *data;
+    size_t pos, end; // In bits, relative to data
+    int detect_eptb;
+    uint64_t busy_until;
+};
+
+// A software stand-in for the VE: a register file, the H.264 SRAM, a bitreader that
+// really reads the stream, and slice decodes that "finish" after a configurable delay.
+struct sim_dev {
+    uint32_t regs[VE_REGS_SIZE / 4];
+    uint32_t sram[SIM_SRAM_SIZE / 4];
+    struct sim_vld vld;
+    int decode_pending, data_request; // data_request: the slice ran into VLD_END and the driver said more follows
+    uint64_t decode_done_at;
+    uint32_t decode_count;
+    unsigned int decode_us, bits_us;
+    pthread_mutex_t lock; // Allocations may come from any thread, register accesses come from the decoder
+    struct sim_mem *mems;
+    uint32_t next_iommu;
+};
+
+static uint64_t sim_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sim_sleep_until(uint64_t deadline) {
+    struct timespec ts = {
+        .tv_sec = deadline / 1000000000ull,
+        .tv_nsec = deadline % 1000000000ull
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        ;
+}
+
+static unsigned int sim_env_uint(const char *name) {
+    const char *value = getenv(name);
+    return value ? (unsigned int)strtoul(value, NULL, 0) : 0;
+}
+
+// Resolve a device address back to CPU memory, returns NULL if nothing we handed out covers it
+static uint8_t *sim_lookup(struct sim_dev *sim, uint32_t addr, size_t *avail) {
+    uint8_t *ptr = NULL;
+    pthread_mutex_lock(&sim->lock);
+    for (struct sim_mem *mem = sim->mems; mem; mem = mem->next) {
+        twig_mem_t *pub = &mem->priv.pub_mem;
+        if (addr >= pub->iommu_addr && addr < pub->iommu_addr + pub->size) {
+            ptr = mem->device_view + (addr - pub->iommu_addr);
+            if (avail)
+                *avail = pub->size - (addr - pub->iommu_addr);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim->lock);
+    return ptr;
+}
+
+static uint32_t sim_vld_get_bits(struct sim_vld *vld, int num) {
+    uint32_t value = 0;
+    for (int i = 0; i < num; i++) {
+        if ((vld->pos & 7) == 0 && vld->detect_eptb && vld->pos >= 16 && vld->pos < vld->end) {
+            const uint8_t *byte = vld->data + (vld->pos >> 3);
+            if (byte[0] == 0x03 && byte[-1] == 0x00 && byte[-2] == 0x00)
+                vld->pos += 8;
+        }
+
+        int bit = 0;
+        if (vld->pos < vld->end)
+            bit = (vld->data[vld->pos >> 3] >> (7 - (vld->pos & 7))) & 1;
+        vld->pos++;
+        value = (value << 1) | bit;
+    }
+    return value;
+}
+
+static uint32_t sim_vld_get_ue(struct sim_vld *vld) {
+    int leading_zeros = 0;
+    while (vld->pos < vld->end && sim_vld_get_bits(vld, 1) == 0 && leading_zeros < 32)
+        leading_zeros++;
+
+    return ((1u << leading_zeros) - 1) + sim_vld_get_bits(vld, leading_zeros);
+}
+
+static void sim_vld_init(struct sim_dev *sim) {
+    uint32_t vld_addr = sim->regs[H264_VLD_ADDR / 4];
+    uint32_t base = (vld_addr & 0x0ffffff0) | ((vld_addr & 0xf) << 28);
+    size_t avail = 0;
+
+    sim->vld.data = sim_lookup(sim, base, &avail);
+    sim->vld.pos = sim->regs[H264_VLD_OFFSET / 4];
+    sim->vld.end = 0;
+    if (sim->vld.data) {
+        uint32_t end = sim->regs[H264_VLD_END / 4];
+        size_t len = (end > base && end - base < avail) ? end - base : avail;
+        sim->vld.end = len * 8;
+        if (sim->vld.pos + sim->regs[H264_VLD_LEN / 4] < sim->vld.end) // VLD_LEN counts from the offset
+            sim->vld.end = sim->vld.pos + sim->regs[H264_VLD_LEN / 4];
+    }
+    sim->vld.detect_eptb = !(sim->regs[H264_CTRL / 4] & (0x1 << 24));
+}
+
+// Secondary output gets the same stamp, plus chroma that says which plane is which: U is 0x40, V is 0xc0
+static void sim_write_extra_output(struct sim_dev *sim, const int32_t stamp[2]) {
+    uint32_t luma_addr = sim->regs[H264_SDROT_LUMA / 4], chroma_addr = sim->regs[H264_SDROT_CHROMA / 4];
+    size_t luma_avail = 0, chroma_avail = 0;
+    uint8_t *luma = sim_lookup(sim, luma_addr, &luma_avail);
+    uint8_t *chroma = sim_lookup(sim, chroma_addr, &chroma_avail);
+    if (!luma || !chroma || chroma_addr <= luma_addr)
+        return;
+
+    size_t luma_size = chroma_addr - luma_addr;
+    size_t chroma_size = VE_EXTRA_OUT_CHROMA_LEN(sim->regs[VE_EXTRA_OUT_FMT_OFFSET / 4]);
+    if (luma_size > luma_avail || chroma_size > chroma_avail || luma_size < 2 * sizeof(int32_t))
+        return;
+
+    memset(luma, 0x80, luma_size);
+    memcpy(luma, stamp, 2 * sizeof(int32_t));
+    switch (sim->regs[VE_OUTPUT_FORMAT / 4] & 0x7) {
+        case VE_OUTPUT_FMT_NV12:
+        case VE_OUTPUT_FMT_NV21: {
+            int nv21 = (sim->regs[VE_OUTPUT_FORMAT / 4] & 0x7) == VE_OUTPUT_FMT_NV21;
+            for (size_t i = 0; i + 1 < chroma_size; i += 2) {
+                chroma[i] = nv21 ? 0xc0 : 0x40;
+                chroma[i + 1] = nv21 ? 0x40 : 0xc0;
+            }
+            break;
+        }
+        case VE_OUTPUT_FMT_YV12:
+            memset(chroma, 0xc0, chroma_size / 2);
+            memset(chroma + chroma_size / 2, 0x40, chroma_size / 2);
+            break;
+        default:
+            memset(chroma, 0x80, chroma_size);
+            break;
+    }
+}
+
+// Paint the output picture so callers can tell a "decoded" frame from an untouched one.
+// Luma goes flat grey with the POC and the decode sequence number stamped into the first 8 bytes.
+static void sim_decode_picture(struct sim_dev *sim) {
+    uint32_t idx = sim->regs[H264_OUTPUT_FRAME_INDEX / 4];
+    if (idx >= 18)
+        return;
+
+    const uint32_t *entry = &sim->sram[VE_SRAM_H264_FRAMEBUFFER_LIST / 4 + idx * 8];
+    uint32_t luma_addr = entry[3], chroma_addr = entry[4];
+    size_t luma_avail = 0, chroma_avail = 0;
+    uint8_t *luma = sim_lookup(sim, luma_addr, &luma_avail);
+    uint8_t *chroma = sim_lookup(sim, chroma_addr, &chroma_avail);
+    if (!luma || !chroma || chroma_addr <= luma_addr)
+        return;
+
+    size_t luma_size = chroma_addr - luma_addr;
+    size_t chroma_size = luma_size / 2;
+    memset(luma, 0x80, luma_size < luma_avail ? luma_size : luma_avail);
+    memset(chroma, 0x80, chroma_size < chroma_avail ? chroma_size : chroma_avail);
+
+    int32_t stamp[2] = { (int16_t)entry[0], (int32_t)sim->decode_count };
+    if (luma_size >= sizeof(stamp))
+        memcpy(luma, stamp, sizeof(stamp));
+    if (sim->regs[H264_SDROT_CTRL / 4] & H264_SDROT_ENABLE)
+        sim_write_extra_output(sim, stamp);
+}
+
+// Slice data runs up to the next start code. Running into VLD_END first ends the slice too, unless the
+// driver left last_slice_data clear. Then the VE stops there and asks for the rest (status bit 2).
+static void sim_decode_slice(struct sim_dev *sim) {
+    int more_data = !(sim->regs[H264_VLD_ADDR / 4] & (0x1 << 29));
+    for (size_t byte = (sim->vld.pos + 7) / 8; more_data && sim->vld.data && byte + 3 <= sim->vld.end / 8; byte++) {
+        const uint8_t *data = sim->vld.data + byte;
+        if (data[0] == 0x00 && data[1] == 0x00 && data[2] == 0x01)
+            more_data = 0;
+    }
+
+    sim->vld.pos = sim->vld.end;
+    sim->data_request = more_data;
+    sim->decode_pending = 1;
+    sim->decode_done_at = sim_now() + sim->decode_us * 1000ull;
+}
+
+static void sim_finish_slice(struct sim_dev *sim) {
+    sim->decode_pending = 0;
+    sim->regs[H264_STATUS / 4] |= sim->data_request ? 0x4 : 0x1; // Data request or slice decode finished
+}
+
+static void sim_trigger(struct sim_dev *sim, uint32_t value) {
+    int num = (value >> 8) & 0x3f;
+    switch (value & 0xf) {
+        case 2: // Get bits
+            sim->regs[H264_BASIC_BITS / 4] = sim_vld_get_bits(&sim->vld, num);
+            break;
+        case 3: // Skip bits
+            sim_vld_get_bits(&sim->vld, num);
+            break;
+        case 4: { // se(v)
+            uint32_t code = sim_vld_get_ue(&sim->vld);
+            sim->regs[H264_BASIC_BITS / 4] = (code & 1) ? (code + 1) >> 1 : -(int32_t)(code >> 1);
+            break;
+        }
+        case 5: // ue(v)
+            sim->regs[H264_BASIC_BITS / 4] = sim_vld_get_ue(&sim->vld);
+            break;
+        case 7: // INIT_SWDEC
+            sim_vld_init(sim);
+            break;
+        case 8: // Decode slice
+            if ((sim->regs[VE_CTRL / 4] & 0xf) != 0x1) { // Engine select isn't H.264, real hardware would never finish
+                TWIG_LOG(WARN, "WARNING: Simulated VE got a slice while not in H.264 mode, ignoring it!\n");
+                break;
+            }
+            if (sim->regs[H264_SLICE_HDR / 4] & (0x1 << 5)) { // first_slice_in_pic
+                sim->decode_count++;
+                sim_decode_picture(sim);
+            }
+            sim_decode_slice(sim);
+            break;
+        default:
+            break;
+    }
+
+    if ((value & 0xf) >= 2 && (value & 0xf) <= 5 && sim->bits_us)
+        sim->vld.busy_until = sim_now() + sim->bits_us * 1000ull;
+    sim->regs[H264_VLD_OFFSET / 4] = sim->vld.pos;
+}
+
+static uint32_t sim_readl(twig_dev_t *cedar, uint32_t reg) {
+    struct sim_dev *sim = cedar->priv;
+    if (reg >= VE_REGS_SIZE)
+        return 0;
+
+    if (reg == H264_STATUS) {
+        uint64_t now = sim_now();
+        if (sim->decode_pending && now >= sim->decode_done_at)
+            sim_finish_slice(sim);
+        uint32_t status = sim->regs[H264_STATUS / 4];
+        if (now < sim->vld.busy_until)
+            status |= (0x1 << 8); // VLD busy
+        return status;
+    }
+    return sim->regs[reg / 4];
+}
+
+static void sim_writel(twig_dev_t *cedar, uint32_t reg, uint32_t value) {
+    struct sim_dev *sim = cedar->priv;
+    if (reg >= VE_REGS_SIZE)
+        return;
+
+    switch (reg) {
+        case H264_STATUS: // Write 1 to clear
+            if ((value & 0x4) && (sim->regs[reg / 4] & 0x4) && sim->data_request) { // Data request answered, carry on from the new VLD_ADDR
+                sim->regs[reg / 4] &= ~value;
+                sim_vld_init(sim);
+                sim_decode_slice(sim);
+                break;
+            }
+            sim->regs[reg / 4] &= ~value;
+            break;
+        case H264_RAM_WRITE_DATA: {
+            uint32_t ptr = sim->regs[H264_RAM_WRITE_PTR / 4];
+            sim->sram[(ptr / 4) % (SIM_SRAM_SIZE / 4)] = value;
+            sim->regs[H264_RAM_WRITE_PTR / 4] = ptr + 4;
+            break;
+        }
+        case H264_TRIGGER:
+            sim->regs[reg / 4] = value;
+            sim_trigger(sim, value);
+            break;
+        default:
+            sim->regs[reg / 4] = value;
+            break;
+    }
+}
+
+static int sim_wait(twig_dev_t *cedar) {
+    struct sim_dev *sim = cedar->priv;
+    if (!sim->decode_pending)
+        return (sim->regs[H264_STATUS / 4] & 0x7) ? 0 : -1; // Nothing in flight, real hardware would time out
+
+    sim_sleep_until(sim->decode_done_at);
+    sim_finish_slice(sim);
+    return 0;
+}
+
+// Hands out a device address range, like the IOMMU mapping on hardware
+static void sim_add_mem(struct sim_dev *sim, struct sim_mem *mem, size_t aligned_size) {
+    twig_mem_t *pub = &mem->priv.pub_mem;
+    pthread_mutex_lock(&sim->lock);
+    pub->iommu_addr = sim->next_iommu;
+    pub->phys_addr = pub->iommu_addr;
+    sim->next_iommu += aligned_size + 4096; // Leave a hole so overruns don't land in the neighbour
+    mem->next = sim->mems;
+    sim->mems = mem;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+static twig_mem_t *sim_alloc(twig_dev_t *cedar, size_t size, unsigned int flags) {
+    struct sim_dev *sim = cedar->priv;
+    struct sim_mem *mem = calloc(1, sizeof(*mem));
+    if (!mem)
+        return NULL;
+
+    size_t aligned_size = (size + 4095) & ~(4095);
+    twig_mem_t *pub = &mem->priv.pub_mem;
+    pub->ion_fd = memfd_create("twig-sim", MFD_CLOEXEC); // A real fd, so the buffer can be mapped/shared like a dma-buf
+    if (pub->ion_fd < 0)
+        goto err_free;
+
+    if (ftruncate(pub->ion_fd, aligned_size) < 0)
+        goto err_close;
+
+    pub->size = size;
+    pub->virt_addr = mmap(NULL, aligned_size, PROT_READ | PROT_WRITE, MAP_SHARED, pub->ion_fd, 0);
+    if (pub->virt_addr == MAP_FAILED)
+        goto err_close;
+
+    mem->device_view = pub->virt_addr;
+    sim_add_mem(sim, mem, aligned_size);
+    return pub;
+
+err_close:
+    close(pub->ion_fd);
+err_free:
+    free(mem);
+    return NULL;
+}
+
+// Anything mmap-able works as a "dma-buf" here, memfds and udmabufs included
+static twig_mem_t *sim_import(twig_dev_t *cedar, int fd, size_t size) {
+    struct sim_dev *sim = cedar->priv;
+    struct sim_mem *mem = calloc(1, sizeof(*mem));
+    if (!mem)
+        return NULL;
+
+    size_t aligned_size = (size + 4095) & ~(4095);
+    mem->device_view = mmap(NULL, aligned_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem->device_view == MAP_FAILED) {
+        free(mem);
+        return NULL;
+    }
+
+    twig_mem_t *pub = &mem->priv.pub_mem;
+    pub->ion_fd = fd;
+    pub->size = size;
+    sim_add_mem(sim, mem, aligned_size);
+    return pub;
+}
+
+static void sim_flush(twig_dev_t *cedar, twig_mem_t *mem, size_t offset, size_t len) {
+    // Simulated device shares the CPU's view of memory, nothing to do
+}
+
+static void sim_invalidate(twig_dev_t *cedar, twig_mem_t *mem, size_t offset, size_t len) {
+    // Same as sim_flush, the VE's writes are already visible
+}
+
+static void sim_free(twig_dev_t *cedar, twig_mem_t *pub) {
+    struct sim_dev *sim = cedar->priv;
+    struct sim_mem *mem = (struct sim_mem *)pub;
+
+    pthread_mutex_lock(&sim->lock);
+    for (struct sim_mem **link = &sim->mems; *link; link = &(*link)->next) {
+        if (*link == mem) {
+            *link = mem->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim->lock);
+
+    if (pub->virt_addr && pub->virt_addr != (void *)mem->device_view) // Imports the CPU side mapped as well
+        munmap(pub->virt_addr, pub->size);
+    munmap(mem->device_view, (pub->size + 4095) & ~(4095));
+    close(pub->ion_fd);
+    free(mem);
+}
+
+static int sim_open(twig_dev_t *cedar) {
+    struct sim_dev *sim = calloc(1, sizeof(*sim));
+    if (!sim)
+        return -1;
+
+    pthread_mutex_init(&sim->lock, NULL);
+    sim->next_iommu = SIM_IOMMU_BASE;
+    sim->decode_us = sim_env_uint("TWIG_SIM_DECODE_US");
+    sim->bits_us = sim_env_uint("TWIG_SIM_BITS_US");
+    sim->regs[VE_VERSION / 4] = 0x16800000;
+
+    cedar->priv = sim;
+    cedar->regs = NULL; // Trap every access
+    return 0;
+}
+
+static void sim_close(twig_dev_t *cedar) {
+    struct sim_dev *sim = cedar->priv;
+    while (sim->mems) {
+        TWIG_LOG(WARN, "WARNING: Simulated VE closed with %zu bytes still allocated!\n", sim->mems->priv.pub_mem.size);
+        sim_free(cedar, &sim->mems->priv.pub_mem);
+    }
+
+    pthread_mutex_destroy(&sim->lock);
+    free(sim);
+    cedar->priv = NULL;
+}
+
+const twig_backend_t twig_sim_backend = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .readl = sim_readl,
+    .writel = sim_writel,
+    .wait = sim_wait,
+    .alloc = sim_alloc,
+    .import = sim_import,
+    .flush = sim_flush,
+    .invalidate = sim_invalidate,
+    .free = sim_free,
+};
+
+EXPORT int twig_sim_set_latency(twig_dev_t *cedar, unsigned int decode_us, unsigned int bits_us) {
+    if (!cedar || cedar->backend != &twig_sim_backend)
+        return -1;
+
+    struct sim_dev *sim = cedar->priv;
+    sim->decode_us = decode_us;
+    sim->bits_us = bits_us;
+    return 0;
+}
\ No newline at end of file
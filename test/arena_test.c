@@ -0,0 +1,169 @@
+#include <time.h>
+#include "twig.h"
+
+#define CHUNK_SIZE (4 * 1024 * 1024)
+#define MAX_LIVE 64
+
+static void print_usage(const char *prog_name) {
+    printf("Usage: %s [rounds]\n", prog_name);
+    printf("  rounds          - Optional: random alloc/free rounds to run against the arena (default 20000)\n");
+}
+
+static uint32_t rng_state = 0x1234567;
+static uint32_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Mix of bitstream buffers, extra data and frames, a bit smaller than the chunk at most
+static size_t random_size(void) {
+    switch (rng_next() % 3) {
+        case 0: return 1 + rng_next() % (64 * 1024);
+        case 1: return 64 * 1024 + rng_next() % (512 * 1024);
+        default: return 512 * 1024 + rng_next() % (CHUNK_SIZE / 2);
+    }
+}
+
+// Every live buffer is page aligned, has its own device range, and still holds the pattern it was filled with
+static int check_live(twig_mem_t **live, int count) {
+    for (int i = 0; i < count; i++) {
+        if (live[i]->iommu_addr & 4095) {
+            printf("Buffer at 0x%08x isn't page aligned\n", live[i]->iommu_addr);
+            return -1;
+        }
+        if (((uint8_t *)live[i]->virt_addr)[0] != (uint8_t)i || ((uint8_t *)live[i]->virt_addr)[live[i]->size - 1] != (uint8_t)i) {
+            printf("Buffer at 0x%08x was overwritten\n", live[i]->iommu_addr);
+            return -1;
+        }
+        for (int j = i + 1; j < count; j++) {
+            if (live[i]->iommu_addr < live[j]->iommu_addr + live[j]->size && live[j]->iommu_addr < live[i]->iommu_addr + live[i]->size) {
+                printf("Buffers at 0x%08x and 0x%08x overlap\n", live[i]->iommu_addr, live[j]->iommu_addr);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void fill(twig_mem_t *mem, int index) {
+    memset(mem->virt_addr, index, mem->size);
+}
+
+static int stress(twig_dev_t *cedar, int rounds) {
+    twig_mem_t *live[MAX_LIVE];
+    int count = 0, ret = 0;
+    for (int round = 0; round < rounds && ret == 0; round++) {
+        if (count < MAX_LIVE && (count == 0 || rng_next() % 2)) {
+            live[count] = twig_alloc_mem(cedar, random_size());
+            if (!live[count]) {
+                printf("Allocation failed with %d buffers live\n", count);
+                ret = -1;
+                break;
+            }
+            fill(live[count], count);
+            count++;
+        } else {
+            int victim = rng_next() % count;
+            twig_free_mem(cedar, live[victim]);
+            live[victim] = live[--count];
+            if (victim < count)
+                fill(live[victim], victim); // Moved down, so its pattern changes with its index
+        }
+        if (round % 64 == 0)
+            ret = check_live(live, count);
+    }
+    if (ret == 0)
+        ret = check_live(live, count);
+
+    while (count)
+        twig_free_mem(cedar, live[--count]);
+    return ret;
+}
+
+// Neighbours have to merge back, or a chunk-sized request after the churn can't be served from the arena
+static int check_coalescing(twig_dev_t *cedar) {
+    twig_mem_t *a = twig_alloc_mem(cedar, CHUNK_SIZE / 4);
+    twig_mem_t *b = twig_alloc_mem(cedar, CHUNK_SIZE / 4);
+    twig_mem_t *c = twig_alloc_mem(cedar, CHUNK_SIZE / 2);
+    if (!a || !b || !c)
+        return -1;
+
+    int shared = (a->ion_fd == b->ion_fd && b->ion_fd == c->ion_fd);
+    int fd = a->ion_fd;
+    twig_free_mem(cedar, b);
+    twig_free_mem(cedar, a);
+    twig_free_mem(cedar, c);
+
+    twig_mem_t *whole = twig_alloc_mem(cedar, CHUNK_SIZE);
+    twig_mem_t *big = twig_alloc_mem(cedar, CHUNK_SIZE + 1);
+    int ret = 0;
+    if (!shared) {
+        printf("Sub-allocations didn't share their chunk's fd\n");
+        ret = -1;
+    } else if (!whole || whole->ion_fd != fd || whole->fd_offset != 0) {
+        printf("Freed neighbours weren't merged back into one block\n");
+        ret = -1;
+    } else if (!big || big->ion_fd == fd || big->fd_offset != 0) {
+        printf("Oversized request didn't get its own allocation\n");
+        ret = -1;
+    }
+
+    twig_free_mem(cedar, whole);
+    twig_free_mem(cedar, big);
+    return ret;
+}
+
+static double time_allocs(twig_dev_t *cedar, int count) {
+    twig_mem_t *live[MAX_LIVE];
+    double t = now_sec();
+    for (int i = 0; i < count; i++) {
+        live[i % MAX_LIVE] = twig_alloc_mem(cedar, 512 * 1024);
+        if (i % MAX_LIVE == MAX_LIVE - 1) {
+            for (int j = 0; j < MAX_LIVE; j++)
+                twig_free_mem(cedar, live[j]);
+        }
+    }
+    for (int j = 0; j < count % MAX_LIVE; j++)
+        twig_free_mem(cedar, live[j]);
+    return (now_sec() - t) / count;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && argv[1][0] == '-') {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int rounds = (argc > 1) ? atoi(argv[1]) : 20000;
+    if (rounds < 1)
+        rounds = 1;
+
+    twig_dev_t *plain = twig_open_backend("sim");
+    twig_dev_t *cedar = twig_open_backend("sim");
+    if (!plain || !cedar || twig_enable_arena(cedar, CHUNK_SIZE) < 0) {
+        printf("Failed to open the simulated VE\n");
+        return 1;
+    }
+
+    int ret = stress(cedar, rounds);
+    if (ret == 0)
+        ret = check_coalescing(cedar);
+    if (ret == 0) {
+        printf("Arena survived %d rounds, no overlaps, neighbours merge back\n", rounds);
+        double plain_time = time_allocs(plain, 4096);
+        double arena_time = time_allocs(cedar, 4096);
+        printf("alloc+free: plain %.2f us, arena %.2f us\n", plain_time * 1e6, arena_time * 1e6);
+    }
+
+    twig_close(cedar);
+    twig_close(plain);
+    return ret == 0 ? 0 : 1;
+}
\ No newline at end of file
@@ -41,9 +41,11 @@ static void dump_yuv_frame(const char *filename, twig_mem_t *frame_buf, uint16_t
 
     uint8_t *yuv_data = (uint8_t *)frame_buf->virt_addr;
 
+    twig_mem_begin_cpu_access(frame_buf, TWIG_CPU_READ, 0, width * height * 3 / 2); // Free if check_frame_content already did it
     fwrite(yuv_data, 1, width * height, f);
     fwrite(yuv_data + (width * height), 1, (width * height) / 4, f);
     fwrite(yuv_data + (width * height) + (width * height) / 4, 1, (width * height) / 4, f);
+    twig_mem_end_cpu_access(frame_buf, TWIG_CPU_READ, 0, width * height * 3 / 2);
 
     fclose(f);
     printf("First frame dumped to %s (%dx%d YUV420)\n", filename, width, height);
@@ -67,11 +69,13 @@ static int check_frame_content(twig_mem_t *frame_buf, uint16_t width, uint16_t h
     int total_bytes = width * height * 3 / 2;
     int non_zero_count = 0;
 
+    twig_mem_begin_cpu_access(frame_buf, TWIG_CPU_READ, 0, total_bytes); // Only the planes, not the padding after them
     for (int i = 0; i < total_bytes; i++) {
         if (data[i] != 0) {
             non_zero_count++;
         }
     }
+    twig_mem_end_cpu_access(frame_buf, TWIG_CPU_READ, 0, total_bytes);
 
     printf("Frame content check: %d/%d bytes non-zero (%.1f%%)\n", 
            non_zero_count, total_bytes, (100.0 * non_zero_count) / total_bytes);
@@ -135,6 +139,8 @@ int main(int argc, char *argv[]) {
     printf("Bitstream buffer allocated and filled (%zu bytes)\n", file_size);
     printf("\nStarting decode...\n");
     twig_mem_t *output_frame = twig_h264_decode_frame(decoder, bitstream_buf);
+    if (!output_frame) // Reordering streams hold frames back until they know nothing comes before them
+        output_frame = twig_h264_flush(decoder);
 
     if (output_frame) {
         printf("Got output from decoder, testing results...\n");
@@ -1,6 +1,459 @@
+#define _GNU_SOURCE // memfd_create
+#include <poll.h>
 #include "twig.h"
 
-// TODO: Implement real-world test that can process whole .h264 files
-int main(int argc, char *argv[]) {
+#define BITSTREAM_SLOTS 4
+#define MAX_HOLD 8
+#define RING_SIZE 4096 // Small enough that access units keep straddling the end
+#define EXTERNAL_FRAMES 8
+#define EXTERNAL_FRAME_SIZE (1920 * 1088 * 3 / 2) // Doesn't know the stream yet, so big enough for anything up to 1080p
+
+typedef struct {
+    const char *name;
+    twig_output_format_t format;
+    int scale_shift;
+    twig_rotation_t rotation;
+    int keep_full;
+} output_mode_t;
+
+static const output_mode_t output_modes[] = {
+    { "nv12", TWIG_OUTPUT_NV12, 0, TWIG_ROTATE_0, 0 },
+    { "nv21", TWIG_OUTPUT_NV21, 0, TWIG_ROTATE_0, 0 },
+    { "yv12", TWIG_OUTPUT_YV12, 0, TWIG_ROTATE_0, 0 },
+    { "preview", TWIG_OUTPUT_NV12, 2, TWIG_ROTATE_90, 1 },
+    { "thumb", TWIG_OUTPUT_YV12, 3, TWIG_ROTATE_180, 0 }
+};
+
+// Frames the "display" still has, each with the stamp it had on output so reuse under our feet shows up
+typedef struct {
+    twig_mem_t *frame;
+    int32_t stamp[2];
+} held_frame_t;
+
+static void print_usage(const char *prog_name) {
+    printf("Usage: %s <input.h264> [loops] [hold] [tiled|ring|import|external|nv12|nv21|yv12|preview|thumb] [slices]\n", prog_name);
+    printf("  input.h264      - Raw Annex B H.264 file\n");
+    printf("  loops           - Optional: feed the whole file this many times (default 1)\n");
+    printf("  hold            - Optional: keep this many frames out like a display queue would (default 0)\n");
+    printf("  tiled           - Optional: the default, own buffers and tiled frames only\n");
+    printf("  ring            - Optional: write access units into the decoder's bitstream ring instead of own buffers\n");
+    printf("  import          - Optional: hand access units over in memfds imported as dma-bufs, like a demuxer would\n");
+    printf("  external        - Optional: decode into our own frame buffers instead of the library's\n");
+    printf("  nv12|nv21|yv12  - Optional: have the VE write linear frames in this format next to the tiled ones\n");
+    printf("  preview         - Optional: quarter size NV12 turned sideways, handed out next to the full frame\n");
+    printf("  thumb           - Optional: eighth size YV12 upside down, handed out instead of the full frame\n");
+    printf("  slices          - Optional: slices the VE should get per pass through the file, broken ones left out\n");
+}
+
+static int load_file_to_memory(const char *filename, uint8_t **data, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open %s\n", filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        printf("Failed to get file size\n");
+        close(fd);
+        return -1;
+    }
+
+    *size = st.st_size;
+    *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (*data == MAP_FAILED) {
+        printf("Failed to map file into memory\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static size_t find_start_code(const uint8_t *data, size_t size, size_t start) {
+    for (size_t pos = start; pos + 2 < size; pos++) {
+        if (data[pos] == 0x00 && data[pos + 1] == 0x00 && data[pos + 2] == 0x01)
+            return pos;
+    }
+    return size;
+}
+
+// Poor man's demuxer: an access unit starts at SPS/PPS/AUD/SEI or at a slice whose first_mb_in_slice is 0
+static size_t next_access_unit(const uint8_t *data, size_t size, size_t start) {
+    int have_slice = 0;
+    size_t pos = find_start_code(data, size, start);
+    while (pos < size) {
+        if (pos + 4 >= size)
+            return size;
+
+        int nal_type = data[pos + 3] & 0x1f;
+        int first_mb_zero = data[pos + 4] & 0x80;
+        if (nal_type == 1 || nal_type == 5) {
+            if (have_slice && first_mb_zero)
+                break;
+            have_slice = 1;
+        } else if (have_slice && (nal_type == 6 || nal_type == 7 || nal_type == 8 || nal_type == 9)) {
+            break;
+        }
+        pos = find_start_code(data, size, pos + 3);
+    }
+
+    while (pos < size && pos > start && data[pos - 1] == 0x00) // Keep 4-byte start codes with the next unit
+        pos--;
+    return pos;
+}
+
+// The sim stamps each picture with its POC, so output order can be checked without real pixels.
+// Every test stream counts POC up by 2 per frame and starts over at 0 on IDRs, so a gap means a picture got the wrong POC.
+static int check_output_order(twig_mem_t *frame, int *last_poc) {
+    int32_t poc;
+    twig_mem_begin_cpu_access(frame, TWIG_CPU_READ, 0, sizeof(poc)); // Just the first line, not the whole frame
+    memcpy(&poc, frame->virt_addr, sizeof(poc));
+    twig_mem_end_cpu_access(frame, TWIG_CPU_READ, 0, sizeof(poc));
+    int in_order = (poc == 0 || poc == *last_poc + 2);
+    if (!in_order)
+        printf("Out of order: POC %d after POC %d\n", poc, *last_poc);
+    *last_poc = poc;
+    return in_order;
+}
+
+// With external frames, every picture has to land in one of the buffers we registered
+static int is_own_buffer(twig_mem_t *frame, twig_mem_t **frame_bufs, int count) {
+    if (count == 0)
+        return 1;
+
+    for (int i = 0; i < count; i++) {
+        if (frame == frame_bufs[i])
+            return 1;
+    }
+    printf("Frame came back in a buffer we never registered\n");
     return 0;
 }
+
+// The sim paints U as 0x40 and V as 0xc0 in linear output, so swapped or misplaced planes show up
+static int check_chroma(twig_mem_t *copy, const twig_frame_info_t *info) {
+    const uint8_t *data = copy->virt_addr;
+    twig_mem_begin_cpu_access(copy, TWIG_CPU_READ, info->offset[1], copy->size - info->offset[1]); // Chroma only
+    uint8_t u = (info->format == TWIG_OUTPUT_YV12) ? data[info->offset[2]] : data[info->offset[1] + (info->format == TWIG_OUTPUT_NV21)];
+    uint8_t v = (info->format == TWIG_OUTPUT_YV12) ? data[info->offset[1]] : data[info->offset[1] + (info->format == TWIG_OUTPUT_NV12)];
+    twig_mem_end_cpu_access(copy, TWIG_CPU_READ, info->offset[1], copy->size - info->offset[1]);
+    if (u != 0x40 || v != 0xc0) {
+        printf("Chroma planes are mixed up: U 0x%02x, V 0x%02x\n", u, v);
+        return 0;
+    }
+    return 1;
+}
+
+// With keep_full the copy rides along with the tiled frame, so it has to be the same picture at the expected size
+static int check_alongside(twig_h264_decoder_t *decoder, twig_mem_t *frame, const twig_frame_info_t *info, twig_mem_t *copy) {
+    twig_frame_info_t full;
+    if (twig_h264_get_frame_info(decoder, frame, &full) < 0 || full.format != TWIG_OUTPUT_TILED) {
+        printf("Full frame isn't the tiled one\n");
+        return 0;
+    }
+
+    int sideways = (info->rotation == TWIG_ROTATE_90 || info->rotation == TWIG_ROTATE_270);
+    int width = (((sideways ? full.height : full.width) >> info->scale_shift) + 1) & ~1;
+    int height = (((sideways ? full.width : full.height) >> info->scale_shift) + 1) & ~1;
+    if (info->width != width || info->height != height) {
+        printf("Secondary copy is %dx%d, expected %dx%d\n", info->width, info->height, width, height);
+        return 0;
+    }
+
+    int32_t stamps[2][2];
+    twig_mem_begin_cpu_access(frame, TWIG_CPU_READ, 0, sizeof(stamps[0]));
+    twig_mem_begin_cpu_access(copy, TWIG_CPU_READ, 0, sizeof(stamps[1]));
+    memcpy(stamps[0], frame->virt_addr, sizeof(stamps[0]));
+    memcpy(stamps[1], copy->virt_addr, sizeof(stamps[1]));
+    twig_mem_end_cpu_access(frame, TWIG_CPU_READ, 0, sizeof(stamps[0]));
+    twig_mem_end_cpu_access(copy, TWIG_CPU_READ, 0, sizeof(stamps[1]));
+    if (memcmp(stamps[0], stamps[1], sizeof(stamps[0])) != 0) {
+        printf("Secondary copy is from a different picture\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Linear output has to come back in the format, scale and rotation asked for. Tiled frames have nothing to check.
+static int check_output(twig_h264_decoder_t *decoder, twig_mem_t *frame, const output_mode_t *mode) {
+    if (!mode)
+        return 1;
+
+    twig_frame_info_t info;
+    twig_mem_t *copy = mode->keep_full ? twig_h264_get_secondary(decoder, frame, &info) : frame;
+    if (!copy || (!mode->keep_full && twig_h264_get_frame_info(decoder, frame, &info) < 0)
+            || info.format != mode->format || info.scale_shift != mode->scale_shift || info.rotation != mode->rotation
+            || info.offset[info.planes - 1] >= copy->size) {
+        printf("Frame came back without the layout we asked for\n");
+        return 0;
+    }
+
+    if (mode->keep_full && !check_alongside(decoder, frame, &info, copy))
+        return 0;
+    return check_chroma(copy, &info);
+}
+
+// Queues the frame and returns the oldest ones past the hold depth, NULL just drains down.
+// Returns how many came back with a changed stamp, meaning the decoder reused or freed them while held.
+static int display_frame(twig_h264_decoder_t *decoder, twig_mem_t *frame, held_frame_t *held, int *held_count, int hold) {
+    if (frame) {
+        held[*held_count].frame = frame;
+        twig_mem_begin_cpu_access(frame, TWIG_CPU_READ, 0, sizeof(held[*held_count].stamp));
+        memcpy(held[*held_count].stamp, frame->virt_addr, sizeof(held[*held_count].stamp));
+        twig_mem_end_cpu_access(frame, TWIG_CPU_READ, 0, sizeof(held[*held_count].stamp));
+        (*held_count)++;
+    }
+
+    int clobbered = 0;
+    while (*held_count > hold) {
+        twig_mem_begin_cpu_access(held[0].frame, TWIG_CPU_READ, 0, sizeof(held[0].stamp)); // Catches a decode into it while held
+        if (memcmp(held[0].stamp, held[0].frame->virt_addr, sizeof(held[0].stamp)) != 0) {
+            printf("Held frame was overwritten while the app still had it\n");
+            clobbered++;
+        }
+        twig_mem_end_cpu_access(held[0].frame, TWIG_CPU_READ, 0, sizeof(held[0].stamp));
+        twig_h264_return_frame(decoder, held[0].frame);
+        memmove(held, held + 1, --(*held_count) * sizeof(*held));
+    }
+    return clobbered;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int loops = (argc > 2) ? atoi(argv[2]) : 1;
+    if (loops < 1)
+        loops = 1;
+
+    int hold = (argc > 3) ? atoi(argv[3]) : 0;
+    if (hold < 0 || hold > MAX_HOLD)
+        hold = 0;
+
+    int use_ring = (argc > 4) && strcmp(argv[4], "ring") == 0;
+    int use_import = (argc > 4) && strcmp(argv[4], "import") == 0;
+    int use_external = (argc > 4) && strcmp(argv[4], "external") == 0;
+    const output_mode_t *mode = NULL;
+    for (size_t i = 0; argc > 4 && i < sizeof(output_modes) / sizeof(output_modes[0]); i++) {
+        if (strcmp(argv[4], output_modes[i].name) == 0)
+            mode = &output_modes[i];
+    }
+    int slices = (argc > 5) ? atoi(argv[5]) : 0;
+
+    uint8_t *file_data;
+    size_t file_size;
+    if (load_file_to_memory(argv[1], &file_data, &file_size) < 0)
+        return 1;
+
+    twig_dev_t *cedar = twig_open();
+    if (!cedar) {
+        printf("Failed to initialize Cedar VE\n");
+        munmap(file_data, file_size);
+        return 1;
+    }
+
+    twig_h264_decoder_t *decoder = twig_h264_decoder_init(cedar);
+    if (!decoder) {
+        printf("Failed to initialize H.264 decoder\n");
+        twig_close(cedar);
+        munmap(file_data, file_size);
+        return 1;
+    }
+
+    twig_h264_decoder_set_pool_hint(decoder, hold + 1); // The held ones plus the one being checked
+    twig_h264_decoder_set_ring_size(decoder, RING_SIZE);
+    if (mode && (twig_h264_decoder_set_output_format(decoder, mode->format) < 0
+            || twig_h264_decoder_set_output_transform(decoder, mode->scale_shift, mode->rotation, mode->keep_full) < 0)) {
+        printf("Failed to set up the secondary output\n");
+        twig_h264_decoder_destroy(decoder);
+        twig_close(cedar);
+        munmap(file_data, file_size);
+        return 1;
+    }
+
+    // Each in-flight access unit needs its own buffer until it has been decoded
+    twig_mem_t *slots[BITSTREAM_SLOTS] = { 0 };
+    int slot_fds[BITSTREAM_SLOTS] = { -1, -1, -1, -1 };
+    twig_mem_t *frame_bufs[EXTERNAL_FRAMES + MAX_HOLD] = { 0 };
+    int frame_buf_count = use_external ? EXTERNAL_FRAMES + hold : 0;
+    int submitted = 0, frames = 0, errors = 0, loop = 0, last_poc = -1, held_count = 0;
+    held_frame_t held[MAX_HOLD + 1];
+    const char *backend = getenv("TWIG_BACKEND");
+    int is_sim = backend && strcmp(backend, "sim") == 0;
+    for (int i = 0; i < frame_buf_count; i++) { // Stand-ins for a renderer's or encoder's input buffers
+        frame_bufs[i] = twig_alloc_mem(cedar, EXTERNAL_FRAME_SIZE);
+        if (!frame_bufs[i]) {
+            printf("Failed to allocate frame buffer\n");
+            goto out;
+        }
+    }
+    if (use_external && twig_h264_decoder_use_external_frames(decoder, frame_bufs, frame_buf_count) < 0) {
+        printf("Failed to register frame buffers\n");
+        goto out;
+    }
+
+    for (int i = 0; i < BITSTREAM_SLOTS && use_import; i++) { // Stand-ins for the demuxer's own dma-bufs
+        slot_fds[i] = memfd_create("demux", MFD_CLOEXEC);
+        if (slot_fds[i] < 0 || ftruncate(slot_fds[i], file_size) < 0) {
+            printf("Failed to create bitstream memfd\n");
+            goto out;
+        }
+    }
+    for (int i = 0; i < BITSTREAM_SLOTS && !use_ring && !use_import; i++) {
+        slots[i] = twig_alloc_mem_flags(cedar, file_size, (i % 2) ? TWIG_MEM_UNCACHED : 0); // Both kinds, uncached ones never need a flush
+        if (!slots[i]) {
+            printf("Failed to allocate bitstream buffer\n");
+            goto out;
+        }
+    }
+
+    struct pollfd pfd = { .fd = twig_h264_get_fd(decoder), .events = POLLIN };
+    size_t pos = 0;
+    twig_mem_t *frame;
+    int ret;
+
+    while (loop < loops) {
+        // Keep the hardware fed while a slot is free, this side would be demuxing or reading the network.
+        // Access units decode in order, so only the newest get_pending() slots are still in use.
+        while (loop < loops && (use_ring || twig_h264_get_pending(decoder) < BITSTREAM_SLOTS)) {
+            size_t end = next_access_unit(file_data, file_size, pos);
+            if (use_ring) { // Straight into the decoder's ring, no buffers of our own
+                void *span = twig_h264_ring_reserve(decoder, end - pos);
+                if (!span)
+                    break;
+                memcpy(span, file_data + pos, end - pos);
+                if (twig_h264_ring_commit(decoder, end - pos) < 0)
+                    break;
+            } else if (use_import) { // Import every time, only the first import of each memfd should cost anything
+                int slot = submitted % BITSTREAM_SLOTS;
+                if (pwrite(slot_fds[slot], file_data + pos, end - pos, 0) != (ssize_t)(end - pos))
+                    break;
+                twig_mem_t *mem = twig_import_dmabuf(cedar, slot_fds[slot], 0);
+                if (!mem || (slots[slot] && mem != slots[slot])) {
+                    printf("Re-import didn't come from the cache\n");
+                    errors++;
+                }
+                if (lseek(slot_fds[slot], 0, SEEK_CUR) != 0) { // Importing must leave the producer's offset alone
+                    printf("Import moved the memfd's file offset\n");
+                    errors++;
+                }
+                twig_free_mem(cedar, slots[slot]); // Drops last round's import of this slot, it's been decoded
+                slots[slot] = mem;
+                if (!mem || twig_h264_submit(decoder, mem, end - pos) < 0)
+                    break;
+            } else {
+                twig_mem_t *slot = slots[submitted % BITSTREAM_SLOTS];
+                memcpy(slot->virt_addr, file_data + pos, end - pos);
+                twig_flush_range(slot, 0, end - pos); // Only what was written, and free for the uncached ones
+                if (twig_h264_submit(decoder, slot, end - pos) < 0)
+                    break;
+            }
+
+            submitted++;
+            pos = end;
+            if (pos >= file_size) {
+                pos = 0;
+                loop++;
+            }
+        }
+
+        if (poll(&pfd, 1, 5000) <= 0) {
+            printf("Timed out waiting for the decoder\n");
+            break;
+        }
+
+        while ((ret = twig_h264_poll(decoder, &frame)) != 0) {
+            if (ret < 0) {
+                errors++;
+                continue;
+            }
+            frames++;
+            if (is_sim && !check_output_order(frame, &last_poc))
+                errors++;
+            if (is_sim && !check_output(decoder, frame, mode))
+                errors++;
+            errors += !is_own_buffer(frame, frame_bufs, frame_buf_count);
+            errors += display_frame(decoder, frame, held, &held_count, hold); // This side would be displaying it
+        }
+    }
+
+    while ((frame = twig_h264_flush(decoder))) { // End of stream, whatever is still waiting for reordering comes out now
+        frames++;
+        if (is_sim && !check_output_order(frame, &last_poc))
+            errors++;
+        if (is_sim && !check_output(decoder, frame, mode))
+            errors++;
+        errors += !is_own_buffer(frame, frame_bufs, frame_buf_count);
+        errors += display_frame(decoder, frame, held, &held_count, hold);
+    }
+    errors += display_frame(decoder, NULL, held, &held_count, 0); // Let go of everything
+
+    int width = 0, height = 0;
+    twig_h264_get_frame_res(decoder, &width, &height);
+    printf("Decoded %d frames (%dx%d) from %d access units, %d errors\n", frames, width, height, submitted, errors);
+
+    twig_stream_stats_t stats;
+    twig_h264_get_stream_stats(decoder, &stats);
+    printf("Register writes: %llu issued, %llu elided\n", (unsigned long long)stats.mmio_issued, (unsigned long long)stats.mmio_elided);
+    if (frames > 1 && stats.mmio_elided == 0) { // Same SPS/PPS and references from picture to picture, some must have stuck
+        printf("Every register write went out again\n");
+        errors++;
+    }
+
+    twig_stats_t dev_stats;
+    if (twig_h264_get_stats(decoder, &dev_stats) == 0) { // Built with TWIG_ENABLE_STATS
+        twig_stage_stats_t *wait = &dev_stats.stages[TWIG_STAGE_VE_WAIT];
+        twig_stage_stats_t *decode = &dev_stats.stages[TWIG_STAGE_DECODE];
+        printf("Stats: %llu frames, %llu slices, %llu MMIO writes, %llu reads, VE busy %llu of %llu us\n",
+               (unsigned long long)dev_stats.frames, (unsigned long long)dev_stats.slices,
+               (unsigned long long)dev_stats.mmio_writes, (unsigned long long)dev_stats.mmio_reads,
+               (unsigned long long)wait->total_ns / 1000, (unsigned long long)decode->total_ns / 1000);
+        uint64_t binned = 0;
+        for (int i = 0; i < TWIG_STATS_BUCKETS; i++)
+            binned += decode->hist[i];
+        if (dev_stats.frames != (uint64_t)submitted || dev_stats.slices < dev_stats.frames || wait->count < dev_stats.slices ||
+            decode->count != dev_stats.frames || binned != decode->count || dev_stats.bytes_in_use == 0) {
+            printf("Stats don't add up\n");
+            errors++;
+        }
+        if (slices && dev_stats.slices != (uint64_t)slices * loops) { // Every slice of every picture, up to the first broken one
+            printf("VE got %llu slices, expected %d\n", (unsigned long long)dev_stats.slices, slices * loops);
+            errors++;
+        }
+    }
+
+    twig_trace_event_t trace[64];
+    int trace_count = twig_h264_get_trace(decoder, trace, 64);
+    if (trace_count >= 0) { // Built with the trace ring, the last few pictures must be in there
+        int traced_frames = 0;
+        for (int i = 0; i < trace_count; i++) {
+            traced_frames += (trace[i].event == TWIG_TRACE_FRAME);
+            if (i > 0 && trace[i].seq <= trace[i - 1].seq) {
+                printf("Trace came out of order\n");
+                errors++;
+            }
+        }
+        printf("Trace: %d events, %d frames\n", trace_count, traced_frames);
+        if (traced_frames == 0) {
+            printf("No decoded frames in the trace\n");
+            errors++;
+        }
+    }
+
+out:
+    for (int i = 0; i < BITSTREAM_SLOTS; i++) {
+        twig_free_mem(cedar, slots[i]);
+        if (slot_fds[i] >= 0)
+            close(slot_fds[i]);
+    }
+    twig_h264_decoder_destroy(decoder);
+    for (int i = 0; i < frame_buf_count; i++) // Ours, the decoder only borrowed them
+        twig_free_mem(cedar, frame_bufs[i]);
+    twig_close(cedar);
+    munmap(file_data, file_size);
+
+    return (frames == submitted && errors == 0) ? 0 : 1;
+}
\ No newline at end of file
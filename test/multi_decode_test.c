@@ -0,0 +1,306 @@
+#include <poll.h>
+#include "twig.h"
+
+#define MAX_STREAMS 16
+#define MAX_FILES 4
+#define BITSTREAM_SLOTS 2
+#define LIVE_FPS 1000
+
+// One camera: its own decoder and bitstream buffers, all of them sharing the one VE
+typedef struct {
+    twig_h264_decoder_t *decoder;
+    twig_mem_t *slots[BITSTREAM_SLOTS];
+    const uint8_t *data;
+    size_t size, pos;
+    int loop, submitted, frames, last_poc;
+    int droppable; // Non-reference access units it will be fed, the most a live stream may lose
+} stream_t;
+
+static void print_usage(const char *prog_name) {
+    printf("Usage: %s <streams> <loops> [live] <input.h264> [more.h264 ...]\n", prog_name);
+    printf("  streams         - Decoders to run side by side on one device, 1 to %d\n", MAX_STREAMS);
+    printf("  loops           - Feed each stream its whole file this many times\n");
+    printf("  live            - Optional: give every stream a %d fps deadline, more than the VE can keep up with\n", LIVE_FPS);
+    printf("  input.h264      - Raw Annex B H.264 files, handed out to the streams in turn (up to %d)\n", MAX_FILES);
+}
+
+static int load_file_to_memory(const char *filename, uint8_t **data, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open %s\n", filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        printf("Failed to get file size\n");
+        close(fd);
+        return -1;
+    }
+
+    *size = st.st_size;
+    *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (*data == MAP_FAILED) {
+        printf("Failed to map file into memory\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static size_t find_start_code(const uint8_t *data, size_t size, size_t start) {
+    for (size_t pos = start; pos + 2 < size; pos++) {
+        if (data[pos] == 0x00 && data[pos + 1] == 0x00 && data[pos + 2] == 0x01)
+            return pos;
+    }
+    return size;
+}
+
+// Poor man's demuxer: an access unit starts at SPS/PPS/AUD/SEI or at a slice whose first_mb_in_slice is 0
+static size_t next_access_unit(const uint8_t *data, size_t size, size_t start) {
+    int have_slice = 0;
+    size_t pos = find_start_code(data, size, start);
+    while (pos < size) {
+        if (pos + 4 >= size)
+            return size;
+
+        int nal_type = data[pos + 3] & 0x1f;
+        int first_mb_zero = data[pos + 4] & 0x80;
+        if (nal_type == 1 || nal_type == 5) {
+            if (have_slice && first_mb_zero)
+                break;
+            have_slice = 1;
+        } else if (have_slice && (nal_type == 6 || nal_type == 7 || nal_type == 8 || nal_type == 9)) {
+            break;
+        }
+        pos = find_start_code(data, size, pos + 3);
+    }
+
+    while (pos < size && pos > start && data[pos - 1] == 0x00) // Keep 4-byte start codes with the next unit
+        pos--;
+    return pos;
+}
+
+// Only pictures nothing refers to may be dropped, the first slice says which kind it is
+static int is_droppable(const uint8_t *data, size_t size, size_t start) {
+    for (size_t pos = find_start_code(data, size, start); pos + 3 < size; pos = find_start_code(data, size, pos + 3)) {
+        int nal_type = data[pos + 3] & 0x1f;
+        if (nal_type == 1 || nal_type == 5)
+            return (data[pos + 3] & 0x60) == 0;
+    }
+    return 0;
+}
+
+// The sim stamps each picture with its POC and a device-wide decode count. POC has to go up within a stream,
+// and no count may show up twice, or a picture came out that the VE never decoded (another stream's turn, or idle).
+static int check_frame(stream_t *stream, twig_mem_t *frame, uint8_t *seen, int seen_size) {
+    int32_t stamp[2];
+    twig_mem_begin_cpu_access(frame, TWIG_CPU_READ, 0, sizeof(stamp));
+    memcpy(stamp, frame->virt_addr, sizeof(stamp));
+    twig_mem_end_cpu_access(frame, TWIG_CPU_READ, 0, sizeof(stamp));
+
+    int ok = 1;
+    if (stamp[0] != 0 && stamp[0] <= stream->last_poc) {
+        printf("Out of order: POC %d after POC %d\n", stamp[0], stream->last_poc);
+        ok = 0;
+    }
+    if (stamp[1] <= 0 || stamp[1] >= seen_size || seen[stamp[1]]++) {
+        printf("Picture %d was never decoded, or came out twice\n", stamp[1]);
+        ok = 0;
+    }
+    stream->last_poc = stamp[0];
+    return ok;
+}
+
+static int open_stream(twig_dev_t *cedar, stream_t *stream, const uint8_t *data, size_t size) {
+    stream->data = data;
+    stream->size = size;
+    stream->last_poc = -1;
+    stream->decoder = twig_h264_decoder_init(cedar);
+    if (!stream->decoder) {
+        printf("Failed to initialize H.264 decoder\n");
+        return -1;
+    }
+
+    for (int i = 0; i < BITSTREAM_SLOTS; i++) {
+        stream->slots[i] = twig_alloc_mem(cedar, size);
+        if (!stream->slots[i]) {
+            printf("Failed to allocate bitstream buffer\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_stream(twig_dev_t *cedar, stream_t *stream) {
+    for (int i = 0; i < BITSTREAM_SLOTS; i++)
+        twig_free_mem(cedar, stream->slots[i]);
+    twig_h264_decoder_destroy(stream->decoder);
+    memset(stream, 0, sizeof(*stream));
+}
+
+// Feed the stream until its buffers are all in flight, like a camera's network socket would
+static void feed_stream(stream_t *stream, int loops) {
+    while (stream->loop < loops && twig_h264_get_pending(stream->decoder) < BITSTREAM_SLOTS) {
+        size_t end = next_access_unit(stream->data, stream->size, stream->pos);
+        twig_mem_t *slot = stream->slots[stream->submitted % BITSTREAM_SLOTS];
+        memcpy(slot->virt_addr, stream->data + stream->pos, end - stream->pos);
+        twig_flush_range(slot, 0, end - stream->pos);
+        if (twig_h264_submit(stream->decoder, slot, end - stream->pos) < 0)
+            break;
+
+        stream->submitted++;
+        stream->pos = end;
+        if (stream->pos >= stream->size) {
+            stream->pos = 0;
+            stream->loop++;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int stream_count = atoi(argv[1]);
+    int loops = atoi(argv[2]);
+    int live = strcmp(argv[3], "live") == 0;
+    char **files = argv + 3 + live;
+    int file_count = argc - 3 - live;
+    if (stream_count < 1 || stream_count > MAX_STREAMS || loops < 1 || file_count < 1 || file_count > MAX_FILES) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    uint8_t *file_data[MAX_FILES];
+    size_t file_size[MAX_FILES];
+    int droppable[MAX_FILES] = { 0 };
+    int total_units = 0;
+    for (int i = 0; i < file_count; i++) {
+        if (load_file_to_memory(files[i], &file_data[i], &file_size[i]) < 0)
+            return 1;
+        for (size_t pos = 0; pos < file_size[i]; pos = next_access_unit(file_data[i], file_size[i], pos)) {
+            total_units += (stream_count + file_count - 1 - i) / file_count * loops;
+            droppable[i] += is_droppable(file_data[i], file_size[i], pos);
+        }
+    }
+
+    twig_dev_t *cedar = twig_open();
+    if (!cedar) {
+        printf("Failed to initialize Cedar VE\n");
+        return 1;
+    }
+
+    const char *backend = getenv("TWIG_BACKEND");
+    int is_sim = backend && strcmp(backend, "sim") == 0;
+    if (is_sim)
+        twig_sim_set_latency(cedar, 200, 0); // Slow enough that every stream has something queued when the VE frees up
+
+    int seen_size = total_units + BITSTREAM_SLOTS + 1; // Room for the camera that goes away too
+    uint8_t *seen = calloc(seen_size, 1);
+    stream_t streams[MAX_STREAMS] = { 0 }, gone = { 0 };
+    struct pollfd pfds[MAX_STREAMS];
+    twig_mem_t *frame;
+    int frames = 0, submitted = 0, dropped = 0, errors = 0;
+    if (!seen)
+        goto out;
+
+    for (int i = 0; i < stream_count; i++) {
+        if (open_stream(cedar, &streams[i], file_data[i % file_count], file_size[i % file_count]) < 0)
+            goto out;
+        if (i == 0)
+            twig_h264_decoder_set_weight(streams[i].decoder, 3); // The "main" stream, gets more of the VE than the rest
+        if (live)
+            twig_h264_decoder_set_target_fps(streams[i].decoder, LIVE_FPS);
+        streams[i].droppable = droppable[i % file_count] * loops;
+        pfds[i].fd = twig_h264_get_fd(streams[i].decoder);
+        pfds[i].events = POLLIN;
+    }
+
+    // A camera that decodes a little and goes away again, the others must not lose the VE along with it
+    if (open_stream(cedar, &gone, file_data[0], file_size[0]) < 0) {
+        close_stream(cedar, &gone);
+        goto out;
+    }
+    feed_stream(&gone, 1);
+    while ((frame = twig_h264_flush(gone.decoder))) {
+        if (is_sim && !check_frame(&gone, frame, seen, seen_size))
+            errors++;
+        twig_h264_return_frame(gone.decoder, frame);
+    }
+    close_stream(cedar, &gone);
+
+    int running = stream_count;
+    while (running > 0) {
+        for (int i = 0; i < stream_count; i++)
+            feed_stream(&streams[i], loops);
+
+        if (poll(pfds, stream_count, 5000) <= 0) {
+            printf("Timed out waiting for the decoders\n");
+            break;
+        }
+
+        running = 0;
+        for (int i = 0; i < stream_count; i++) {
+            stream_t *stream = &streams[i];
+            int ret;
+            while ((ret = twig_h264_poll(stream->decoder, &frame)) != 0) {
+                if (ret < 0) {
+                    errors++;
+                    continue;
+                }
+                stream->frames++;
+                if (is_sim && !check_frame(stream, frame, seen, seen_size))
+                    errors++;
+                twig_h264_return_frame(stream->decoder, frame); // This side would be recording or displaying it
+            }
+            running += (stream->loop < loops || twig_h264_get_pending(stream->decoder) > 0);
+        }
+    }
+
+    for (int i = 0; i < stream_count; i++) { // End of every stream, out comes whatever waits for reordering
+        stream_t *stream = &streams[i];
+        while ((frame = twig_h264_flush(stream->decoder))) {
+            stream->frames++;
+            if (is_sim && !check_frame(stream, frame, seen, seen_size))
+                errors++;
+            twig_h264_return_frame(stream->decoder, frame);
+        }
+        twig_stream_stats_t stats;
+        twig_h264_get_stream_stats(stream->decoder, &stats);
+        if (stream->frames + (int)stats.dropped != stream->submitted || stats.decoded + stats.dropped != (uint64_t)stream->submitted) {
+            printf("Stream %d decoded %d frames and dropped %d from %d access units\n", i, stream->frames, (int)stats.dropped, stream->submitted);
+            errors++;
+        }
+        if ((int)stats.dropped > stream->droppable) {
+            printf("Stream %d dropped %d pictures but only %d were non-reference\n", i, (int)stats.dropped, stream->droppable);
+            errors++;
+        }
+        frames += stream->frames;
+        submitted += stream->submitted;
+        dropped += stats.dropped;
+    }
+    printf("Decoded %d frames from %d access units across %d streams, %d dropped, %d errors\n", frames, submitted, stream_count, dropped, errors);
+    if (live && is_sim && dropped == 0) { // Way past what the sim can do, something should have given
+        printf("Overloaded live streams never dropped anything\n");
+        errors++;
+    }
+    if (!live && dropped) {
+        printf("Streams without deadlines dropped pictures\n");
+        errors++;
+    }
+
+out:
+    for (int i = 0; i < stream_count; i++)
+        close_stream(cedar, &streams[i]);
+    twig_close(cedar);
+    free(seen);
+    for (int i = 0; i < file_count; i++)
+        munmap(file_data[i], file_size[i]);
+
+    return (frames > 0 && frames + dropped == submitted && errors == 0) ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include <time.h>
+#include "twig.h"
+#include "twig_scan.h"
+
+#define BENCH_SIZE (8 * 1024 * 1024)
+
+static void print_usage(const char *prog_name) {
+    printf("Usage: %s [passes]\n", prog_name);
+    printf("  passes          - Optional: how many times to scan the %d MB benchmark buffer (default 20)\n", BENCH_SIZE >> 20);
+}
+
+static uint32_t rng_state = 0x1234567;
+static uint32_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// Slice-like noise with the odd zero run, start codes of both lengths, and near misses like 00 00 02
+static void fill_stream(uint8_t *data, int len, int nal_spacing) {
+    for (int i = 0; i < len; i++)
+        data[i] = rng_next();
+
+    for (int i = 0; i + 4 < len; i += 1 + rng_next() % nal_spacing) {
+        switch (rng_next() % 4) {
+            case 0: memcpy(data + i, "\x00\x00\x01", 3); break;
+            case 1: memcpy(data + i, "\x00\x00\x00\x01", 4); break;
+            case 2: memcpy(data + i, "\x00\x00\x03", 3); break;
+            default: memset(data + i, 0, 2 + rng_next() % 3); break;
+        }
+    }
+}
+
+// Every start position on small buffers, so the block edges and the tails all get hit
+static int check_scanners(const twig_scanner_t *scanners, int count) {
+    uint8_t data[256];
+    for (int round = 0; round < 2000; round++) {
+        int len = rng_next() % sizeof(data);
+        fill_stream(data, len, 2 + round % 64);
+        for (int start = 0; start <= len; start++) {
+            int expected = scanners[0].find(data, len, start);
+            for (int i = 1; i < count; i++) {
+                int got = scanners[i].find(data, len, start);
+                if (got != expected) {
+                    printf("MISMATCH: %s returned %d, scalar returned %d (len %d, start %d)\n",
+                           scanners[i].name, got, expected, len, start);
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && argv[1][0] == '-') {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int passes = (argc > 1) ? atoi(argv[1]) : 20;
+    if (passes < 1)
+        passes = 1;
+
+    int count;
+    const twig_scanner_t *scanners = twig_get_scanners(&count);
+    printf("Start code scanners: ");
+    for (int i = 0; i < count; i++)
+        printf("%s%s", scanners[i].name, (i == count - 1) ? " (selected)\n" : ", ");
+
+    if (check_scanners(scanners, count) < 0)
+        return 1;
+    printf("All scanners agree with scalar\n");
+
+    uint8_t *data = malloc(BENCH_SIZE);
+    if (!data)
+        return 1;
+    fill_stream(data, BENCH_SIZE, 256 * 1024); // A few start codes per MB, like a high-bitrate I-frame
+
+    double scalar_time = 0;
+    for (int i = 0; i < count; i++) {
+        int nals = 0;
+        double t = now_sec();
+        for (int pass = 0; pass < passes; pass++) {
+            for (int pos = scanners[i].find(data, BENCH_SIZE, 0); pos < BENCH_SIZE; pos = scanners[i].find(data, BENCH_SIZE, pos))
+                nals++;
+        }
+        t = now_sec() - t;
+        if (i == 0)
+            scalar_time = t;
+
+        printf("%-8s %8.1f MB/s  %6.2fx  (%d NALs)\n", scanners[i].name,
+               (double)BENCH_SIZE * passes / t / (1024 * 1024), scalar_time / t, nals / passes);
+    }
+
+    free(data);
+    return 0;
+}
\ No newline at end of file